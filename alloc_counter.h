@@ -0,0 +1,46 @@
+/*! \file alloc_counter.h
+ *  \brief Debug counter of the heap allocations made by the current thread
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Build with -DKEYTAP_COUNT_ALLOCATIONS (cmake -DKEYTAP_COUNT_ALLOCATIONS=ON) to replace the global operator new
+// with a counting one. The replacement is program-wide, so this header must be included in only one translation
+// unit. Without the define, the counter is always zero and costs nothing.
+
+#ifdef KEYTAP_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+static thread_local uint64_t g_nAllocations = 0;
+
+void * operator new(std::size_t n) {
+    ++g_nAllocations;
+    if (void * p = std::malloc(n == 0 ? 1 : n)) return p;
+    throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t n) {
+    ++g_nAllocations;
+    if (void * p = std::malloc(n == 0 ? 1 : n)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete[](void * p) noexcept { std::free(p); }
+void operator delete(void * p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void * p, std::size_t) noexcept { std::free(p); }
+
+static constexpr bool kCountAllocations = true;
+static uint64_t getAllocationCount() { return g_nAllocations; }
+
+#else
+
+static constexpr bool kCountAllocations = false;
+static uint64_t getAllocationCount() { return 0; }
+
+#endif
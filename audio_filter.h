@@ -0,0 +1,157 @@
+/*! \file audio_filter.h
+ *  \brief Block-based biquad filter bank for pre-filtering captured audio
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct BiquadCoefficients {
+    float b0 = 1.0f;
+    float b1 = 0.0f;
+    float b2 = 0.0f;
+    float a1 = 0.0f;
+    float a2 = 0.0f;
+};
+
+// RBJ audio EQ cookbook designs, normalized so that a0 = 1
+
+static BiquadCoefficients makeBiquad(double b0, double b1, double b2, double a0, double a1, double a2) {
+    BiquadCoefficients res;
+    res.b0 = b0/a0;
+    res.b1 = b1/a0;
+    res.b2 = b2/a0;
+    res.a1 = a1/a0;
+    res.a2 = a2/a0;
+    return res;
+}
+
+static BiquadCoefficients makeHighPass(double sampleRate, double f0, double Q = M_SQRT1_2) {
+    double w0 = 2.0*M_PI*f0/sampleRate;
+    double cw = std::cos(w0);
+    double alpha = std::sin(w0)/(2.0*Q);
+    return makeBiquad(0.5*(1.0 + cw), -(1.0 + cw), 0.5*(1.0 + cw), 1.0 + alpha, -2.0*cw, 1.0 - alpha);
+}
+
+static BiquadCoefficients makeLowPass(double sampleRate, double f0, double Q = M_SQRT1_2) {
+    double w0 = 2.0*M_PI*f0/sampleRate;
+    double cw = std::cos(w0);
+    double alpha = std::sin(w0)/(2.0*Q);
+    return makeBiquad(0.5*(1.0 - cw), 1.0 - cw, 0.5*(1.0 - cw), 1.0 + alpha, -2.0*cw, 1.0 - alpha);
+}
+
+// constant 0 dB peak gain
+static BiquadCoefficients makeBandPass(double sampleRate, double f0, double Q = M_SQRT1_2) {
+    double w0 = 2.0*M_PI*f0/sampleRate;
+    double cw = std::cos(w0);
+    double alpha = std::sin(w0)/(2.0*Q);
+    return makeBiquad(alpha, 0.0, -alpha, 1.0 + alpha, -2.0*cw, 1.0 - alpha);
+}
+
+class AudioFilter {
+    public:
+        using Sample = float;
+
+        static constexpr int kBlockSize = 256;
+
+        bool addSection(const BiquadCoefficients & coefficients) {
+            sections_.push_back(coefficients);
+            states_.push_back(State());
+            return true;
+        }
+
+        // comma-separated list of sections:
+        //   hp:F[:Q]             - high-pass at F Hz
+        //   lp:F[:Q]             - low-pass at F Hz
+        //   bp:F[:Q]             - band-pass centered at F Hz
+        //   bq:b0:b1:b2:a1:a2    - raw normalized coefficients
+        bool addSections(const std::string & spec, double sampleRate) {
+            size_t pos = 0;
+            while (pos < spec.size()) {
+                auto end = spec.find(',', pos);
+                if (end == std::string::npos) end = spec.size();
+                auto section = spec.substr(pos, end - pos);
+                pos = end + 1;
+
+                std::vector<double> args;
+                auto type = section.substr(0, section.find(':'));
+                for (size_t p = section.find(':'); p != std::string::npos; p = section.find(':', p + 1)) {
+                    args.push_back(std::atof(section.c_str() + p + 1));
+                }
+
+                if ((type == "hp" || type == "lp" || type == "bp") && (args.size() == 1 || args.size() == 2)) {
+                    double f0 = args[0];
+                    double Q = args.size() > 1 ? args[1] : M_SQRT1_2;
+                    if (f0 <= 0.0 || f0 >= 0.5*sampleRate || Q <= 0.0) {
+                        fprintf(stderr, "Invalid filter section '%s'\n", section.c_str());
+                        return false;
+                    }
+                    if (type == "hp") addSection(makeHighPass(sampleRate, f0, Q));
+                    if (type == "lp") addSection(makeLowPass(sampleRate, f0, Q));
+                    if (type == "bp") addSection(makeBandPass(sampleRate, f0, Q));
+                } else if (type == "bq" && args.size() == 5) {
+                    BiquadCoefficients c;
+                    c.b0 = args[0];
+                    c.b1 = args[1];
+                    c.b2 = args[2];
+                    c.a1 = args[3];
+                    c.a2 = args[4];
+                    addSection(c);
+                } else {
+                    fprintf(stderr, "Unknown filter section '%s'\n", section.c_str());
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        bool empty() const { return sections_.empty(); }
+        int nSections() const { return sections_.size(); }
+
+        void reset() {
+            for (auto & state : states_) state = State();
+        }
+
+        // in-place, the filter state is carried over to the next call
+        void process(Sample * samples, int64_t n) {
+            for (int64_t i0 = 0; i0 < n; i0 += kBlockSize) {
+                int nBlock = std::min<int64_t>(kBlockSize, n - i0);
+                for (int is = 0; is < (int) sections_.size(); ++is) {
+                    processSection(sections_[is], states_[is], samples + i0, nBlock);
+                }
+            }
+        }
+
+    private:
+        struct State {
+            float z1 = 0.0f;
+            float z2 = 0.0f;
+        };
+
+        // transposed direct form II - the recursion is serial in time, so the block is run
+        // one section at a time with the coefficients and the state kept in registers
+        static void processSection(const BiquadCoefficients & c, State & state, Sample * x, int n) {
+            const float b0 = c.b0, b1 = c.b1, b2 = c.b2, a1 = c.a1, a2 = c.a2;
+            float z1 = state.z1;
+            float z2 = state.z2;
+            for (int i = 0; i < n; ++i) {
+                float xi = x[i];
+                float yi = b0*xi + z1;
+                z1 = b1*xi - a1*yi + z2;
+                z2 = b2*xi - a2*yi;
+                x[i] = yi;
+            }
+            state.z1 = z1;
+            state.z2 = z2;
+        }
+
+        std::vector<BiquadCoefficients> sections_;
+        std::vector<State> states_;
+};
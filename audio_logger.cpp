@@ -9,6 +9,7 @@
 #include <SDL_audio.h>
 
 #include <mutex>
+#include <chrono>
 #include <algorithm>
 
 namespace {
@@ -31,6 +32,8 @@ struct AudioLogger::Data {
     //SDL_AudioDeviceID deviceIdOut = 0;
 
     Callback callback = nullptr;
+    Filter filter = nullptr;
+    ThreadInit threadInit = nullptr;
 
     int64_t sampleRate = kMaxSampleRate;
 
@@ -39,8 +42,12 @@ struct AudioLogger::Data {
 
     int32_t bufferId = 0;
     std::array<Frame, getBufferSize_frames(kMaxSampleRate, kMaxBufferSize_s)> buffer;
+    std::array<FrameStamp, getBufferSize_frames(kMaxSampleRate, kMaxBufferSize_s)> bufferStamps;
+
+    int64_t nSamplesCaptured = 0;
 
     Record record;
+    Stamps recordStamps;
 
     std::mutex mutex;
 };
@@ -139,13 +146,26 @@ bool AudioLogger::addFrame(const Sample * stream) {
 
     std::lock_guard<std::mutex> lock(data.mutex);
 
+    if (data.threadInit) {
+        data.threadInit();
+        data.threadInit = nullptr;
+    }
+
+    auto & curStamp = data.bufferStamps[data.bufferId];
+    curStamp.sampleIndex = data.nSamplesCaptured;
+    curStamp.time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    data.nSamplesCaptured += kSamplesPerFrame;
+
     auto & curFrame = data.buffer[data.bufferId];
     std::copy(stream, stream + kSamplesPerFrame, curFrame.data());
+    if (data.filter) data.filter(curFrame.data(), curFrame.size());
     if (data.nFramesToRecord > 0) {
         data.record.push_back(curFrame);
+        data.recordStamps.push_back(curStamp);
         if (--data.nFramesToRecord == 0) {
             if (data.callback) data.callback(data.record);
             data.record.clear();
+            data.recordStamps.clear();
         }
     }
     if (++data.bufferId >= (int) data.buffer.size()) {
@@ -169,6 +189,7 @@ bool AudioLogger::record(float bufferSize_s) {
         if (fStart < 0) fStart += data.buffer.size();
         for (size_t i = 0; i < 2 - 1; ++i) {
             data.record.push_back(data.buffer[(fStart + i)%data.buffer.size()]);
+            data.recordStamps.push_back(data.bufferStamps[(fStart + i)%data.buffer.size()]);
         }
     }
 
@@ -191,6 +212,7 @@ bool AudioLogger::recordSym(float bufferSize_s) {
         if (fStart < 0) fStart += data.buffer.size();
         for (size_t i = 0; i < bufferSize_frames - 1; ++i) {
             data.record.push_back(data.buffer[(fStart + i)%data.buffer.size()]);
+            data.recordStamps.push_back(data.bufferStamps[(fStart + i)%data.buffer.size()]);
         }
     }
 
@@ -199,6 +221,28 @@ bool AudioLogger::recordSym(float bufferSize_s) {
     return true;
 }
 
+bool AudioLogger::setFilter(Filter filter) {
+    auto & data = getData();
+
+    std::lock_guard<std::mutex> lock(data.mutex);
+    data.filter = std::move(filter);
+
+    return true;
+}
+
+bool AudioLogger::setThreadInit(ThreadInit init) {
+    auto & data = getData();
+
+    std::lock_guard<std::mutex> lock(data.mutex);
+    data.threadInit = std::move(init);
+
+    return true;
+}
+
+const AudioLogger::Stamps & AudioLogger::getRecordStamps() const {
+    return data_->recordStamps;
+}
+
 bool AudioLogger::pause() {
     auto & data = getData();
     SDL_PauseAudioDevice(data.deviceIdIn, 1);
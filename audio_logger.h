@@ -9,6 +9,7 @@
 
 #include <memory>
 #include <array>
+#include <cstdint>
 #include <vector>
 #include <functional>
 
@@ -18,6 +19,14 @@ class AudioLogger {
         using Frame = std::array<Sample, kSamplesPerFrame>;
         using Record = std::vector<Frame>;
         using Callback = std::function<void(const Record & frames)>;
+        using Filter = std::function<void(Sample * samples, int64_t n)>;
+        using ThreadInit = std::function<void()>;
+
+        struct FrameStamp {
+            int64_t sampleIndex = 0;    // index of the first sample of the frame, counted from install()
+            int64_t time_us = 0;        // steady clock time at which the frame was captured
+        };
+        using Stamps = std::vector<FrameStamp>;
 
         AudioLogger();
         ~AudioLogger();
@@ -28,6 +37,15 @@ class AudioLogger {
         bool record(float bufferSize_s);
         bool recordSym(float bufferSize_s);
 
+        // applied in-place to every captured frame before it is buffered
+        bool setFilter(Filter filter);
+
+        // called once on the capture thread, before the next captured frame is processed
+        bool setThreadInit(ThreadInit init);
+
+        // stamps of the frames passed to the callback, valid only while the callback runs
+        const Stamps & getRecordStamps() const;
+
         bool pause();
         bool resume();
 
@@ -0,0 +1,53 @@
+/*! \file bench_filter.cpp
+ *  \brief Throughput benchmark for the biquad pre-filter stage
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "audio_filter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s [nSeconds]\n", argv[0]);
+
+    int nSeconds = argc > 1 ? atoi(argv[1]) : 600;
+    if (nSeconds <= 0) nSeconds = 600;
+
+    const int64_t n = (int64_t) nSeconds*kSampleRate;
+
+    std::vector<AudioFilter::Sample> data(n);
+    srand(1234);
+    for (auto & s : data) s = 2.0f*((float) rand())/RAND_MAX - 1.0f;
+
+    const char * specs[] = {
+        "hp:100",
+        "hp:80,bp:3000:0.5",
+        "hp:80,hp:80,lp:8000,lp:8000",
+    };
+
+    const int blockSizes[] = { 64, kSamplesPerFrame, 64*1024 };
+
+    printf("[+] Filtering %d seconds of audio (%d samples)\n", nSeconds, (int) n);
+    for (auto spec : specs) {
+        for (auto blockSize : blockSizes) {
+            AudioFilter filter;
+            filter.addSections(spec, kSampleRate);
+
+            auto buf = data;
+            auto tStart = std::chrono::high_resolution_clock::now();
+            for (int64_t i = 0; i < n; i += blockSize) {
+                filter.process(buf.data() + i, std::min<int64_t>(blockSize, n - i));
+            }
+            auto tEnd = std::chrono::high_resolution_clock::now();
+
+            double sec = std::chrono::duration<double>(tEnd - tStart).count();
+            printf("    %-28s sections = %d, block = %6d : %8.2f Msamples/s (%6.0fx real-time)\n",
+                   spec, filter.nSections(), blockSize, 1e-6*n/sec, n/sec/kSampleRate);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*! \file bench_pca.cpp
+ *  \brief Memory, speed and accuracy of matching in the reduced template space compared to the full templates
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "audio_filter.h"
+#include "training_data.h"
+#include "key_pca.h"
+
+#include <chrono>
+#include <cstdio>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s test.kbd train.kbd [train2.kbd ...]\n", argv[0]);
+    printf("    The training files are used to build the templates and the basis,\n");
+    printf("    the presses in test.kbd are matched with the full templates and in the reduced space\n");
+    printf("\n");
+
+    if (argc < 3) {
+        return -127;
+    }
+
+    const int kAlignWindow = 64;
+    const std::vector<int> kRanks = { 4, 8, 16, 32, 64 };
+
+    AudioFilter filter;
+
+    std::map<TKey, TKeyHistory> histories;
+    TrainingDataStats stats;
+    if (loadTrainingData(std::vector<std::string>(argv + 2, argv + argc), filter, histories, stats) == false) {
+        return -1;
+    }
+    printf("[+] Training on %d presses of %d keys\n", stats.nRecords, stats.nKeys);
+
+    std::map<TKey, TrainResult> results;
+    trainKeys(histories, results);
+
+    std::map<TKey, TKeyWaveform> templates;
+    for (auto & kr : results) {
+        if (kr.second.average.empty()) continue;
+        templates[kr.first] = std::move(kr.second.average);
+    }
+
+    std::map<TKey, TKeyHistory> test;
+    if (loadTrainingData({ argv[1] }, filter, test, stats) == false) {
+        return -1;
+    }
+    printf("[+] Testing on %d presses of %d keys, %d templates\n", stats.nRecords, stats.nKeys, (int) templates.size());
+
+    struct Press {
+        TKey key;
+        const TKeyWaveform * waveform;
+        int pos;
+        TKey best;
+    };
+
+    // the press is at the peak of the middle frame, as found by the detection in keytap
+    std::vector<Press> presses;
+    for (const auto & kh : test) {
+        for (const auto & waveform : kh.second) {
+            int pos = 2*kSamplesPerFrame;
+            for (int i = 2*kSamplesPerFrame; i < 3*kSamplesPerFrame; ++i) {
+                if (std::abs(waveform[i]) > std::abs(waveform[pos])) pos = i;
+            }
+            presses.push_back({ kh.first, &waveform, pos, -1 });
+        }
+    }
+    if (presses.empty()) {
+        printf("No test presses\n");
+        return -3;
+    }
+
+    int nCorrect = 0;
+    auto tStart = std::chrono::high_resolution_clock::now();
+    for (auto & press : presses) {
+        TKeyPrediction res;
+        predictKeyPress(templates, *press.waveform, press.pos, kAlignWindow, 1, res);
+        press.best = res.key;
+        if (res.key == press.key) ++nCorrect;
+    }
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    double msExhaustive = std::chrono::duration<double, std::milli>(tEnd - tStart).count()/presses.size();
+
+    printf("\n");
+    printf("    full templates    : %6.3f ms/press, accuracy = %5.1f%%\n", msExhaustive, (100.0*nCorrect)/presses.size());
+
+    for (auto rank : kRanks) {
+        KeyPCA pca;
+        tStart = std::chrono::high_resolution_clock::now();
+        if (pca.train(histories, templates, rank) == false) {
+            printf("Failed to compute the basis\n");
+            return -2;
+        }
+        tEnd = std::chrono::high_resolution_clock::now();
+        double msTrain = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+
+        const auto & statsPCA = pca.stats();
+
+        int nAgree = 0;
+        nCorrect = 0;
+        tStart = std::chrono::high_resolution_clock::now();
+        for (const auto & press : presses) {
+            TKeyPrediction res;
+            pca.predict(templates, *press.waveform, press.pos, kAlignWindow, res);
+            if (res.key == press.best) ++nAgree;
+            if (res.key == press.key) ++nCorrect;
+        }
+        tEnd = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count()/presses.size();
+
+        printf("    rank %2d           : %6.3f ms/press, accuracy = %5.1f%%, same key as full = %5.1f%%, "
+               "energy kept = %5.1f%%, memory = %6.1f kB (full %6.1f kB), basis in %g ms\n",
+               statsPCA.rank, ms, (100.0*nCorrect)/presses.size(), (100.0*nAgree)/presses.size(), 100.0*statsPCA.explained,
+               (statsPCA.nBytesBasis + statsPCA.nBytesTemplates)/1024.0, statsPCA.nBytesFull/1024.0, msTrain);
+    }
+
+    return 0;
+}
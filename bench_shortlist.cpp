@@ -0,0 +1,126 @@
+/*! \file bench_shortlist.cpp
+ *  \brief Recall and speed of the spectral key shortlist compared to matching all templates
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "audio_filter.h"
+#include "training_data.h"
+#include "key_features.h"
+
+#include <chrono>
+#include <cstdio>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s test.kbd train.kbd [train2.kbd ...]\n", argv[0]);
+    printf("    The training files are used to build the templates and the key features,\n");
+    printf("    the presses in test.kbd are matched with and without the shortlist\n");
+    printf("\n");
+
+    if (argc < 3) {
+        return -127;
+    }
+
+    const int kAlignWindow = 64;
+    const std::vector<int> kShortlistSizes = { 1, 2, 3, 5, 8, 12 };
+
+    AudioFilter filter;
+
+    std::map<TKey, TKeyHistory> histories;
+    TrainingDataStats stats;
+    if (loadTrainingData(std::vector<std::string>(argv + 2, argv + argc), filter, histories, stats) == false) {
+        return -1;
+    }
+    printf("[+] Training on %d presses of %d keys\n", stats.nRecords, stats.nKeys);
+
+    std::map<TKey, TrainResult> results;
+    trainKeys(histories, results);
+
+    std::map<TKey, TKeyWaveform> templates;
+    for (auto & kr : results) {
+        if (kr.second.average.empty()) continue;
+        templates[kr.first] = std::move(kr.second.average);
+    }
+
+    KeyShortlist shortlistPresses;
+    KeyShortlist shortlistTemplates;
+    if (shortlistPresses.build(histories) == false || shortlistTemplates.build(templates) == false) {
+        printf("Failed to compute the key features\n");
+        return -2;
+    }
+
+    std::map<TKey, TKeyHistory> test;
+    if (loadTrainingData({ argv[1] }, filter, test, stats) == false) {
+        return -1;
+    }
+    printf("[+] Testing on %d presses of %d keys, %d templates\n", stats.nRecords, stats.nKeys, (int) templates.size());
+
+    struct Press {
+        TKey key;
+        const TKeyWaveform * waveform;
+        int pos;
+        TKey best;
+    };
+
+    // the press is at the peak of the middle frame, as found by the detection in keytap
+    std::vector<Press> presses;
+    for (const auto & kh : test) {
+        for (const auto & waveform : kh.second) {
+            int pos = 2*kSamplesPerFrame;
+            for (int i = 2*kSamplesPerFrame; i < 3*kSamplesPerFrame; ++i) {
+                if (std::abs(waveform[i]) > std::abs(waveform[pos])) pos = i;
+            }
+            presses.push_back({ kh.first, &waveform, pos, -1 });
+        }
+    }
+    if (presses.empty()) {
+        printf("No test presses\n");
+        return -3;
+    }
+
+    int nCorrect = 0;
+    auto tStart = std::chrono::high_resolution_clock::now();
+    for (auto & press : presses) {
+        TKeyPrediction res;
+        predictKeyPress(templates, *press.waveform, press.pos, kAlignWindow, 1, res);
+        press.best = res.key;
+        if (res.key == press.key) ++nCorrect;
+    }
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    double msExhaustive = std::chrono::duration<double, std::milli>(tEnd - tStart).count()/presses.size();
+
+    printf("\n");
+    printf("    all keys          : %6.3f ms/press, accuracy = %5.1f%%\n", msExhaustive, (100.0*nCorrect)/presses.size());
+
+    for (int pass = 0; pass < 2; ++pass) {
+        const auto & shortlist = pass == 0 ? shortlistPresses : shortlistTemplates;
+        printf("\n");
+        printf("    centroids of the %s:\n", pass == 0 ? "training presses" : "templates");
+
+        for (auto k : kShortlistSizes) {
+            int nHits = 0;
+            nCorrect = 0;
+
+            std::vector<TKey> keys;
+            tStart = std::chrono::high_resolution_clock::now();
+            for (const auto & press : presses) {
+                TKeyFeatures features;
+                if (calcKeyFeatures(*press.waveform, press.pos, features) == false) continue;
+                shortlist.shortlist(features, k, keys);
+
+                TKeyPrediction res;
+                predictKeyPress(templates, *press.waveform, press.pos, kAlignWindow, 1, res, 0, &keys);
+                if (std::find(keys.begin(), keys.end(), press.best) != keys.end()) ++nHits;
+                if (res.key == press.key) ++nCorrect;
+            }
+            tEnd = std::chrono::high_resolution_clock::now();
+            double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count()/presses.size();
+
+            printf("    top %2d            : %6.3f ms/press, accuracy = %5.1f%%, recall vs all keys = %5.1f%%\n",
+                   k, ms, (100.0*nCorrect)/presses.size(), (100.0*nHits)/presses.size());
+        }
+    }
+
+    return 0;
+}
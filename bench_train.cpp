@@ -0,0 +1,85 @@
+/*! \file bench_train.cpp
+ *  \brief Benchmark for trainKey on keys with many recorded presses
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+// synthetic key press: a decaying burst at a random position plus background noise
+static TKeyHistory generateHistory(int nPresses, std::mt19937 & rng) {
+    std::normal_distribution<float> noise(0.0f, 0.01f);
+    std::uniform_int_distribution<int> shift(-200, 200);
+
+    TKeyHistory res(nPresses);
+    for (auto & waveform : res) {
+        waveform.resize(kSamplesPerWaveform);
+        int i0 = kSamplesPerWaveform/2 + shift(rng);
+        for (int i = 0; i < kSamplesPerWaveform; ++i) {
+            float t = i - i0;
+            waveform[i] = noise(rng);
+            if (t >= 0.0f) waveform[i] += std::exp(-t/150.0f)*std::sin(0.31f*t + 0.002f*t*t);
+        }
+    }
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s [nThreads]\n", argv[0]);
+
+    int nThreads = argc > 1 ? atoi(argv[1]) : getNumThreads();
+    if (nThreads <= 0) nThreads = getNumThreads();
+
+    std::mt19937 rng(1234);
+
+    // the template must not depend on the number of threads - more threads than presses included
+    {
+        auto history = generateHistory(6, rng);
+        bool ok = true;
+        TrainResult ref;
+        for (int n : { 1, 2, 4, 16 }) {
+            auto cur = history;
+            TrainResult res;
+            trainKey('a', cur, res, n);
+            if (n == 1) {
+                ref = res;
+            } else if (res.average != ref.average || res.stats.nWaveformsUsed != ref.stats.nWaveformsUsed) {
+                printf("[!] trainKey with %d threads differs from the single-threaded result\n", n);
+                ok = false;
+            }
+        }
+        if (ok == false) return -1;
+        printf("[+] trainKey gives the same template with 1, 2, 4 and 16 threads\n");
+    }
+
+    printf("[+] Training a single key, %d thread(s)\n", nThreads);
+    for (int nPresses : { 25, 50, 100, 200, 400 }) {
+        auto history = generateHistory(nPresses, rng);
+
+        printf("    presses = %4d, pairs = %6d\n", nPresses, nPresses*(nPresses - 1)/2);
+        for (auto method : { TrainMethod::Pairwise, TrainMethod::AlignToMean }) {
+            auto cur = history;
+
+            TrainResult res;
+            auto tStart = std::chrono::high_resolution_clock::now();
+            if (method == TrainMethod::AlignToMean) {
+                trainKeyAlignToMean('a', cur, res, 4, nThreads);
+            } else {
+                trainKey('a', cur, res, nThreads);
+            }
+            auto tEnd = std::chrono::high_resolution_clock::now();
+
+            double ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+            printf("        %-8s : %10.2f ms, cc = %g, template cc = %g, used = %d\n",
+                   method == TrainMethod::AlignToMean ? "mean" : "pairwise", ms,
+                   res.stats.averageCC, res.templateCC, res.stats.nWaveformsUsed);
+        }
+    }
+
+    return 0;
+}
@@ -5,13 +5,18 @@
 
 #pragma once
 
+#include "constants.h"
 #include "audio_logger.h"
 
 #include <map>
+#include <algorithm>
+#include <vector>
 #include <string>
 #include <cstring>
+#include <cstdarg>
 #include <tuple>
 #include <cmath>
+#include <atomic>
 #include <thread>
 #include <mutex>
 
@@ -28,14 +33,76 @@ using TKeyWaveform = std::vector<AudioLogger::Sample>;
 using TKeyHistory = std::vector<TKeyWaveform>;
 using TKeyConfidenceMap = std::map<TKey, TConfidence>;
 
+struct TrainStats {
+    int nWaveformsUsed = 0;
+    int nWaveformsTotal = 0;
+    TValueCC averageCC = 0.0f;
+};
+
+// pairwise alignment of the waveforms of a key
+// cc is symmetric and offset is antisymmetric: (cc, offset) at [i][j] is (cc, -offset) at [j][i]
+struct TrainCCMatrix {
+    int n = 0;
+    std::vector<TValueCC> cc;
+    std::vector<int16_t> offset;
+
+    // keeps the allocated memory, so it can be reused between keys
+    void resize(int nWaveforms) {
+        n = nWaveforms;
+        cc.resize(n*n);
+        offset.resize(n*n);
+    }
+
+    void set(int i, int j, TValueCC c, TOffset o) {
+        cc[i*n + j] = c;
+        offset[i*n + j] = o;
+        cc[j*n + i] = c;
+        offset[j*n + i] = -o;
+    }
+
+    TValueCC getCC(int i, int j) const { return cc[i*n + j]; }
+    TOffset getOffset(int i, int j) const { return offset[i*n + j]; }
+};
+
+enum class TrainMethod {
+    Pairwise,       // align to the press that matches the others best - O(n^2)
+    AlignToMean,    // align to the running average for a few iterations - O(n*iterations)
+};
+
+struct TrainResult {
+    TKeyWaveform average;       // empty if the key was not trained
+    TrainStats stats;
+    TValueCC templateCC = 0.0f; // average CC of the aligned presses against the template
+    bool failed = false;
+    std::string log;
+};
+
 // helpers
 
-static std::map<std::string, std::string> parseCmdArguments(int argc, char ** argv) {
+// short options: -xVALUE, stored as res["x"]
+// long options:  --name=VALUE or --name VALUE, stored as res["name"]
+// flags:         --name, the long options listed in flags never take the next argument as their value
+inline bool isCmdFlag(const char * arg, const std::vector<std::string> & flags) {
+    for (const auto & flag : flags) if (flag == arg) return true;
+    return false;
+}
+
+inline std::map<std::string, std::string> parseCmdArguments(int argc, char ** argv, const std::vector<std::string> & flags = {}) {
     int last = argc;
     std::map<std::string, std::string> res;
     for (int i = 1; i < last; ++i) {
         if (argv[i][0] == '-') {
-            if (strlen(argv[i]) > 1) {
+            if (argv[i][1] == '-') {
+                std::string arg = argv[i] + 2;
+                auto eq = arg.find('=');
+                if (eq != std::string::npos) {
+                    res[arg.substr(0, eq)] = arg.substr(eq + 1);
+                } else if (i + 1 < last && argv[i + 1][0] != '-' && isCmdFlag(argv[i] + 2, flags) == false) {
+                    res[arg] = argv[++i];
+                } else {
+                    res[arg] = "";
+                }
+            } else if (strlen(argv[i]) > 1) {
                 res[std::string(1, argv[i][1])] = strlen(argv[i]) > 2 ? argv[i] + 2 : "";
             }
         }
@@ -44,6 +111,68 @@ static std::map<std::string, std::string> parseCmdArguments(int argc, char ** ar
     return res;
 }
 
+// arguments that are neither options nor values of long options, flags must be the same as for parseCmdArguments
+inline std::vector<std::string> parseCmdPositional(int argc, char ** argv, const std::vector<std::string> & flags = {}) {
+    std::vector<std::string> res;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-') {
+            if (argv[i][1] == '-' && strchr(argv[i], '=') == nullptr && isCmdFlag(argv[i] + 2, flags) == false &&
+                i + 1 < argc && argv[i + 1][0] != '-') ++i;
+            continue;
+        }
+        res.push_back(argv[i]);
+    }
+
+    return res;
+}
+
+inline bool parseTrainMethod(const std::string & name, TrainMethod & method) {
+    if (name.empty() || name == "pairwise") {
+        method = TrainMethod::Pairwise;
+    } else if (name == "mean") {
+        method = TrainMethod::AlignToMean;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static void appendf(std::string & s, const char * fmt, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    s += buf;
+}
+
+static int getNumThreads() {
+#ifdef __EMSCRIPTEN__
+    return 1;
+#else
+    return std::max(1u, std::thread::hardware_concurrency());
+#endif
+}
+
+// calls f(i) for i in [0, n), the indices are handed out to the threads in order
+template <typename F>
+static void parallelFor(int n, int nThreads, F && f) {
+    if (nThreads <= 1 || n <= 1) {
+        for (int i = 0; i < n; ++i) f(i);
+        return;
+    }
+
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers(std::min(nThreads, n));
+    for (auto & worker : workers) {
+        worker = std::thread([&]() {
+            for (int i = next++; i < n; i = next++) f(i);
+        });
+    }
+    for (auto & worker : workers) worker.join();
+}
+
 static std::tuple<TSum, TSum2> calcSum(const TKeyWaveform & waveform, int is0, int is1) {
     TSum sum = 0.0f;
     TSum2 sum2 = 0.0f;
@@ -94,11 +223,13 @@ static TValueCC calcCC(
     return cc;
 }
 
+// nWorkers = 1 searches the offsets serially, for callers that are already running in parallel
 std::tuple<TValueCC, TOffset> findBestCC(
     const TKeyWaveform & waveform0,
     const TKeyWaveform & waveform1,
     int is0, int is1,
-    int alignWindow) {
+    int alignWindow,
+    int nWorkers = 4) {
     TOffset besto = -1;
     TValueCC bestcc = -1.0f;
 
@@ -109,23 +240,24 @@ std::tuple<TValueCC, TOffset> findBestCC(
     auto sum02 = std::get<1>(ret);
 
 #ifdef __EMSCRIPTEN__
-    TOffset cbesto = -1;
-    TValueCC cbestcc = -1.0f;
+    nWorkers = 1;
+#else
+    nWorkers = std::min(nWorkers, (int) std::thread::hardware_concurrency());
+#endif
 
-    for (int o = -alignWindow; o < alignWindow; ++o) {
-        auto cc = calcCC(waveform0, waveform1, sum0, sum02, is00, is0 + o, is1 + o);
-        if (cc > cbestcc) {
-            cbesto = o;
-            cbestcc = cc;
+    if (nWorkers <= 1) {
+        for (int o = -alignWindow; o < alignWindow; ++o) {
+            auto cc = calcCC(waveform0, waveform1, sum0, sum02, is00, is0 + o, is1 + o);
+            if (cc > bestcc) {
+                besto = o;
+                bestcc = cc;
+            }
         }
-    }
 
-    if (cbestcc > bestcc) {
-        bestcc = cbestcc;
-        besto = cbesto;
+        return std::tuple<TValueCC, TOffset>(bestcc, besto);
     }
-#else
-    int nWorkers = std::min(4u, std::thread::hardware_concurrency());
+
+#ifndef __EMSCRIPTEN__
     std::mutex mutex;
     std::vector<std::thread> workers(nWorkers);
     for (int i = 0; i < workers.size(); ++i) {
@@ -156,3 +288,503 @@ std::tuple<TValueCC, TOffset> findBestCC(
 
     return std::tuple<TValueCC, TOffset>(bestcc, besto);
 }
+
+// res[i] = waveform[i + offset], zero outside of the waveform
+static TKeyWaveform shiftWaveform(const TKeyWaveform & waveform, int offset) {
+    TKeyWaveform res(kSamplesPerWaveform);
+    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
+        int iorg = icur + offset;
+
+        if (iorg >= 0 && iorg < kSamplesPerWaveform) {
+            res[icur] = waveform[iorg];
+        } else {
+            res[icur] = 0.0f;
+        }
+    }
+
+    return res;
+}
+
+// moves the peak of every waveform to the center sample
+static void centerWaveforms(TKeyHistory & history, std::string & log) {
+    int nWaveforms = history.size();
+
+    appendf(log, "    - Estimating waveform peaks ...\n");
+    std::vector<int> peakSum;
+    std::vector<int> peakMax;
+
+    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+        int isum = -1;
+        double asum = 0.0f;
+        double aisum = 0.0f;
+
+        int imax = -1;
+        double amax = 0.0f;
+
+        const auto & waveform = history[iwaveform];
+
+        for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
+            double acur = std::abs(waveform[icur]);
+            double acur2 = acur*acur;
+
+            asum += acur2;
+            aisum += acur2*icur;
+
+            if (acur > amax) {
+                amax = acur;
+                imax = icur;
+            }
+        }
+
+        isum = aisum/asum;
+
+        peakSum.push_back(isum);
+        peakMax.push_back(imax);
+    }
+
+    auto calcStdev = [](const std::vector<int> & data) {
+        double sum = 0.0f;
+        double sum2 = 0.0f;
+        for (const auto & p : data) {
+            sum += p;
+            sum2 += p*p;
+        }
+        sum /= data.size();
+        sum2 /= data.size();
+        return sqrt(sum2 - sum*sum);
+    };
+
+    double stdevSum = calcStdev(peakSum);
+    double stdevMax = calcStdev(peakMax);
+
+    appendf(log, "    - Stdev of estimated peaks: %g (sum) vs %g (max)\n", stdevSum, stdevMax);
+
+    const auto & peakUsed = peakMax;
+    appendf(log, "    - Using 'max' estimation\n");
+
+    int centerSample = kSamplesPerWaveform/2;
+
+    appendf(log, "    - Centering waveforms at sample %d\n", centerSample);
+    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+        int offset = peakUsed[iwaveform] - centerSample;
+
+        history[iwaveform] = shiftWaveform(history[iwaveform], offset);
+    }
+}
+
+// average CC of the aligned waveforms against the template, around the center sample
+static TValueCC calcTemplateCC(const TKeyHistory & history, const TKeyWaveform & average) {
+    int is0 = kSamplesPerWaveform/2 - kSamplesPerFrame;
+    int is1 = kSamplesPerWaveform/2 + kSamplesPerFrame;
+
+    auto ret = calcSum(average, is0, is1);
+
+    TValueCC res = 0.0f;
+    for (const auto & waveform : history) {
+        res += calcCC(average, waveform, std::get<0>(ret), std::get<1>(ret), is0, is0, is1);
+    }
+
+    return history.empty() ? 0.0f : res/history.size();
+}
+
+struct TKeyPrediction {
+    TKey key = -1;
+    TValueCC cc = -1.0f;
+    TOffset offset = 0;
+    TKeyConfidenceMap confidence;   // best CC of every template
+};
+
+// matches the key press at sample curPos of ampl against the templates
+// nCandidates > 0 prunes the templates first: all of them are compared only at zero offset and the offset search
+// runs just for the nCandidates best ones. The confidence of the pruned templates is their zero-offset CC.
+// keys, if given, restricts the matching to the templates of these keys, e.g. a shortlist from key_features.h
+inline void predictKeyPress(
+    const std::map<TKey, TKeyWaveform> & templates,
+    const TKeyWaveform & ampl,
+    int curPos,
+    int alignWindow,
+    int nWorkers,
+    TKeyPrediction & res,
+    int nCandidates = 0,
+    const std::vector<TKey> * keys = nullptr) {
+    int scmp0 = curPos - kSamplesPerFrame;
+    int scmp1 = curPos + kSamplesPerFrame;
+
+    res = TKeyPrediction();
+
+    std::vector<const std::pair<const TKey, TKeyWaveform> *> candidates;
+    if (keys) {
+        candidates.reserve(keys->size());
+        for (auto key : *keys) {
+            auto it = templates.find(key);
+            if (it != templates.end()) candidates.push_back(&*it);
+        }
+    } else {
+        candidates.reserve(templates.size());
+        for (const auto & ka : templates) candidates.push_back(&ka);
+    }
+
+    if (nCandidates > 0 && nCandidates < (int) candidates.size()) {
+        for (const auto & ka : candidates) {
+            const auto & waveform0 = ka->second;
+            int is00 = waveform0.size()/2 - (scmp1 - scmp0)/2;
+            auto ret = calcSum(waveform0, is00, is00 + scmp1 - scmp0);
+            res.confidence[ka->first] = calcCC(waveform0, ampl, std::get<0>(ret), std::get<1>(ret), is00, scmp0, scmp1);
+        }
+
+        std::partial_sort(candidates.begin(), candidates.begin() + nCandidates, candidates.end(),
+                          [&](const std::pair<const TKey, TKeyWaveform> * a, const std::pair<const TKey, TKeyWaveform> * b) {
+                              return res.confidence[a->first] > res.confidence[b->first];
+                          });
+        candidates.resize(nCandidates);
+    }
+
+    for (const auto & ka : candidates) {
+        auto ret = findBestCC(ka->second, ampl, scmp0, scmp1, alignWindow, nWorkers);
+        auto bestcc     = std::get<0>(ret);
+        auto bestoffset = std::get<1>(ret);
+
+        if (bestcc > res.cc) {
+            res.key = ka->first;
+            res.cc = bestcc;
+            res.offset = bestoffset;
+        }
+        res.confidence[ka->first] = bestcc;
+    }
+}
+
+// aligns the recorded waveforms of a key and averages them into a template
+// the pairwise alignments are split between nThreads threads, the result does not depend on nThreads
+// ccsBuffer, if given, holds the pairwise matrix, so that its memory is reused between the keys of one caller
+static bool trainKey(TKey key, TKeyHistory & history, TrainResult & res, int nThreads = 1, TrainCCMatrix * ccsBuffer = nullptr) {
+    res = TrainResult();
+    auto & log = res.log;
+
+    int nWaveforms = history.size();
+    int nFramesPerWaveform = kTrainBufferSize_frames;
+
+    appendf(log, "    - Training key '%c'\n", key);
+    appendf(log, "    - History size = %d key waveforms\n", nWaveforms);
+    appendf(log, "    - Frames per key waveform   = %d\n", nFramesPerWaveform);
+    appendf(log, "    - Total frames available    = %d\n", nWaveforms*nFramesPerWaveform);
+    appendf(log, "    - Samples per frame         = %d\n", (int) kSamplesPerFrame);
+    appendf(log, "    - Total samples available   = %d\n", (int) (nWaveforms*nFramesPerWaveform*kSamplesPerFrame));
+
+    centerWaveforms(history, log);
+
+    int centerSample = kSamplesPerWaveform/2;
+
+    int alignWindow = 64;
+    appendf(log, "    - Calculating CC pairs\n");
+    appendf(log, "      Align window = %d\n", alignWindow);
+
+    int bestw = -1;
+    int ntrain = 0;
+    double bestccsum = -1.0f;
+    double bestosum = 1e10;
+    // shared by the row threads below, each row writes its own pairs
+    TrainCCMatrix ccsLocal;
+    TrainCCMatrix & ccs = ccsBuffer ? *ccsBuffer : ccsLocal;
+    ccs.resize(nWaveforms);
+
+    {
+        int is0 = centerSample - kSamplesPerFrame;
+        int is1 = centerSample + kSamplesPerFrame;
+
+        // row alignToWaveform writes only the pairs (alignToWaveform, iwaveform > alignToWaveform) and their mirror
+        parallelFor(nWaveforms, nThreads, [&](int alignToWaveform) {
+            ccs.set(alignToWaveform, alignToWaveform, 1.0f, 0);
+
+            const auto & waveform0 = history[alignToWaveform];
+            for (int iwaveform = alignToWaveform + 1; iwaveform < nWaveforms; ++iwaveform) {
+                auto ret = findBestCC(waveform0, history[iwaveform], is0, is1, alignWindow, 1);
+                ccs.set(iwaveform, alignToWaveform, std::get<0>(ret), std::get<1>(ret));
+            }
+        });
+    }
+
+    for (int alignToWaveform = 0; alignToWaveform < nWaveforms; ++alignToWaveform) {
+        const TValueCC * rowCC = ccs.cc.data() + alignToWaveform*nWaveforms;
+        const int16_t * rowOffset = ccs.offset.data() + alignToWaveform*nWaveforms;
+
+        int curntrain = 0;
+        double curccsum = 0.0;
+        double curosum = 0.0;
+        for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+            // [iwaveform][alignToWaveform] via symmetry
+            TValueCC cc = rowCC[iwaveform];
+            int offset = rowOffset[iwaveform];
+
+            if (std::abs(offset) > 50) continue;
+            ++curntrain;
+            curccsum += cc*cc;
+            curosum += offset*offset;
+        }
+
+        if (curccsum > bestccsum) {
+            ntrain = curntrain;
+            bestw = alignToWaveform;
+            bestccsum = curccsum;
+            bestosum = curosum;
+        }
+    }
+    bestccsum = sqrt(bestccsum/ntrain);
+
+    res.stats.nWaveformsUsed = ntrain;
+    res.stats.nWaveformsTotal = nWaveforms;
+    res.stats.averageCC = bestccsum;
+
+    appendf(log, "    - Aligning all waveforms to waveform %d, (cost = %g)\n", bestw, bestccsum);
+    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+        if (iwaveform == bestw) continue;
+
+        history[iwaveform] = shiftWaveform(history[iwaveform], ccs.getOffset(iwaveform, bestw));
+    }
+
+    appendf(log, "    - Calculating average waveform\n");
+    double ccsum = 0.0f;
+    double norm = 0.0f;
+    auto & avgWaveform = res.average;
+    avgWaveform.resize(kSamplesPerWaveform);
+    std::fill(avgWaveform.begin(), avgWaveform.end(), 0.0f);
+    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+        TValueCC cc = ccs.getCC(iwaveform, bestw);
+        auto offset = ccs.getOffset(iwaveform, bestw);
+
+        appendf(log, "        Adding waveform %d - cc = %g, offset = %d\n", iwaveform, cc, offset);
+        ccsum += cc*cc;
+        norm += cc*cc;
+        auto & waveform = history[iwaveform];
+        for (int is = 0; is < kSamplesPerWaveform; ++is) {
+            avgWaveform[is] += cc*cc*waveform[is];
+        }
+    }
+
+    norm = 1.0f/(norm);
+    for (int is = 0; is < kSamplesPerWaveform; ++is) {
+        avgWaveform[is] *= norm;
+    }
+
+    if (ccsum*norm < 0.50f || (1.0f/norm < nWaveforms/3)) {
+        res.failed = true;
+    }
+
+    res.templateCC = calcTemplateCC(history, avgWaveform);
+    appendf(log, "    - Template CC = %g\n", res.templateCC);
+
+    appendf(log, "\n");
+
+    return true;
+}
+
+// alternative to trainKey for keys with many presses: instead of matching all pairs, every waveform is aligned
+// to the current average and the average is rebuilt from the aligned waveforms, until the offsets stop changing
+static bool trainKeyAlignToMean(TKey key, TKeyHistory & history, TrainResult & res, int nIterations = 4, int nThreads = 1) {
+    res = TrainResult();
+    auto & log = res.log;
+
+    int nWaveforms = history.size();
+
+    appendf(log, "    - Training key '%c' (align to mean)\n", key);
+    appendf(log, "    - History size = %d key waveforms\n", nWaveforms);
+
+    centerWaveforms(history, log);
+
+    int centerSample = kSamplesPerWaveform/2;
+    int is0 = centerSample - kSamplesPerFrame;
+    int is1 = centerSample + kSamplesPerFrame;
+
+    int alignWindow = 64;
+    appendf(log, "    - Aligning to the average waveform, max %d iterations\n", nIterations);
+    appendf(log, "      Align window = %d\n", alignWindow);
+
+    std::vector<TValueCC> ccs(nWaveforms, 1.0f);
+    std::vector<TOffset> offsets(nWaveforms, 0);
+    std::vector<double> accum(kSamplesPerWaveform);
+
+    // weighted average of the waveforms shifted by the current offsets
+    auto & avgWaveform = res.average;
+    auto calcAverage = [&]() {
+        std::fill(accum.begin(), accum.end(), 0.0);
+
+        double norm = 0.0f;
+        for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+            double w = ccs[iwaveform]*ccs[iwaveform];
+            const auto & waveform = history[iwaveform];
+
+            int i0 = std::max(0, -offsets[iwaveform]);
+            int i1 = std::min(kSamplesPerWaveform, kSamplesPerWaveform - offsets[iwaveform]);
+            for (int is = i0; is < i1; ++is) {
+                accum[is] += w*waveform[is + offsets[iwaveform]];
+            }
+            norm += w;
+        }
+
+        avgWaveform.resize(kSamplesPerWaveform);
+        for (int is = 0; is < kSamplesPerWaveform; ++is) {
+            avgWaveform[is] = accum[is]/norm;
+        }
+
+        return norm;
+    };
+
+    calcAverage();
+
+    for (int iter = 0; iter < nIterations; ++iter) {
+        std::atomic<int> nChanged(0);
+        parallelFor(nWaveforms, nThreads, [&](int iwaveform) {
+            auto ret = findBestCC(avgWaveform, history[iwaveform], is0, is1, alignWindow, 1);
+            if (std::get<1>(ret) != offsets[iwaveform]) ++nChanged;
+            ccs[iwaveform] = std::get<0>(ret);
+            offsets[iwaveform] = std::get<1>(ret);
+        });
+
+        calcAverage();
+
+        double ccsum = 0.0;
+        for (auto cc : ccs) ccsum += cc;
+        appendf(log, "      Iteration %d - average cc = %g, changed offsets = %d\n", iter, ccsum/nWaveforms, (int) nChanged);
+
+        if (nChanged == 0) break;
+    }
+
+    int ntrain = 0;
+    double ccsum = 0.0f;
+    double norm = 0.0f;
+    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
+        appendf(log, "        Adding waveform %d - cc = %g, offset = %d\n", iwaveform, ccs[iwaveform], offsets[iwaveform]);
+        history[iwaveform] = shiftWaveform(history[iwaveform], offsets[iwaveform]);
+
+        norm += ccs[iwaveform]*ccs[iwaveform];
+        if (std::abs(offsets[iwaveform]) > 50) continue;
+        ++ntrain;
+        ccsum += ccs[iwaveform]*ccs[iwaveform];
+    }
+
+    res.stats.nWaveformsUsed = ntrain;
+    res.stats.nWaveformsTotal = nWaveforms;
+    res.stats.averageCC = ntrain > 0 ? sqrt(ccsum/ntrain) : 0.0f;
+
+    if (norm < nWaveforms/3) {
+        res.failed = true;
+    }
+
+    res.templateCC = calcTemplateCC(history, avgWaveform);
+    appendf(log, "    - Template CC = %g\n", res.templateCC);
+
+    appendf(log, "\n");
+
+    return true;
+}
+
+// folds a newly labeled press into the template of its key without retraining
+// press holds the recorded audio with the key press at sample pressCenter, which has to be at least
+// kSamplesPerFrame + alignWindow samples away from both ends. The press is aligned to the template with a single
+// findBestCC search and added to the running average with weight cc^2. The weight of the current template is
+// nWaveformsUsed*averageCC^2 - the sum of the weights that trainKey used. The peak of the template is preserved.
+// returns false if the press cannot be aligned or matches the template with a CC below minCC
+inline bool foldKeyPress(TKeyWaveform & average, TrainStats & stats,
+                         const TKeyWaveform & press, int pressCenter, TValueCC minCC,
+                         TValueCC & cc, TOffset & offset) {
+    const int alignWindow = 64;
+    const int centerSample = kSamplesPerWaveform/2;
+
+    int is0 = pressCenter - kSamplesPerFrame;
+    int is1 = pressCenter + kSamplesPerFrame;
+    if ((int) average.size() != kSamplesPerWaveform || is0 - alignWindow < 0 || is1 + alignWindow > (int) press.size()) {
+        return false;
+    }
+
+    auto ret = findBestCC(average, press, is0, is1, alignWindow, 1);
+    cc = std::get<0>(ret);
+    offset = std::get<1>(ret);
+
+    if (cc < minCC) {
+        return false;
+    }
+
+    // sample i of the template corresponds to sample i + ishift of the press
+    int ishift = pressCenter + offset - centerSample;
+
+    double amaxAverage = 0.0;
+    double amaxPress = 0.0;
+    for (int is = 0; is < kSamplesPerWaveform; ++is) {
+        amaxAverage = std::max(amaxAverage, (double) std::abs(average[is]));
+        int ip = is + ishift;
+        if (ip >= 0 && ip < (int) press.size()) {
+            amaxPress = std::max(amaxPress, (double) std::abs(press[ip]));
+        }
+    }
+
+    if (amaxPress == 0.0) {
+        return false;
+    }
+
+    // bring the press to the scale of the template
+    double scale = amaxAverage > 0.0 ? amaxAverage/amaxPress : 1.0;
+    double w0 = stats.nWaveformsUsed*stats.averageCC*stats.averageCC;
+    double w1 = cc*cc;
+    if (w0 + w1 <= 0.0) {
+        return false;
+    }
+    double norm = 1.0/(w0 + w1);
+
+    double amaxNew = 0.0;
+    for (int is = 0; is < kSamplesPerWaveform; ++is) {
+        int ip = is + ishift;
+        double a1 = (ip >= 0 && ip < (int) press.size()) ? scale*press[ip] : 0.0;
+        average[is] = (w0*average[is] + w1*a1)*norm;
+        amaxNew = std::max(amaxNew, (double) std::abs(average[is]));
+    }
+
+    if (amaxAverage > 0.0 && amaxNew > 0.0) {
+        for (auto & v : average) v *= amaxAverage/amaxNew;
+    }
+
+    ++stats.nWaveformsTotal;
+    if (std::abs(offset) <= 50) {
+        ++stats.nWaveformsUsed;
+        stats.averageCC = sqrt((w0 + w1)/stats.nWaveformsUsed);
+    }
+
+    return true;
+}
+
+// trains all keys, the threads are split between the keys first and then between the rows of each key
+// nTrained is incremented after each finished key and can be polled from another thread
+inline bool trainKeys(std::map<TKey, TKeyHistory> & histories, std::map<TKey, TrainResult> & results,
+                      std::atomic<int> * nTrained = nullptr, int nThreads = getNumThreads(),
+                      TrainMethod method = TrainMethod::Pairwise) {
+    std::vector<TKey> keys;
+    for (const auto & kh : histories) {
+        keys.push_back(kh.first);
+        results[kh.first] = TrainResult();
+    }
+
+    int nKeys = keys.size();
+    int nThreadsKeys = std::max(1, std::min(nThreads, nKeys));
+    int nThreadsRows = std::max(1, nThreads/nThreadsKeys);
+
+    // one pairwise matrix per key thread, reused for all keys trained by that thread
+    std::vector<TrainCCMatrix> ccsBuffers(nThreadsKeys);
+    std::atomic<int> next(0);
+    parallelFor(nThreadsKeys, nThreadsKeys, [&](int t) {
+        for (int i = next++; i < nKeys; i = next++) {
+            auto & history = histories.at(keys[i]);
+            auto & res = results.at(keys[i]);
+            if (history.size() > 2) {
+                if (method == TrainMethod::AlignToMean) {
+                    trainKeyAlignToMean(keys[i], history, res, 4, nThreadsRows);
+                } else {
+                    trainKey(keys[i], history, res, nThreadsRows, &ccsBuffers[t]);
+                }
+            } else {
+                appendf(res.log, "[!] Key '%s' does not have enough training data. Need at least 3 presses\n", kKeyText.at(keys[i]));
+                res.failed = true;
+            }
+            if (nTrained) ++(*nTrained);
+        }
+    });
+
+    return true;
+}
@@ -0,0 +1,276 @@
+/*! \file feature_store.h
+ *  \brief Append-only file of detected key presses, for re-analysis without going back to the audio
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+#include "key_features.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// File layout (native byte order, same as the .kbd files):
+//
+//   FeatureStoreHeader
+//   records of kFeatureStoreRecordSize bytes until the end of the file:
+//     int64 sampleIndex, int32 key, float cc, int32 offset, float scale, double sum, double sum2,
+//     float features[kFeatures], int16 window[kFeatureStoreWindow]
+//
+// The window is centered at the detected position plus the offset of the best match, i.e. aligned to the template
+// of the predicted key. Its amplitude is window[i]*scale. sum and sum2 are the sums of the amplitude and of its
+// square over the 2*kSamplesPerFrame samples around the center - the segment that is cross-correlated with the
+// templates. A session opened on an existing store appends to it. A record cut short by a crash is ignored.
+
+constexpr int kFeatureStoreWindow = kSamplesPerWaveform;
+constexpr int kFeatureStoreRecordSize = 8 + 4 + 4 + 4 + 4 + 8 + 8 + 4*kFeatures + 2*kFeatureStoreWindow;
+
+struct FeatureStoreHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t sampleRate;
+    int32_t window;
+    int32_t nFeatures;
+    uint32_t reserved[4];
+};
+
+struct FeatureStoreEntry {
+    int64_t sampleIndex = 0;
+    TKey key = -1;
+    float cc = 0.0f;
+    int32_t offset = 0;
+    float scale = 0.0f;
+    double sum = 0.0;
+    double sum2 = 0.0;
+    TKeyFeatures features;
+    std::array<int16_t, kFeatureStoreWindow> window;
+
+    // fills the entry from the samples around ampl[center]; outside of ampl the window is zero
+    void set(const TKeyWaveform & ampl, int center) {
+        const int i0 = center - kFeatureStoreWindow/2;
+
+        float amax = 0.0f;
+        for (int i = std::max(0, -i0); i < kFeatureStoreWindow && i0 + i < (int) ampl.size(); ++i) {
+            amax = std::max(amax, std::abs(ampl[i0 + i]));
+        }
+        scale = amax > 0.0f ? amax/32767.0f : 1.0f;
+
+        window.fill(0);
+        for (int i = std::max(0, -i0); i < kFeatureStoreWindow && i0 + i < (int) ampl.size(); ++i) {
+            window[i] = std::round(ampl[i0 + i]/scale);
+        }
+
+        // the stats are of the stored samples, so that they match the window exactly
+        sum = 0.0;
+        sum2 = 0.0;
+        for (int i = kFeatureStoreWindow/2 - kSamplesPerFrame; i < kFeatureStoreWindow/2 + kSamplesPerFrame; ++i) {
+            double x = window[i]*scale;
+            sum += x;
+            sum2 += x*x;
+        }
+
+        if (calcKeyFeatures(ampl, center, features) == false) features.fill(0.0f);
+    }
+
+    // the amplitude of the window, the aligned press is at kFeatureStoreWindow/2
+    void waveform(TKeyWaveform & res) const {
+        res.resize(kFeatureStoreWindow);
+        for (int i = 0; i < kFeatureStoreWindow; ++i) res[i] = window[i]*scale;
+    }
+};
+
+static const char kFeatureStoreMagic[8] = { 'K', 'B', 'D', 'F', 'E', 'A', 'T', '1' };
+static const uint32_t kFeatureStoreVersion = 1;
+
+// Records are written from the deliver callback of the work queue, so append() is never called concurrently.
+// The file is buffered and flushed by close().
+class FeatureStoreWriter {
+    public:
+        FeatureStoreWriter() {}
+        ~FeatureStoreWriter() { close(); }
+
+        FeatureStoreWriter(const FeatureStoreWriter &) = delete;
+        FeatureStoreWriter & operator = (const FeatureStoreWriter &) = delete;
+
+        bool open(const std::string & fname) {
+            close();
+
+            // an existing store is appended to, if it was written with the same parameters
+            if (FILE * fin = fopen(fname.c_str(), "rb")) {
+                FeatureStoreHeader header;
+                bool ok = fread(&header, sizeof(header), 1, fin) == 1 && isCompatible(header);
+                fseek(fin, 0, SEEK_END);
+                long size = ftell(fin);
+                fclose(fin);
+                if (ok == false) {
+                    fprintf(stderr, "File '%s' exists and is not a compatible feature store\n", fname.c_str());
+                    return false;
+                }
+
+                // a partial record at the end is overwritten by the new ones
+                long nRecords = (size - (long) sizeof(header))/kFeatureStoreRecordSize;
+                fout_ = fopen(fname.c_str(), "r+b");
+                if (fout_ == nullptr || fseek(fout_, sizeof(header) + nRecords*kFeatureStoreRecordSize, SEEK_SET) != 0) {
+                    fprintf(stderr, "Failed to open '%s' for appending\n", fname.c_str());
+                    close();
+                    return false;
+                }
+                nExisting_ = nRecords;
+            } else {
+                fout_ = fopen(fname.c_str(), "wb");
+                if (fout_ == nullptr) {
+                    fprintf(stderr, "Failed to open '%s' for writing\n", fname.c_str());
+                    return false;
+                }
+
+                FeatureStoreHeader header;
+                memset(&header, 0, sizeof(header));
+                memcpy(header.magic, kFeatureStoreMagic, sizeof(kFeatureStoreMagic));
+                header.version = kFeatureStoreVersion;
+                header.sampleRate = kSampleRate;
+                header.window = kFeatureStoreWindow;
+                header.nFeatures = kFeatures;
+                fwrite(&header, sizeof(header), 1, fout_);
+                nExisting_ = 0;
+            }
+
+            buffer_.resize(1 << 20);
+            setvbuf(fout_, buffer_.data(), _IOFBF, buffer_.size());
+            nWritten_ = 0;
+
+            return true;
+        }
+
+        void close() {
+            if (fout_) fclose(fout_);
+            fout_ = nullptr;
+        }
+
+        bool isOpen() const { return fout_ != nullptr; }
+
+        bool append(const FeatureStoreEntry & entry) {
+            uint8_t record[kFeatureStoreRecordSize];
+            uint8_t * cur = record;
+            auto put = [&](const void * data, size_t n) { memcpy(cur, data, n); cur += n; };
+
+            int32_t key = entry.key;
+            put(&entry.sampleIndex, 8);
+            put(&key, 4);
+            put(&entry.cc, 4);
+            put(&entry.offset, 4);
+            put(&entry.scale, 4);
+            put(&entry.sum, 8);
+            put(&entry.sum2, 8);
+            put(entry.features.data(), 4*kFeatures);
+            put(entry.window.data(), 2*kFeatureStoreWindow);
+
+            if (fwrite(record, sizeof(record), 1, fout_) != 1) return false;
+            ++nWritten_;
+
+            return true;
+        }
+
+        // records written in this session and records that were in the file before
+        int64_t nWritten() const { return nWritten_; }
+        int64_t nExisting() const { return nExisting_; }
+
+        static bool isCompatible(const FeatureStoreHeader & header) {
+            return memcmp(header.magic, kFeatureStoreMagic, sizeof(kFeatureStoreMagic)) == 0 &&
+                header.version == kFeatureStoreVersion &&
+                header.sampleRate == kSampleRate &&
+                header.window == kFeatureStoreWindow &&
+                header.nFeatures == kFeatures;
+        }
+
+    private:
+        FILE * fout_ = nullptr;
+        std::vector<char> buffer_;
+
+        int64_t nWritten_ = 0;
+        int64_t nExisting_ = 0;
+};
+
+// sequential reader, the entries are returned in the order in which they were appended
+class FeatureStoreReader {
+    public:
+        FeatureStoreReader() {}
+        ~FeatureStoreReader() { close(); }
+
+        FeatureStoreReader(const FeatureStoreReader &) = delete;
+        FeatureStoreReader & operator = (const FeatureStoreReader &) = delete;
+
+        bool open(const std::string & fname) {
+            close();
+
+            fin_ = fopen(fname.c_str(), "rb");
+            if (fin_ == nullptr) {
+                fprintf(stderr, "Failed to open '%s'\n", fname.c_str());
+                return false;
+            }
+
+            FeatureStoreHeader header;
+            if (fread(&header, sizeof(header), 1, fin_) != 1 || FeatureStoreWriter::isCompatible(header) == false) {
+                fprintf(stderr, "File '%s' is not a compatible feature store\n", fname.c_str());
+                close();
+                return false;
+            }
+
+            fseek(fin_, 0, SEEK_END);
+            nEntries_ = (ftell(fin_) - (long) sizeof(header))/kFeatureStoreRecordSize;
+            rewind();
+
+            return true;
+        }
+
+        void close() {
+            if (fin_) fclose(fin_);
+            fin_ = nullptr;
+        }
+
+        int64_t size() const { return nEntries_; }
+
+        void rewind() {
+            fseek(fin_, sizeof(FeatureStoreHeader), SEEK_SET);
+            iNext_ = 0;
+        }
+
+        // returns false at the end of the store
+        bool next(FeatureStoreEntry & entry) {
+            if (fin_ == nullptr || iNext_ >= nEntries_) return false;
+
+            uint8_t record[kFeatureStoreRecordSize];
+            if (fread(record, sizeof(record), 1, fin_) != 1) return false;
+            ++iNext_;
+
+            const uint8_t * cur = record;
+            auto get = [&](void * data, size_t n) { memcpy(data, cur, n); cur += n; };
+
+            int32_t key;
+            get(&entry.sampleIndex, 8);
+            get(&key, 4);
+            get(&entry.cc, 4);
+            get(&entry.offset, 4);
+            get(&entry.scale, 4);
+            get(&entry.sum, 8);
+            get(&entry.sum2, 8);
+            get(entry.features.data(), 4*kFeatures);
+            get(entry.window.data(), 2*kFeatureStoreWindow);
+            entry.key = key;
+
+            return true;
+        }
+
+    private:
+        FILE * fin_ = nullptr;
+
+        int64_t nEntries_ = 0;
+        int64_t iNext_ = 0;
+};
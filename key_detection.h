@@ -0,0 +1,93 @@
+/*! \file key_detection.h
+ *  \brief Key press detection on a whole recording, split into chunks that are processed in parallel
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Sample i is a key press if |x[i]| is the largest in the kSamplesPerFrame samples around it and exceeds
+// thresholdBackground times the average |x| of the kBkgrRingBufferSize samples before the end of that window.
+// The peak test is the one of the live detection in keytap, the background is not: live, it is one average per
+// captured record, updated with every kBkgrStep_samples-th sample up to the end of the record, and only the peaks
+// in frames [2, nFrames - 2) of the record are tested. Here the background slides with every sample and every
+// sample is tested, so that the result does not depend on how the audio is split. The detections are close to
+// the live ones, but not always the same. Only the presses in [i0, i1) are reported, but the samples outside of
+// the range are used, so that splitting a recording into ranges does not change the result.
+// strength, if given, gets the ratio of the peak to the background of every press - the presses for a higher
+// threshold are the ones with a larger strength.
+static void detectKeyPresses(
+        const float * samples,
+        int64_t nSamples,
+        int64_t i0,
+        int64_t i1,
+        float thresholdBackground,
+        std::vector<int64_t> & res,
+        std::vector<float> * strength = nullptr) {
+    const int64_t k = kSamplesPerFrame;
+    const int64_t nBkgr = kBkgrRingBufferSize;
+
+    i1 = std::min(i1, nSamples - k/2);
+
+    // scan position i tests sample i - k/2
+    int64_t iBegin = std::max<int64_t>(0, i0 + k/2 - k);
+    int64_t iEnd = i1 + k/2;
+
+    double sumBkgr = 0.0;
+    for (int64_t i = std::max<int64_t>(0, iBegin - nBkgr); i < iBegin; ++i) sumBkgr += std::abs(samples[i]);
+
+    std::deque<int64_t> que;
+    for (int64_t i = iBegin; i < iEnd; ++i) {
+        const float acur = std::abs(samples[i]);
+
+        sumBkgr += acur;
+        if (i - nBkgr >= 0) sumBkgr -= std::abs(samples[i - nBkgr]);
+
+        while (que.empty() == false && que.front() <= i - k) que.pop_front();
+        while (que.empty() == false && acur >= std::abs(samples[que.back()])) que.pop_back();
+        que.push_back(i);
+
+        const int64_t itest = i - k/2;
+        if (itest < i0 || i < k || que.front() != itest) continue;
+
+        const float bkgr = sumBkgr/nBkgr;
+        if (std::abs(samples[itest]) > thresholdBackground*bkgr) {
+            res.push_back(itest);
+            if (strength) strength->push_back(bkgr > 0.0f ? std::abs(samples[itest])/bkgr : 1e10f);
+        }
+    }
+}
+
+// detects the presses in chunks of chunkSize samples on nThreads threads, the result is in sample order
+inline void detectKeyPressesParallel(
+        const float * samples,
+        int64_t nSamples,
+        float thresholdBackground,
+        std::vector<int64_t> & res,
+        int nThreads = getNumThreads(),
+        int64_t chunkSize = 1 << 18,
+        std::vector<float> * strength = nullptr) {
+    const int nChunks = (nSamples + chunkSize - 1)/chunkSize;
+
+    std::vector<std::vector<int64_t>> chunks(nChunks);
+    std::vector<std::vector<float>> chunksStrength(nChunks);
+    parallelFor(nChunks, nThreads, [&](int i) {
+        detectKeyPresses(samples, nSamples, i*chunkSize, std::min(nSamples, (i + 1)*chunkSize), thresholdBackground, chunks[i],
+                         strength ? &chunksStrength[i] : nullptr);
+    });
+
+    res.clear();
+    for (const auto & chunk : chunks) res.insert(res.end(), chunk.begin(), chunk.end());
+
+    if (strength) {
+        strength->clear();
+        for (const auto & chunk : chunksStrength) strength->insert(strength->end(), chunk.begin(), chunk.end());
+    }
+}
@@ -0,0 +1,203 @@
+/*! \file key_features.h
+ *  \brief Cheap spectral features of key presses, used to shortlist the templates before the exact matching
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <vector>
+
+// Features of the kFeatureWindow samples around a key press:
+//
+//   kFeatureBands    - log energy in log-spaced frequency bands from one FFT, minus their mean (spectral shape)
+//   kFeatureEnvelope - log energy of consecutive blocks, minus their mean (envelope shape)
+//   1                - log of the peak amplitude
+//
+constexpr int kFeatureWindow = 1024;
+constexpr int kFeatureBands = 16;
+constexpr int kFeatureEnvelope = 8;
+constexpr int kFeatures = kFeatureBands + kFeatureEnvelope + 1;
+
+using TKeyFeatures = std::array<float, kFeatures>;
+
+// in-place radix-2 FFT, n must be a power of 2
+static void fftRadix2(std::vector<std::complex<float>> & x) {
+    const int n = x.size();
+
+    for (int i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(x[i], x[j]);
+    }
+
+    for (int len = 2; len <= n; len <<= 1) {
+        double ang = -2.0*M_PI/len;
+        std::complex<float> wlen(std::cos(ang), std::sin(ang));
+        for (int i = 0; i < n; i += len) {
+            std::complex<float> w(1.0f, 0.0f);
+            for (int j = 0; j < len/2; ++j) {
+                auto u = x[i + j];
+                auto v = x[i + j + len/2]*w;
+                x[i + j] = u + v;
+                x[i + j + len/2] = u - v;
+                w *= wlen;
+            }
+        }
+    }
+}
+
+// returns false if the window around center does not fit in ampl
+static bool calcKeyFeatures(const TKeyWaveform & ampl, int center, TKeyFeatures & res) {
+    const int i0 = center - kFeatureWindow/2;
+    if (i0 < 0 || i0 + kFeatureWindow > (int) ampl.size()) return false;
+
+    static thread_local std::vector<std::complex<float>> spectrum(kFeatureWindow);
+    static const std::vector<float> hann = []() {
+        std::vector<float> res(kFeatureWindow);
+        for (int i = 0; i < kFeatureWindow; ++i) res[i] = 0.5f - 0.5f*std::cos((2.0*M_PI*i)/(kFeatureWindow - 1));
+        return res;
+    }();
+
+    float amax = 0.0f;
+    for (int i = 0; i < kFeatureWindow; ++i) {
+        spectrum[i] = { hann[i]*ampl[i0 + i], 0.0f };
+        amax = std::max(amax, std::abs(ampl[i0 + i]));
+    }
+    fftRadix2(spectrum);
+
+    const float eps = 1e-12f;
+
+    // bands from bin 2 to the Nyquist bin, equally spaced in log frequency
+    float mean = 0.0f;
+    for (int b = 0; b < kFeatureBands; ++b) {
+        int k0 = std::round(2.0*std::pow(0.5*kFeatureWindow/2.0, double(b)/kFeatureBands));
+        int k1 = std::round(2.0*std::pow(0.5*kFeatureWindow/2.0, double(b + 1)/kFeatureBands));
+        k1 = std::max(k1, k0 + 1);
+
+        float e = 0.0f;
+        for (int k = k0; k < k1; ++k) e += std::norm(spectrum[k]);
+        res[b] = std::log(e + eps);
+        mean += res[b];
+    }
+    mean /= kFeatureBands;
+    for (int b = 0; b < kFeatureBands; ++b) res[b] -= mean;
+
+    const int blockSize = kFeatureWindow/kFeatureEnvelope;
+    mean = 0.0f;
+    for (int e = 0; e < kFeatureEnvelope; ++e) {
+        float sum = 0.0f;
+        for (int i = 0; i < blockSize; ++i) {
+            float a = ampl[i0 + e*blockSize + i];
+            sum += a*a;
+        }
+        res[kFeatureBands + e] = std::log(sum + eps);
+        mean += res[kFeatureBands + e];
+    }
+    mean /= kFeatureEnvelope;
+    for (int e = 0; e < kFeatureEnvelope; ++e) res[kFeatureBands + e] -= mean;
+
+    res[kFeatures - 1] = std::log(amax + eps);
+
+    return true;
+}
+
+// Per-key feature centroids. The features are weighted with the inverse of their spread over all presses.
+class KeyShortlist {
+    public:
+        // centroids of the recorded presses of each key, centered at kSamplesPerWaveform/2
+        bool build(const std::map<TKey, TKeyHistory> & histories) {
+            std::map<TKey, std::vector<TKeyFeatures>> features;
+            for (const auto & kh : histories) {
+                for (const auto & waveform : kh.second) {
+                    TKeyFeatures cur;
+                    if (calcKeyFeatures(waveform, kSamplesPerWaveform/2, cur)) features[kh.first].push_back(cur);
+                }
+            }
+
+            return build(features, true);
+        }
+
+        // fallback when only the templates are available, e.g. for a loaded model
+        // the templates are rescaled, so their peak amplitude is not used
+        bool build(const std::map<TKey, TKeyWaveform> & templates) {
+            std::map<TKey, std::vector<TKeyFeatures>> features;
+            for (const auto & kt : templates) {
+                TKeyFeatures cur;
+                if (calcKeyFeatures(kt.second, kSamplesPerWaveform/2, cur)) features[kt.first].push_back(cur);
+            }
+
+            return build(features, false);
+        }
+
+        bool empty() const { return keys_.empty(); }
+
+        // the k keys with the closest centroids, closest first
+        void shortlist(const TKeyFeatures & features, int k, std::vector<TKey> & res) const {
+            std::vector<std::pair<float, TKey>> dists(keys_.size());
+            for (int i = 0; i < (int) keys_.size(); ++i) {
+                float d = 0.0f;
+                for (int j = 0; j < kFeatures; ++j) {
+                    float x = (features[j] - centroids_[i][j])*weights_[j];
+                    d += x*x;
+                }
+                dists[i] = { d, keys_[i] };
+            }
+
+            k = std::min(k, (int) dists.size());
+            std::partial_sort(dists.begin(), dists.begin() + k, dists.end());
+
+            res.resize(k);
+            for (int i = 0; i < k; ++i) res[i] = dists[i].second;
+        }
+
+    private:
+        bool build(const std::map<TKey, std::vector<TKeyFeatures>> & features, bool useAmplitude) {
+            keys_.clear();
+            centroids_.clear();
+
+            TKeyFeatures sum {};
+            TKeyFeatures sum2 {};
+            int n = 0;
+            for (const auto & kf : features) {
+                if (kf.second.empty()) continue;
+
+                TKeyFeatures centroid {};
+                for (const auto & f : kf.second) {
+                    for (int j = 0; j < kFeatures; ++j) {
+                        centroid[j] += f[j];
+                        sum[j] += f[j];
+                        sum2[j] += f[j]*f[j];
+                    }
+                }
+                for (auto & c : centroid) c /= kf.second.size();
+                n += kf.second.size();
+
+                keys_.push_back(kf.first);
+                centroids_.push_back(centroid);
+            }
+
+            if (n == 0) return false;
+
+            for (int j = 0; j < kFeatures; ++j) {
+                float mean = sum[j]/n;
+                float var = sum2[j]/n - mean*mean;
+                weights_[j] = var > 1e-6f ? 1.0f/std::sqrt(var) : 0.0f;
+            }
+            if (useAmplitude == false) weights_[kFeatures - 1] = 0.0f;
+
+            return true;
+        }
+
+        std::vector<TKey> keys_;
+        std::vector<TKeyFeatures> centroids_;
+        TKeyFeatures weights_ {};
+};
@@ -0,0 +1,169 @@
+/*! \file key_model.h
+ *  \brief Binary file format for trained key templates
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+#include "mapped_recording.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+
+// File layout (native byte order, same as the .kbd files):
+//
+//   KeyModelHeader
+//   KeyModelEntry x nKeys
+//   padding up to templatesOffset (multiple of 64 bytes)
+//   float x samplesPerWaveform x nKeys - the average key waveforms, in the order of the entries
+//
+// The templates are stored as they are used for prediction, i.e. already scaled to [amplMin, amplMax].
+
+struct KeyModel {
+    float amplMin = 0.0f;
+    float amplMax = 0.0f;
+
+    std::map<TKey, TKeyWaveform> templates;
+    std::map<TKey, TrainStats> trainStats;
+};
+
+struct KeyModelHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t sampleRate;
+    int32_t samplesPerWaveform;
+    int32_t nKeys;
+    float amplMin;
+    float amplMax;
+    uint32_t templatesOffset;
+    uint32_t reserved[7];
+};
+
+struct KeyModelEntry {
+    int32_t key;
+    int32_t nWaveformsUsed;
+    int32_t nWaveformsTotal;
+    float averageCC;
+};
+
+static const char kKeyModelMagic[8] = { 'K', 'B', 'D', 'M', 'O', 'D', 'E', 'L' };
+static const uint32_t kKeyModelVersion = 1;
+
+inline bool saveKeyModel(const std::string & fname, const KeyModel & model) {
+    std::ofstream fout(fname, std::ios::binary);
+    if (fout.good() == false) {
+        fprintf(stderr, "Failed to open '%s' for writing\n", fname.c_str());
+        return false;
+    }
+
+    int nKeys = model.templates.size();
+    size_t entriesEnd = sizeof(KeyModelHeader) + nKeys*sizeof(KeyModelEntry);
+
+    KeyModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kKeyModelMagic, sizeof(header.magic));
+    header.version = kKeyModelVersion;
+    header.sampleRate = kSampleRate;
+    header.samplesPerWaveform = kSamplesPerWaveform;
+    header.nKeys = nKeys;
+    header.amplMin = model.amplMin;
+    header.amplMax = model.amplMax;
+    header.templatesOffset = ((entriesEnd + 63)/64)*64;
+    fout.write((char *)(&header), sizeof(header));
+
+    for (const auto & kt : model.templates) {
+        KeyModelEntry entry;
+        entry.key = kt.first;
+        entry.nWaveformsUsed = 0;
+        entry.nWaveformsTotal = 0;
+        entry.averageCC = 0.0f;
+
+        auto stats = model.trainStats.find(kt.first);
+        if (stats != model.trainStats.end()) {
+            entry.nWaveformsUsed = stats->second.nWaveformsUsed;
+            entry.nWaveformsTotal = stats->second.nWaveformsTotal;
+            entry.averageCC = stats->second.averageCC;
+        }
+        fout.write((char *)(&entry), sizeof(entry));
+    }
+
+    std::vector<char> padding(header.templatesOffset - entriesEnd, 0);
+    fout.write(padding.data(), padding.size());
+
+    for (const auto & kt : model.templates) {
+        if ((int) kt.second.size() != kSamplesPerWaveform) {
+            fprintf(stderr, "Unexpected template size for key %d - %d\n", kt.first, (int) kt.second.size());
+            return false;
+        }
+        fout.write((char *)(kt.second.data()), kt.second.size()*sizeof(AudioLogger::Sample));
+    }
+
+    return fout.good();
+}
+
+static bool loadKeyModel(const std::string & fname, KeyModel & model) {
+    MappedFile fin;
+    if (fin.open(fname) == false) {
+        fprintf(stderr, "Failed to open model file '%s'\n", fname.c_str());
+        return false;
+    }
+
+    KeyModelHeader header;
+    if (fin.size() < sizeof(header)) {
+        fprintf(stderr, "Model file '%s' is too small\n", fname.c_str());
+        return false;
+    }
+    memcpy(&header, fin.data(), sizeof(header));
+
+    if (memcmp(header.magic, kKeyModelMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "File '%s' is not a keytap model\n", fname.c_str());
+        return false;
+    }
+
+    if (header.version != kKeyModelVersion) {
+        fprintf(stderr, "Unsupported model version %d (expected %d)\n", (int) header.version, (int) kKeyModelVersion);
+        return false;
+    }
+
+    if (header.sampleRate != kSampleRate || header.samplesPerWaveform != kSamplesPerWaveform) {
+        fprintf(stderr, "Model parameters (sample rate = %d, samples per waveform = %d) do not match the expected ones (%d, %d)\n",
+                header.sampleRate, header.samplesPerWaveform, (int) kSampleRate, (int) kSamplesPerWaveform);
+        return false;
+    }
+
+    size_t templateSize = header.samplesPerWaveform*sizeof(AudioLogger::Sample);
+    if (header.nKeys < 0 ||
+        header.templatesOffset < sizeof(header) + header.nKeys*sizeof(KeyModelEntry) ||
+        fin.size() < header.templatesOffset + header.nKeys*templateSize) {
+        fprintf(stderr, "Model file '%s' is truncated or corrupted\n", fname.c_str());
+        return false;
+    }
+
+    model = KeyModel();
+    model.amplMin = header.amplMin;
+    model.amplMax = header.amplMax;
+
+    const uint8_t * entries = fin.data() + sizeof(header);
+    const uint8_t * templates = fin.data() + header.templatesOffset;
+    for (int i = 0; i < header.nKeys; ++i) {
+        KeyModelEntry entry;
+        memcpy(&entry, entries + i*sizeof(entry), sizeof(entry));
+
+        auto & stats = model.trainStats[entry.key];
+        stats.nWaveformsUsed = entry.nWaveformsUsed;
+        stats.nWaveformsTotal = entry.nWaveformsTotal;
+        stats.averageCC = entry.averageCC;
+
+        auto & waveform = model.templates[entry.key];
+        waveform.resize(header.samplesPerWaveform);
+        memcpy(waveform.data(), templates + i*templateSize, templateSize);
+    }
+
+    return true;
+}
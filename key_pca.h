@@ -0,0 +1,232 @@
+/*! \file key_pca.h
+ *  \brief Low-rank basis of the key press waveforms for matching the templates in a reduced space
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <vector>
+
+// The matched segment of a template is the kPCAWindow samples around its center, the same samples that
+// predictKeyPress compares. Each segment is mean-subtracted and normalized, so the dot product of two segments
+// is their CC. The basis spans the dominant directions of these segments, and the CC of a template with a window
+// of the input is approximated by the dot product of their projections.
+constexpr int kPCAWindow = 2*kSamplesPerFrame;
+
+struct KeyPCAStats {
+    int rank = 0;
+    int nWaveforms = 0;
+    double explained = 0.0;     // fraction of the energy of the training segments kept by the basis
+    size_t nBytesBasis = 0;
+    size_t nBytesTemplates = 0; // projected templates
+    size_t nBytesFull = 0;      // the matched segments of the full templates, for comparison
+};
+
+class KeyPCA {
+    public:
+        // learns the basis from the training presses, centered at kSamplesPerWaveform/2, and the templates
+        // histories can be empty, e.g. for a loaded model - then rank is limited by the number of templates
+        bool train(
+                const std::map<TKey, TKeyHistory> & histories,
+                const std::map<TKey, TKeyWaveform> & templates,
+                int rank,
+                int nThreads = getNumThreads(),
+                int nIterations = 20) {
+            std::vector<std::vector<float>> segments;
+            std::vector<float> cur;
+            for (const auto & kh : histories) {
+                for (const auto & waveform : kh.second) {
+                    if (normalizedSegment(waveform, waveform.size()/2 - kPCAWindow/2, cur)) segments.push_back(cur);
+                }
+            }
+            for (const auto & kt : templates) {
+                if (normalizedSegment(kt.second, kt.second.size()/2 - kPCAWindow/2, cur)) segments.push_back(cur);
+            }
+
+            rank = std::min(rank, (int) segments.size());
+            if (rank < 1) return false;
+
+            const int n = segments.size();
+            std::vector<float> z(n*rank);
+
+            // subspace iteration on the segment covariance: basis <- orth(X^T X basis)
+            std::mt19937 rng(1234);
+            std::normal_distribution<float> dist(0.0f, 1.0f);
+            basis_.resize(rank*kPCAWindow);
+            for (auto & v : basis_) v = dist(rng);
+            orthonormalize(basis_, rank);
+
+            for (int iter = 0; iter < nIterations; ++iter) {
+                parallelFor(n, nThreads, [&](int i) {
+                    for (int r = 0; r < rank; ++r) z[i*rank + r] = dot(segments[i].data(), basis_.data() + r*kPCAWindow);
+                });
+                parallelFor(rank, nThreads, [&](int r) {
+                    float * b = basis_.data() + r*kPCAWindow;
+                    std::fill(b, b + kPCAWindow, 0.0f);
+                    for (int i = 0; i < n; ++i) {
+                        const float zi = z[i*rank + r];
+                        const float * s = segments[i].data();
+                        for (int j = 0; j < kPCAWindow; ++j) b[j] += zi*s[j];
+                    }
+                });
+                orthonormalize(basis_, rank);
+            }
+
+            rank_ = rank;
+
+            double explained = 0.0;
+            for (int i = 0; i < n; ++i) {
+                for (int r = 0; r < rank; ++r) {
+                    float c = dot(segments[i].data(), basis_.data() + r*kPCAWindow);
+                    explained += c*c;
+                }
+            }
+
+            stats_ = KeyPCAStats();
+            stats_.rank = rank;
+            stats_.nWaveforms = n;
+            stats_.explained = explained/n;
+            stats_.nBytesBasis = basis_.size()*sizeof(float);
+
+            return project(templates);
+        }
+
+        // projects the templates on the basis, call again when the templates change
+        bool project(const std::map<TKey, TKeyWaveform> & templates) {
+            if (rank_ == 0) return false;
+
+            coeffs_.clear();
+            std::vector<float> cur;
+            for (const auto & kt : templates) {
+                if (normalizedSegment(kt.second, kt.second.size()/2 - kPCAWindow/2, cur) == false) continue;
+                auto & c = coeffs_[kt.first];
+                c.resize(rank_);
+                for (int r = 0; r < rank_; ++r) c[r] = dot(cur.data(), basis_.data() + r*kPCAWindow);
+            }
+
+            stats_.nBytesTemplates = coeffs_.size()*rank_*sizeof(float);
+            stats_.nBytesFull = coeffs_.size()*kPCAWindow*sizeof(float);
+
+            return coeffs_.empty() == false;
+        }
+
+        bool empty() const { return coeffs_.empty(); }
+        const KeyPCAStats & stats() const { return stats_; }
+
+        // Same result as predictKeyPress, but the offsets are searched in the reduced space with the given step and
+        // only the winner gets the exact CC search, in the refineWindow offsets around its reduced best offset.
+        // The confidence of the other templates is their reduced CC. keys, if given, restricts the matching.
+        void predict(
+                const std::map<TKey, TKeyWaveform> & templates,
+                const TKeyWaveform & ampl,
+                int curPos,
+                int alignWindow,
+                TKeyPrediction & res,
+                int step = 2,
+                int refineWindow = 4,
+                const std::vector<TKey> * keys = nullptr) const {
+            res = TKeyPrediction();
+
+            std::vector<const std::pair<const TKey, std::vector<float>> *> candidates;
+            if (keys) {
+                for (auto key : *keys) {
+                    auto it = coeffs_.find(key);
+                    if (it != coeffs_.end()) candidates.push_back(&*it);
+                }
+            } else {
+                for (const auto & kc : coeffs_) candidates.push_back(&kc);
+            }
+            if (candidates.empty()) return;
+
+            const int scmp0 = curPos - kPCAWindow/2;
+            if (scmp0 - alignWindow - refineWindow < 0 || scmp0 + kPCAWindow + alignWindow + refineWindow > (int) ampl.size()) return;
+
+            static thread_local std::vector<float> proj;
+            proj.resize(rank_);
+
+            std::vector<TValueCC> bestCC(candidates.size(), -1.0f);
+            TOffset bestOffset = 0;
+            for (int o = -alignWindow; o < alignWindow; o += std::max(1, step)) {
+                const float * w = ampl.data() + scmp0 + o;
+
+                TSum sum = 0.0f;
+                TSum2 sum2 = 0.0f;
+                for (int j = 0; j < kPCAWindow; ++j) {
+                    sum += w[j];
+                    sum2 += w[j]*w[j];
+                }
+                double norm = std::sqrt(std::max(0.0, sum2 - sum*sum/kPCAWindow));
+                if (norm <= 0.0) continue;
+
+                // the basis vectors have zero mean, so the window does not need to be mean-subtracted
+                for (int r = 0; r < rank_; ++r) proj[r] = dot(w, basis_.data() + r*kPCAWindow)/norm;
+
+                for (int i = 0; i < (int) candidates.size(); ++i) {
+                    TValueCC cc = dot(proj.data(), candidates[i]->second.data(), rank_);
+                    if (cc > bestCC[i]) bestCC[i] = cc;
+                    if (cc > res.cc) {
+                        res.key = candidates[i]->first;
+                        res.cc = cc;
+                        bestOffset = o;
+                    }
+                }
+            }
+
+            for (int i = 0; i < (int) candidates.size(); ++i) res.confidence[candidates[i]->first] = bestCC[i];
+
+            if (res.key == -1) return;
+
+            auto ret = findBestCC(templates.at(res.key), ampl, scmp0 + bestOffset, scmp0 + bestOffset + kPCAWindow, refineWindow, 1);
+            res.cc = std::get<0>(ret);
+            res.offset = bestOffset + std::get<1>(ret);
+            res.confidence[res.key] = res.cc;
+        }
+
+    private:
+        static float dot(const float * a, const float * b, int n = kPCAWindow) {
+            float res = 0.0f;
+            for (int i = 0; i < n; ++i) res += a[i]*b[i];
+            return res;
+        }
+
+        static bool normalizedSegment(const TKeyWaveform & waveform, int is0, std::vector<float> & res) {
+            if (is0 < 0 || is0 + kPCAWindow > (int) waveform.size()) return false;
+
+            auto ret = calcSum(waveform, is0, is0 + kPCAWindow);
+            double mean = std::get<0>(ret)/kPCAWindow;
+            double norm = std::sqrt(std::max(0.0, std::get<1>(ret) - std::get<0>(ret)*mean));
+            if (norm <= 0.0) return false;
+
+            res.resize(kPCAWindow);
+            for (int j = 0; j < kPCAWindow; ++j) res[j] = (waveform[is0 + j] - mean)/norm;
+
+            return true;
+        }
+
+        // modified Gram-Schmidt on the rows
+        static void orthonormalize(std::vector<float> & rows, int n) {
+            for (int r = 0; r < n; ++r) {
+                float * a = rows.data() + r*kPCAWindow;
+                for (int p = 0; p < r; ++p) {
+                    const float * b = rows.data() + p*kPCAWindow;
+                    float d = dot(a, b);
+                    for (int j = 0; j < kPCAWindow; ++j) a[j] -= d*b[j];
+                }
+                float norm = std::sqrt(dot(a, a));
+                if (norm > 0.0f) for (int j = 0; j < kPCAWindow; ++j) a[j] /= norm;
+            }
+        }
+
+        int rank_ = 0;
+        std::vector<float> basis_;                  // rank_ rows of kPCAWindow samples
+        std::map<TKey, std::vector<float>> coeffs_;  // projected templates
+
+        KeyPCAStats stats_;
+};
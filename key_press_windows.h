@@ -0,0 +1,121 @@
+/*! \file key_press_windows.h
+ *  \brief Contiguous, aligned storage of key press windows for similarity computation
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Every key press window is copied into one 64-byte aligned buffer with a fixed stride:
+//
+//   [ alignWindow | n0 template samples | alignWindow ] [ padding to stride ]
+//
+// The template sums are precomputed, so matching two presses touches only the two windows.
+class KeyPressWindows {
+    public:
+        using Sample = int32_t;
+        using Sum = int64_t;
+
+        static constexpr int kAlignment = 64;
+        static constexpr int kStrideAlign = kAlignment/sizeof(Sample);
+
+        bool init(int nPresses, int n0, int alignWindow) {
+            if (nPresses < 0 || n0 <= 0 || alignWindow < 0) return false;
+
+            nPresses_ = nPresses;
+            n0_ = n0;
+            alignWindow_ = alignWindow;
+            stride_ = ((n0 + 2*alignWindow + kStrideAlign - 1)/kStrideAlign)*kStrideAlign;
+
+            storage_.assign((size_t) nPresses*stride_*sizeof(Sample) + kAlignment, 0);
+            auto addr = (uintptr_t) storage_.data();
+            data_ = (Sample *) ((addr + kAlignment - 1) & ~(uintptr_t) (kAlignment - 1));
+
+            sum0_.assign(nPresses, 0);
+            sum02_.assign(nPresses, 0);
+
+            return true;
+        }
+
+        // src points to the first sample of the window, i.e. alignWindow samples before the template
+        void set(int i, const Sample * src) {
+            auto dst = data_ + (size_t) i*stride_;
+            std::memcpy(dst, src, (n0_ + 2*alignWindow_)*sizeof(Sample));
+
+            Sum sum = 0;
+            Sum sum2 = 0;
+            for (int k = alignWindow_; k < alignWindow_ + n0_; ++k) {
+                sum += dst[k];
+                sum2 += (Sum) dst[k]*dst[k];
+            }
+            sum0_[i] = sum;
+            sum02_[i] = sum2;
+        }
+
+        int size() const { return nPresses_; }
+        int stride() const { return stride_; }
+        size_t sizeInBytes() const { return storage_.size() + 2*sum0_.size()*sizeof(Sum); }
+
+        const Sample * window(int i) const { return data_ + (size_t) i*stride_; }
+        const Sample * samples(int i) const { return window(i) + alignWindow_; }
+
+        // best CC of the template of press i against the window of press j, for offsets in [-alignWindow, alignWindow)
+        void findBestCC(int i, int j, double & bestcc, int & besto) const {
+            const Sample * __restrict t0 = samples(i);
+            const Sample * __restrict w1 = window(j);
+
+            const Sum n = n0_;
+            const Sum sum0 = sum0_[i];
+            const Sum sum02 = sum02_[i];
+            const double den2a = sum02*n - sum0*sum0;
+
+            bestcc = -1.0;
+            besto = -1;
+
+            // running sums of the compared part of window j
+            Sum sum1 = 0;
+            Sum sum12 = 0;
+            for (int k = 0; k < n0_; ++k) {
+                sum1 += w1[k];
+                sum12 += (Sum) w1[k]*w1[k];
+            }
+
+            for (int o = 0; o < 2*alignWindow_; ++o) {
+                const Sample * __restrict a1 = w1 + o;
+
+                Sum sum01 = 0;
+                for (int k = 0; k < n0_; ++k) {
+                    sum01 += (Sum) t0[k]*a1[k];
+                }
+
+                double nom = sum01*n - sum0*sum1;
+                double den2b = sum12*n - sum1*sum1;
+                double cc = (nom)/(sqrt(den2a*den2b));
+
+                if (cc > bestcc) {
+                    besto = o - alignWindow_;
+                    bestcc = cc;
+                }
+
+                sum1 += a1[n0_] - a1[0];
+                sum12 += (Sum) a1[n0_]*a1[n0_] - (Sum) a1[0]*a1[0];
+            }
+        }
+
+    private:
+        int nPresses_ = 0;
+        int n0_ = 0;
+        int alignWindow_ = 0;
+        int stride_ = 0;
+
+        std::vector<uint8_t> storage_;
+        Sample * data_ = nullptr;
+
+        std::vector<Sum> sum0_;
+        std::vector<Sum> sum02_;
+};
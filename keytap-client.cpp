@@ -0,0 +1,117 @@
+/*! \file keytap-client.cpp
+ *  \brief Streams a recording to keytap-server and prints the predictions
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "mapped_recording.h"
+#include "server_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s recording.kbd [--socket PATH] [--model N] [--realtime]\n", argv[0]);
+    printf("    --socket PATH - socket of keytap-server (default %s)\n", kServerDefaultSocket);
+    printf("    --model N     - index of the server model to use (default 0)\n");
+    printf("    --realtime    - send the audio at the speed of a live capture, takes no value\n");
+    printf("\n");
+
+    const std::vector<std::string> flags = { "realtime" };
+    auto argm = parseCmdArguments(argc, argv, flags);
+    auto inputFiles = parseCmdPositional(argc, argv, flags);
+    if (inputFiles.size() != 1) {
+        return -127;
+    }
+
+    const std::string socketPath = argm["socket"].empty() ? kServerDefaultSocket : argm["socket"];
+    const int model = argm["model"].empty() ? 0 : std::stoi(argm["model"]);
+    const bool isRealtime = argm.find("realtime") != argm.end();
+
+    MappedRecording recording;
+    if (recording.open(inputFiles[0]) == false) {
+        printf("Failed to open recording '%s'\n", inputFiles[0].c_str());
+        return -1;
+    }
+    if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+        printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
+        return -1;
+    }
+
+    sockaddr_un addr;
+    if (serverSocketAddress(socketPath, addr) == false) {
+        printf("Socket path '%s' is too long\n", socketPath.c_str());
+        return -2;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+        printf("Failed to connect to '%s': %s\n", socketPath.c_str(), strerror(errno));
+        if (fd >= 0) close(fd);
+        return -2;
+    }
+
+    ServerHello hello = { kSampleRate, model };
+    if (serverWriteFrame(fd, ServerMessage::Hello, &hello, sizeof(hello)) == false) {
+        printf("Failed to send hello\n");
+        close(fd);
+        return -2;
+    }
+
+    auto tStart = std::chrono::high_resolution_clock::now();
+
+    std::atomic<int> nPredictions(0);
+    std::atomic<bool> isDone(false);
+    std::thread reader([&]() {
+        std::vector<uint8_t> payload;
+        ServerMessage type;
+        while (serverReadFrame(fd, type, payload)) {
+            if (type == ServerMessage::Prediction && payload.size() == sizeof(ServerPrediction)) {
+                ServerPrediction prediction;
+                memcpy(&prediction, payload.data(), sizeof(prediction));
+                printf("    [%10.3f s] Prediction: '%c'        (%8.5g), sample = %lld, offset = %d\n",
+                       double(prediction.sampleIndex)/kSampleRate, prediction.key, prediction.cc,
+                       (long long) prediction.sampleIndex, prediction.offset);
+                ++nPredictions;
+            } else if (type == ServerMessage::Error) {
+                printf("Server error: %s\n", std::string(payload.begin(), payload.end()).c_str());
+                break;
+            } else if (type == ServerMessage::Done) {
+                isDone = true;
+                break;
+            }
+        }
+    });
+
+    const int64_t nSamples = recording.size();
+    std::vector<float> frame(kSamplesPerFrame);
+    for (int64_t i = 0; i < nSamples; i += kSamplesPerFrame) {
+        const int64_t n = std::min<int64_t>(kSamplesPerFrame, nSamples - i);
+        recording.read(i, n, frame.data());
+        if (serverWriteFrame(fd, ServerMessage::Audio, frame.data(), n*sizeof(float)) == false) break;
+
+        if (isRealtime) {
+            std::this_thread::sleep_until(tStart + std::chrono::microseconds((i + n)*1000000/kSampleRate));
+        }
+    }
+    serverWriteFrame(fd, ServerMessage::End, nullptr, 0);
+
+    reader.join();
+    close(fd);
+
+    double elapsed_s = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tStart).count();
+    printf("[+] %d predictions for %.1f s of audio in %.3f s%s\n", (int) nPredictions, double(nSamples)/kSampleRate, elapsed_s,
+           isDone ? "" : " - the server closed the connection early");
+
+    return isDone ? 0 : -3;
+}
@@ -0,0 +1,249 @@
+/*! \file keytap-eval.cpp
+ *  \brief Accuracy and speed of the keytap prediction on labeled key presses
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "audio_filter.h"
+#include "key_model.h"
+#include "training_data.h"
+#include "key_features.h"
+#include "key_pca.h"
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s train.kbd [train2.kbd ...] --test F[,F2,...] [-fS] [--load-model F] [--train M] [--threads N] [--topk N] [--shortlist K] [--pca R] [--min-accuracy F]\n", argv[0]);
+    printf("    --test F         - .kbd files with the labeled key presses to predict\n");
+    printf("    -fS              - pre-filter the audio with biquad sections, same as keytap\n");
+    printf("    --load-model F   - use the templates in file F instead of training\n");
+    printf("    --train M        - training method: 'pairwise' (default) or 'mean'\n");
+    printf("    --threads N      - number of presses predicted in parallel (default - all cores)\n");
+    printf("    --topk N         - report the top-1 ... top-N accuracy (default 3)\n");
+    printf("    --shortlist K    - match only the K keys with the closest spectral features\n");
+    printf("    --pca R          - match in a reduced space of R basis waveforms\n");
+    printf("    --min-accuracy F - exit with an error if the top-1 accuracy is below F percent\n");
+    printf("\n");
+
+    auto argm = parseCmdArguments(argc, argv);
+    auto trainFiles = parseCmdPositional(argc, argv);
+
+    if (argm["test"].empty() || (trainFiles.empty() && argm["load-model"].empty())) {
+        return -127;
+    }
+
+    const int kAlignWindow = 64;
+
+    int nThreads = argm["threads"].empty() ? getNumThreads() : std::max(1, std::stoi(argm["threads"]));
+    int topK = argm["topk"].empty() ? 3 : std::max(1, std::stoi(argm["topk"]));
+    int shortlistSize = argm["shortlist"].empty() ? 0 : std::max(0, std::stoi(argm["shortlist"]));
+    int pcaRank = argm["pca"].empty() ? 0 : std::max(0, std::stoi(argm["pca"]));
+
+    AudioFilter filter;
+    if (argm["f"].empty() == false && filter.addSections(argm["f"], kSampleRate) == false) {
+        printf("Invalid filter specification: '%s'\n", argm["f"].c_str());
+        return -3;
+    }
+
+    TrainMethod trainMethod = TrainMethod::Pairwise;
+    if (parseTrainMethod(argm["train"], trainMethod) == false) {
+        printf("Unknown training method: '%s'. Expected 'pairwise' or 'mean'\n", argm["train"].c_str());
+        return -5;
+    }
+
+    std::map<TKey, TKeyHistory> histories;
+    std::map<TKey, TKeyWaveform> templates;
+
+    if (argm["load-model"].empty() == false) {
+        KeyModel model;
+        if (loadKeyModel(argm["load-model"], model) == false) {
+            return -4;
+        }
+        templates = std::move(model.templates);
+        printf("[+] Loaded model '%s' with %d keys\n", argm["load-model"].c_str(), (int) templates.size());
+    } else {
+        TrainingDataStats stats;
+        if (loadTrainingData(trainFiles, filter, histories, stats) == false) {
+            return -2;
+        }
+
+        auto tStart = std::chrono::high_resolution_clock::now();
+        std::map<TKey, TrainResult> results;
+        trainKeys(histories, results, nullptr, getNumThreads(), trainMethod);
+        for (auto & kr : results) {
+            if (kr.second.average.empty()) continue;
+            templates[kr.first] = std::move(kr.second.average);
+        }
+        auto tEnd = std::chrono::high_resolution_clock::now();
+
+        printf("[+] Trained %d keys on %d presses from %d file(s) in %g ms\n", (int) templates.size(), stats.nRecords, stats.nFiles,
+               std::chrono::duration<double, std::milli>(tEnd - tStart).count());
+    }
+
+    if (templates.empty()) {
+        printf("No trained keys\n");
+        return -2;
+    }
+
+    KeyShortlist shortlist;
+    if (shortlistSize > 0) {
+        bool ok = histories.empty() ? shortlist.build(templates) : shortlist.build(histories);
+        if (ok == false) {
+            printf("Failed to compute the key features\n");
+            return -6;
+        }
+    }
+
+    KeyPCA pca;
+    if (pcaRank > 0 && pca.train(histories, templates, pcaRank) == false) {
+        printf("Failed to compute the template basis\n");
+        return -6;
+    }
+
+    std::vector<std::string> testFiles;
+    for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+        end = argm["test"].find(',', begin);
+        testFiles.push_back(argm["test"].substr(begin, end == std::string::npos ? end : end - begin));
+    }
+
+    std::map<TKey, TKeyHistory> test;
+    {
+        TrainingDataStats stats;
+        if (loadTrainingData(testFiles, filter, test, stats) == false) {
+            return -2;
+        }
+        printf("[+] Testing on %d presses of %d keys from %d file(s)\n", stats.nRecords, stats.nKeys, stats.nFiles);
+    }
+
+    struct Press {
+        TKey key;
+        const TKeyWaveform * waveform;
+        int pos;
+
+        TKeyPrediction prediction;
+        std::vector<TKey> ranked;   // the predicted key, then the others by decreasing confidence
+        int64_t latency_us;
+    };
+
+    // the press is at the peak of the middle frame, as found by the detection in keytap
+    std::vector<Press> presses;
+    for (const auto & kh : test) {
+        for (const auto & waveform : kh.second) {
+            int pos = 2*kSamplesPerFrame;
+            for (int i = 2*kSamplesPerFrame; i < 3*kSamplesPerFrame; ++i) {
+                if (std::abs(waveform[i]) > std::abs(waveform[pos])) pos = i;
+            }
+            presses.push_back({ kh.first, &waveform, pos, {}, {}, 0 });
+        }
+    }
+    if (presses.empty()) {
+        printf("No test presses\n");
+        return -2;
+    }
+
+    auto tStart = std::chrono::high_resolution_clock::now();
+    parallelFor(presses.size(), nThreads, [&](int i) {
+        auto & press = presses[i];
+        int64_t t0_us = getTime_us();
+
+        std::vector<TKey> keys;
+        const std::vector<TKey> * pkeys = nullptr;
+        TKeyFeatures features;
+        if (shortlistSize > 0 && calcKeyFeatures(*press.waveform, press.pos, features)) {
+            shortlist.shortlist(features, shortlistSize, keys);
+            pkeys = &keys;
+        }
+
+        if (pcaRank > 0) {
+            pca.predict(templates, *press.waveform, press.pos, kAlignWindow, press.prediction, 2, 4, pkeys);
+        } else {
+            predictKeyPress(templates, *press.waveform, press.pos, kAlignWindow, 1, press.prediction, 0, pkeys);
+        }
+
+        press.latency_us = getTime_us() - t0_us;
+
+        // the predicted key is the top-1, the same as in the confusion matrix, the rest follow by confidence
+        // with --pca the confidence of the other keys is their CC in the reduced space, so it can exceed the prediction
+        std::vector<std::pair<TConfidence, TKey>> ranked;
+        for (const auto & kc : press.prediction.confidence) {
+            if (kc.first != press.prediction.key) ranked.emplace_back(kc.second, kc.first);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const std::pair<TConfidence, TKey> & a, const std::pair<TConfidence, TKey> & b) {
+            return a.first > b.first;
+        });
+        if (press.prediction.key != -1) press.ranked.push_back(press.prediction.key);
+        for (const auto & rk : ranked) press.ranked.push_back(rk.second);
+    });
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    double elapsed_s = std::chrono::duration<double>(tEnd - tStart).count();
+
+    const int n = presses.size();
+
+    // confusion matrix over the keys that were either pressed or predicted
+    std::map<TKey, std::map<TKey, int>> confusion;
+    std::vector<TKey> keys;
+    for (const auto & press : presses) {
+        ++confusion[press.key][press.prediction.key];
+        keys.push_back(press.key);
+        keys.push_back(press.prediction.key);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    printf("\n");
+    printf("[+] Confusion matrix (rows - pressed, columns - predicted):\n");
+    printf("      ");
+    for (auto key : keys) printf(" %3s", key == -1 ? "-" : kKeyText.at(key));
+    printf("\n");
+    for (auto key : keys) {
+        if (confusion.count(key) == 0) continue;
+        printf("    %-3s", kKeyText.at(key));
+        for (auto predicted : keys) {
+            int cur = confusion[key][predicted];
+            if (cur == 0) {
+                printf("   .");
+            } else {
+                printf(" %3d", cur);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\n");
+    printf("[+] Accuracy on %d presses:\n", n);
+    double accuracy = 0.0;
+    for (int k = 1; k <= topK; ++k) {
+        int nCorrect = 0;
+        for (const auto & press : presses) {
+            int m = std::min<int>(k, press.ranked.size());
+            if (std::find(press.ranked.begin(), press.ranked.begin() + m, press.key) != press.ranked.begin() + m) ++nCorrect;
+        }
+        if (k == 1) accuracy = (100.0*nCorrect)/n;
+        printf("    top-%d : %6.2f%% (%d / %d)\n", k, (100.0*nCorrect)/n, nCorrect, n);
+    }
+
+    std::vector<int64_t> latencies;
+    for (const auto & press : presses) latencies.push_back(press.latency_us);
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile_ms = [&](double p) { return 1e-3*latencies[std::min<int>(n - 1, p*n)]; };
+
+    printf("\n");
+    printf("[+] Speed (%d thread(s)):\n", nThreads);
+    printf("    predictions per second : %.1f\n", n/elapsed_s);
+    printf("    latency per press      : p50 = %.3f ms, p99 = %.3f ms, max = %.3f ms\n",
+           percentile_ms(0.50), percentile_ms(0.99), 1e-3*latencies.back());
+
+    if (argm["min-accuracy"].empty() == false && accuracy < std::stof(argm["min-accuracy"])) {
+        printf("\n[!] Top-1 accuracy %.2f%% is below the required %s%%\n", accuracy, argm["min-accuracy"].c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -12,6 +12,12 @@
 #include "constants.h"
 #include "common.h"
 #include "audio_logger.h"
+#include "audio_filter.h"
+#include "key_model.h"
+#include "training_data.h"
+#include "work_queue.h"
+#include "prediction_qos.h"
+#include "thread_policy.h"
 
 #include "imgui.h"
 #include "imgui_impl_sdl.h"
@@ -31,7 +37,9 @@
 
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <cmath>
+#include <cctype>
 #include <string>
 #include <chrono>
 #include <thread>
@@ -55,12 +63,6 @@ static const std::vector<std::vector<int>> kKeyboard = {
 
 // types
 
-struct TrainStats {
-    int nWaveformsUsed = 0;
-    int nWaveformsTotal = 0;
-    TValueCC averageCC = 0.0f;
-};
-
 // globals
 
 static bool g_isInitialized = false;
@@ -100,8 +102,18 @@ extern "C" {
 int main(int argc, char ** argv) {
 	printf("hardware_concurrency = %d\n", (int) std::thread::hardware_concurrency());
 
-    printf("Usage: %s input.kbd [input2.kbd ...] [-cN]\n", argv[0]);
+    printf("Usage: %s input.kbd [input2.kbd ...] [-cN] [-fS] [--save-model F] [--load-model F] [--train M] [--workers N] [--queue N] [--qos N] [--thread-capture S] [--thread-workers S] [--thread-gui S]\n", argv[0]);
     printf("    -cN - select capture device N\n");
+    printf("    -fS - pre-filter audio with biquad sections, e.g. -fhp:100 or -fhp:80,bp:3000:0.5\n");
+    printf("    --save-model F - save the trained key templates to file F\n");
+    printf("    --load-model F - load trained key templates from file F instead of training\n");
+    printf("    --train M      - training method: 'pairwise' (default) or 'mean' (faster for many presses per key)\n");
+    printf("    --workers N    - number of prediction threads (default 2)\n");
+    printf("    --queue N      - max number of pending prediction jobs (default 64)\n");
+    printf("    --qos N        - 1 (default) - lower the matching quality while the queue is backed up, 0 - always full quality\n");
+    printf("    --thread-capture S - scheduling of the capture thread, e.g. cpu:1,fifo:80 - see thread_policy.h\n");
+    printf("    --thread-workers S - scheduling of the prediction threads, e.g. cpu:2-3,nice:5\n");
+    printf("    --thread-gui S     - scheduling of the GUI thread, e.g. nice:10\n");
     printf("\n");
 
     if (argc < 2) {
@@ -113,6 +125,45 @@ int main(int argc, char ** argv) {
     auto argm = parseCmdArguments(argc, argv);
     int captureId = argm["c"].empty() ? 0 : std::stoi(argm["c"]);
 
+    ThreadConfig threadConfig;
+    if (threadConfig.parse(argm, { "capture", "workers", "gui" }) == false) {
+        return -9;
+    }
+
+    // the capture filter runs continuously on the microphone stream, while the
+    // training records are independent snippets and are filtered from a clean state
+    AudioFilter filterCapture;
+    AudioFilter filterInput;
+    if (argm["f"].empty() == false) {
+        if (filterCapture.addSections(argm["f"], kSampleRate) == false ||
+            filterInput.addSections(argm["f"], kSampleRate) == false) {
+            printf("Invalid filter specification: '%s'\n", argm["f"].c_str());
+            return -3;
+        }
+        printf("Pre-filter: %d biquad section(s) - '%s'\n", filterCapture.nSections(), argm["f"].c_str());
+    }
+
+    TrainMethod trainMethod = TrainMethod::Pairwise;
+    if (parseTrainMethod(argm["train"], trainMethod) == false) {
+        printf("Unknown training method: '%s'. Expected 'pairwise' or 'mean'\n", argm["train"].c_str());
+        return -5;
+    }
+
+    KeyModel model;
+    bool hasModel = false;
+    if (argm["load-model"].empty() == false) {
+        auto tStart = std::chrono::high_resolution_clock::now();
+        if (loadKeyModel(argm["load-model"], model) == false) {
+            return -4;
+        }
+        auto tEnd = std::chrono::high_resolution_clock::now();
+        printf("Loaded model '%s' with %d keys in %g ms\n", argm["load-model"].c_str(), (int) model.templates.size(),
+               std::chrono::duration<double, std::milli>(tEnd - tStart).count());
+        hasModel = true;
+    }
+
+    auto inputFiles = parseCmdPositional(argc, argv);
+
     if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER) != 0) {
         printf("Error: %s\n", SDL_GetError());
         return -1;
@@ -191,26 +242,6 @@ int main(int argc, char ** argv) {
     ImGui::GetIO().Fonts->AddFontDefault(&fontConfig);
 
     std::ifstream frecord;
-    std::map<int, std::ifstream> fins;
-    for (int i = 0; i < argc - 1; ++i) {
-        if (argv[i + 1][0] == '-') continue;
-        printf("Opening file '%s'\n", argv[i + 1]);
-        fins[i] = std::ifstream(argv[i + 1], std::ios::binary);
-        if (fins[i].good() == false) {
-            printf("Failed to open input file: '%s'\n", argv[i + 1]);
-            return -2;
-        }
-
-        {
-            int bufferSize_frames = 1;
-            fins[i].read((char *)(&bufferSize_frames), sizeof(bufferSize_frames));
-            if (bufferSize_frames != kTrainBufferSize_frames) {
-                printf("Buffer size in file (%d) does not match the expected one (%d)\n", bufferSize_frames, (int) kTrainBufferSize_frames);
-                return -1;
-            }
-        }
-    }
-
     TKey keyPressed = -1;
     TKeyConfidenceMap keyConfidence;
     TKeyConfidenceMap keyConfidenceDisplay;
@@ -221,13 +252,10 @@ int main(int argc, char ** argv) {
 
     bool doRecord = false;
     bool isReadyToPredict = false;
-    bool processingInput = true;
     bool processingRecord = false;
     bool finishApp = false;
     bool waitForQueueDuringPlayback = true;
 
-    int curFile = 0;
-
     int predictedKey = -1;
     TKeyWaveform predictedAmpl(kSamplesPerWaveform, 0);
     int predictedHistoryBegin = 0;
@@ -235,6 +263,12 @@ int main(int argc, char ** argv) {
     predictedHistory.fill({});
     std::map<TKey, TrainStats> trainStats;
 
+    std::thread trainer;
+    std::map<TKey, TrainResult> trainResults;
+    std::atomic<bool> isTrainingDone(false);
+    std::atomic<int> nKeysTrained(0);
+    int nKeysToTrain = 0;
+
     float amplMin = 0.0f;
     float amplMax = 0.0f;
     float thresholdCC = 0.5f;
@@ -242,6 +276,40 @@ int main(int argc, char ** argv) {
     TValueCC predictedCC = -1.0f;
     auto tLastDetectedKeyStroke = std::chrono::high_resolution_clock::now();
 
+    // live refinement: the next detected press after a typed key is folded into the template of that key
+    bool refineTemplates = false;
+    std::atomic<int> refineKey(-1);
+    std::atomic<int> nRefined(0);
+
+    if (hasModel) {
+        keySoundAverageAmpl = std::move(model.templates);
+        trainStats = std::move(model.trainStats);
+        amplMin = model.amplMin;
+        amplMax = model.amplMax;
+
+        isReadyToPredict = true;
+        doRecord = true;
+    }
+
+    auto loadInput = [&](const std::vector<std::string> & fnames) {
+        auto tStart = std::chrono::high_resolution_clock::now();
+        TrainingDataStats trainingDataStats;
+        if (loadTrainingData(fnames, filterInput, keySoundHistoryAmpl, trainingDataStats) == false) {
+            return false;
+        }
+        auto tEnd = std::chrono::high_resolution_clock::now();
+        printf("Loaded %d key presses of %d keys from %d file(s) (%g MB) in %g ms\n",
+               trainingDataStats.nRecords, trainingDataStats.nKeys, trainingDataStats.nFiles,
+               trainingDataStats.nBytes/1024.0/1024.0, std::chrono::duration<double, std::milli>(tEnd - tStart).count());
+        return true;
+    };
+
+    if (hasModel == false && inputFiles.empty() == false) {
+        if (loadInput(inputFiles) == false) {
+            return -2;
+        }
+    }
+
     // ring buffer
     int rbBegin = 0;
     double rbAverage = 0.0f;
@@ -249,7 +317,7 @@ int main(int argc, char ** argv) {
     rbSamples.fill(0.0f);
 
     // Train data
-    bool isAcquiringTrainData = (argc == 1) ? true : false;
+    bool isAcquiringTrainData = (inputFiles.empty() && hasModel == false) ? true : false;
     std::map<int, int> nTimes;
     size_t totalSize_bytes = 0;
     std::ofstream foutTrain("train_default.kbd", std::ios::binary);
@@ -265,90 +333,108 @@ int main(int argc, char ** argv) {
         std::vector<int> positionsToPredict;
     };
 
-    std::mutex mutex;
-    std::deque<WorkData> workQueue;
-    std::thread worker([&]() {
-        int lastkey = -1;
-        double lastcc = -1.0f;
+    struct WorkResult {
+        std::vector<TKeyPrediction> predictions;
+        std::vector<TKeyWaveform> presses;  // kSamplesPerWaveform samples around every position
+    };
 
-        while (finishApp == false) {
-            bool process = false;
-            WorkData workData;
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                while (workQueue.size() > 30 && processingRecord == false) {
-                    workQueue.pop_front();
-                    printf("pop\n");
+    // the templates are shared by all workers, the CC search of each template is split between nWorkersCC threads
+    int nWorkersPredict = argm["workers"].empty() ? 2 : std::max(1, std::stoi(argm["workers"]));
+    int nWorkersCC = std::max(1, std::min(4, getNumThreads()/nWorkersPredict));
+    int queueCapacity = argm["queue"].empty() ? 64 : std::max(1, std::stoi(argm["queue"]));
+
+    // lower the matching quality while the queue is backed up, instead of dropping key presses
+    bool useQoS = argm["qos"].empty() || std::stoi(argm["qos"]) != 0;
+    PredictionQoS qos(queueCapacity);
+
+    // refining a template modifies it while the other workers might be matching against it
+    std::shared_timed_mutex mutexTemplates;
+
+    int lastkey = -1;
+    double lastcc = -1.0f;
+
+    WorkQueue<WorkData, WorkResult> workQueue;
+    workQueue.start(nWorkersPredict, queueCapacity,
+        [&](WorkData & workData, WorkResult & result) {
+            //int alignWindow = kSamplesPerFrame/2;
+            PredictionQuality quality = PredictionQoS::levels()[0];
+            if (useQoS && processingRecord == false) {
+                quality = qos.update(workQueue.size());
+            }
+
+            const auto & ampl = workData.ampl;
+            const auto & positionsToPredict = workData.positionsToPredict;
+
+            result.predictions.resize(positionsToPredict.size());
+            result.presses.resize(positionsToPredict.size());
+            for (int ipos = 0; ipos < (int) positionsToPredict.size(); ++ipos) {
+                auto curPos = positionsToPredict[ipos];
+                {
+                    std::shared_lock<std::shared_timed_mutex> lock(mutexTemplates);
+                    predictKeyPress(keySoundAverageAmpl, ampl, curPos, quality.alignWindow, nWorkersCC, result.predictions[ipos], quality.nCandidates);
                 }
 
-                if (workQueue.size() > 0) {
-                    workData = std::move(workQueue.front());
-                    workQueue.pop_front();
-                    process = true;
+                auto & press = result.presses[ipos];
+                press.assign(kSamplesPerWaveform, 0.0f);
+                for (int i = 0; i < kSamplesPerWaveform; ++i) {
+                    int idx = curPos - kSamplesPerWaveform/2 + i;
+                    if (idx < 0 || idx >= (int) ampl.size()) continue;
+                    press[i] = ampl[idx];
                 }
             }
-            if (process) {
-                const auto & ampl = workData.ampl;
-                const auto & positionsToPredict = workData.positionsToPredict;
-
-                //int alignWindow = kSamplesPerFrame/2;
-                int alignWindow = 64;
-
-                for (int ipos = 0; ipos < positionsToPredict.size() ; ++ipos) {
-                    auto curPos = positionsToPredict[ipos];
-                    int scmp0 = curPos - kSamplesPerFrame;
-                    int scmp1 = curPos + kSamplesPerFrame;
-
-                    char res = -1;
-                    TValueCC maxcc = -1.0f;
-                    TOffset offs = 0;
-                    TKeyConfidenceMap keyConfidenceTmp;
-                    for (const auto & ka : keySoundAverageAmpl) {
-                        //auto [bestcc, bestoffset] = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto ret = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        auto bestoffset = std::get<1>(ret);
-
-                        if (bestcc > maxcc) {
-                            res = ka.first;
-                            maxcc = bestcc;
-                            offs = bestoffset;
+        },
+        [&](WorkData & , WorkResult & result) {
+            for (int ipos = 0; ipos < (int) result.predictions.size(); ++ipos) {
+                const auto & prediction = result.predictions[ipos];
+                const auto & press = result.presses[ipos];
+
+                int labeledKey = refineKey.exchange(-1);
+                if (labeledKey != -1) {
+                    std::lock_guard<std::shared_timed_mutex> lock(mutexTemplates);
+                    auto it = keySoundAverageAmpl.find(labeledKey);
+                    auto its = trainStats.find(labeledKey);
+                    if (it != keySoundAverageAmpl.end() && its != trainStats.end()) {
+                        TValueCC cc = 0.0f;
+                        TOffset offset = 0;
+                        if (foldKeyPress(it->second, its->second, press, kSamplesPerWaveform/2, thresholdCC, cc, offset)) {
+                            ++nRefined;
+                            printf("    Refined '%s' - cc = %g, offset = %d\n", kKeyText.at(labeledKey), cc, offset);
+                        } else {
+                            printf("    Skipped '%s' - cc = %g is below the threshold\n", kKeyText.at(labeledKey), cc);
                         }
-                        keyConfidenceTmp[ka.first] = bestcc;
                     }
+                }
 
-                    if (maxcc > thresholdCC) {
-                        if (lastkey != res || lastcc != maxcc) {
-                            printf("    Prediction: '%c'        (%8.5g), ntest = %d\n", res, maxcc, ntest);
-                            predictedKey = res;
-                            predictedCC = maxcc;
-                            predictedHistory[predictedHistoryBegin].clear();
-                            predictedHistory[predictedHistoryBegin].push_back(predictedKey);
-                            for (auto & c : keyConfidenceTmp) {
-                                keyConfidence[c.first] = c.second/maxcc;
-                                keyConfidenceDisplay[c.first] = std::pow(c.second/maxcc, 4.0f);
-                                if (c.first != predictedKey && c.second/maxcc > 0.9f) {
-                                    predictedHistory[predictedHistoryBegin].push_back(c.first);
-                                }
-                            }
-                            if (++predictedHistoryBegin >= predictedHistory.size()) predictedHistoryBegin = 0;
-                            for (int i = 0; i < kSamplesPerWaveform; ++i) {
-                                int idx = curPos + offs - kSamplesPerWaveform/2 + i;
-                                if (idx < 0 || idx >= (int) ampl.size()) continue;
-                                predictedAmpl[i] = ampl[idx];
+                if (prediction.cc > thresholdCC) {
+                    if (lastkey != prediction.key || lastcc != prediction.cc) {
+                        printf("    Prediction: '%c'        (%8.5g), ntest = %d\n", prediction.key, prediction.cc, ntest);
+                        predictedKey = prediction.key;
+                        predictedCC = prediction.cc;
+                        predictedHistory[predictedHistoryBegin].clear();
+                        predictedHistory[predictedHistoryBegin].push_back(predictedKey);
+                        for (auto & c : prediction.confidence) {
+                            keyConfidence[c.first] = c.second/prediction.cc;
+                            keyConfidenceDisplay[c.first] = std::pow(c.second/prediction.cc, 4.0f);
+                            if (c.first != predictedKey && c.second/prediction.cc > 0.9f) {
+                                predictedHistory[predictedHistoryBegin].push_back(c.first);
                             }
                         }
-                        lastkey = res;
-                        lastcc = maxcc;
+                        if (++predictedHistoryBegin >= predictedHistory.size()) predictedHistoryBegin = 0;
+                        for (int i = 0; i < kSamplesPerWaveform; ++i) {
+                            int idx = prediction.offset + i;
+                            if (idx < 0 || idx >= (int) press.size()) continue;
+                            predictedAmpl[i] = press[idx];
+                        }
                     }
-                    ++ntest;
+                    lastkey = prediction.key;
+                    lastcc = prediction.cc;
                 }
-
-            } else {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++ntest;
             }
-        }
-    });
+        },
+        [&](int iWorker) {
+            applyThreadPolicy(("worker " + std::to_string(iWorker)).c_str(), threadConfig.workers);
+        });
 
     AudioLogger::Callback cbAudio = [&](const AudioLogger::Record & frames) {
         if (isAcquiringTrainData) {
@@ -438,10 +524,9 @@ int main(int argc, char ** argv) {
                 }
                 workData.positionsToPredict = positionsToPredict;
 
-                {
-                    std::lock_guard<std::mutex> lock(mutex);
-                    workQueue.push_back(std::move(workData));
-                }
+                // during playback the producer waits for the workers instead of dropping jobs
+                // the dropped jobs are shown in the window, the callback does not print
+                workQueue.push(std::move(workData), processingRecord == false);
             }
 
             doRecord = true;
@@ -459,55 +544,59 @@ int main(int argc, char ** argv) {
     };
 
     g_init = [&]() {
+        if (filterCapture.empty() == false) {
+            audioLogger.setFilter([&](AudioLogger::Sample * samples, int64_t n) { filterCapture.process(samples, n); });
+        }
+        if (threadConfig.capture.empty() == false) {
+            audioLogger.setThreadInit([&]() { applyThreadPolicy("capture", threadConfig.capture); });
+        }
+
         if (audioLogger.install(kSampleRate, cbAudio, captureId) == false) {
             fprintf(stderr, "Failed to install audio logger\n");
             return -1;
         }
 
-        printf("[+] Collecting training data\n");
+        if (isReadyToPredict) {
+            printf("[+] Predicting\n");
+        } else {
+            printf("[+] Collecting training data\n");
+        }
         g_isInitialized = true;
         return 0;
     };
 
     g_handleKey = [&](int key) {
-        if (keyPressed == -1 && isReadyToPredict == false) {
+        if (keyPressed == -1 && isReadyToPredict == false && trainer.joinable() == false) {
             predictedKey = -1;
             keyPressed = key;
             audioLogger.record(kTrainBufferSize_s);
+        } else if (isReadyToPredict && refineTemplates) {
+            refineKey = key;
         }
     };
 
-    g_update = [&]() {
-        if (isAcquiringTrainData) {
-            return;
+    auto saveModel = [&]() {
+        if (argm["save-model"].empty()) return;
+
+        model.amplMin = amplMin;
+        model.amplMax = amplMax;
+        model.templates = keySoundAverageAmpl;
+        model.trainStats = trainStats;
+        if (saveKeyModel(argm["save-model"], model)) {
+            printf("[+] Saved model to '%s'\n", argm["save-model"].c_str());
+        } else {
+            printf("[!] Failed to save model to '%s'\n", argm["save-model"].c_str());
         }
+    };
 
-        if (processingInput) {
-            if (keyPressed == -1) {
-                AudioLogger::Frame frame;
-                AudioLogger::Record record;
-                fins[curFile].read((char *)(&keyPressed), sizeof(keyPressed));
-                if (fins[curFile].eof()) {
-                    ++curFile;
-                    if (curFile >= fins.size()) {
-                        processingInput = false;
-                    }
-                } else {
-                    printf("%c", keyPressed);
-                    fflush(stdout);
-                    for (int i = 0; i < kTrainBufferSize_frames; ++i) {
-                        fins[curFile].read((char *)(frame.data()), sizeof(AudioLogger::Sample)*frame.size());
-                        record.push_back(frame);
-                    }
-                    cbAudio(record);
-                }
-            }
+    g_update = [&]() {
+        if (isAcquiringTrainData) {
             return;
         }
 
         if (processingRecord) {
             if (frecord.eof()) {
-                if (workQueue.size() == 0) {
+                if (workQueue.idle()) {
                     printf("[+] Done. Continuing capturing microphone audio \n");
                     processingRecord = false;
                     audioLogger.resume();
@@ -526,6 +615,7 @@ int main(int argc, char ** argv) {
                 }
                 for (int i = 0; i < nRead; ++i) {
                     frecord.read((char *)(frame.data()), sizeof(AudioLogger::Sample)*frame.size());
+                    filterCapture.process(frame.data(), frame.size());
                     if (frecord.eof()) {
                         printf("[+] Waiting for work queue to get processed. Remaining jobs = %d \n", (int) workQueue.size());
                         record.clear();
@@ -544,242 +634,40 @@ int main(int argc, char ** argv) {
         }
 
         if (isReadyToPredict == false) {
-            printf("[+] Training\n");
-
-            std::vector<TKey> failedToTrain;
-
-            auto trainKey = [&](TKey key) {
-                auto & history = keySoundHistoryAmpl[key];
-
-                int nWaveforms = history.size();
-                int nFramesPerWaveform = kTrainBufferSize_frames;
-
-                printf("    - Training key '%c'\n", key);
-                printf("    - History size = %d key waveforms\n", nWaveforms);
-                printf("    - Frames per key waveform   = %d\n", nFramesPerWaveform);
-                printf("    - Total frames available    = %d\n", nWaveforms*nFramesPerWaveform);
-                printf("    - Samples per frame         = %d\n", (int) kSamplesPerFrame);
-                printf("    - Total samples available   = %d\n", (int) (nWaveforms*nFramesPerWaveform*kSamplesPerFrame));
-
-                printf("    - Estimating waveform peaks ...\n");
-                std::vector<int> peakSum;
-                std::vector<int> peakMax;
-
-                peakSum.clear();
-                peakMax.clear();
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    int isum = -1;
-                    double asum = 0.0f;
-                    double aisum = 0.0f;
-
-                    int imax = -1;
-                    double amax = 0.0f;
-
-                    const auto & waveform = history[iwaveform];
-
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        double acur = std::abs(waveform[icur]);
-                        double acur2 = acur*acur;
-
-                        asum += acur2;
-                        aisum += acur2*icur;
-
-                        if (acur > amax) {
-                            amax = acur;
-                            imax = icur;
-                        }
-                    }
-
-                    isum = aisum/asum;
-
-                    peakSum.push_back(isum);
-                    peakMax.push_back(imax);
-                    //printf("        Estimated peak: %d (method - sum), %d (method - max)\n", isum, imax);
-                }
-
-                auto calcStdev = [](const std::vector<int> & data) {
-                    double sum = 0.0f;
-                    double sum2 = 0.0f;
-                    for (const auto & p : data) {
-                        sum += p;
-                        sum2 += p*p;
-                    }
-                    sum /= data.size();
-                    sum2 /= data.size();
-                    return sqrt(sum2 - sum*sum);
-                };
-
-                double stdevSum = calcStdev(peakSum);
-                double stdevMax = calcStdev(peakMax);
-
-                printf("    - Stdev of estimated peaks: %g (sum) vs %g (max)\n", stdevSum, stdevMax);
-
-                const auto & peakUsed = peakMax;
-                printf("    - Using 'max' estimation\n");
-
-                int centerSample = kSamplesPerWaveform/2;
-
-                printf("    - Centering waveforms at sample %d\n", centerSample);
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    int offset = peakUsed[iwaveform] - centerSample;
-                    //printf("        Offset for waveform %-4d = %-4d\n", iwaveform, offset);
-
-                    auto newWaveform = TKeyWaveform();
-                    newWaveform.resize(kSamplesPerWaveform);
-                    auto & waveform = history[iwaveform];
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        int iorg = icur + offset;
-
-                        if (iorg >= 0 && iorg < kSamplesPerWaveform) {
-                            newWaveform[icur] = waveform[iorg];
-                        } else {
-                            newWaveform[icur] = 0.0f;
-                        }
-                    }
-
-                    waveform = std::move(newWaveform);
-                }
-
-                int alignWindow = 64;
-                printf("    - Calculating CC pairs\n");
-                printf("      Align window = %d\n", alignWindow);
-
-                int bestw = -1;
-                int ntrain = 0;
-                double bestccsum = -1.0f;
-                double bestosum = 1e10;
-                std::map<int, std::map<int, std::tuple<TValueCC, TOffset>>> ccs;
-
-                for (int alignToWaveform = 0; alignToWaveform < nWaveforms; ++alignToWaveform) {
-                    ccs[alignToWaveform][alignToWaveform] = std::tuple<TValueCC, TOffset>(1.0f, 0);
-
-                    int is0 = centerSample - kSamplesPerFrame;
-                    int is1 = centerSample + kSamplesPerFrame;
-
-                    const auto & waveform0 = history[alignToWaveform];
-
-                    for (int iwaveform = alignToWaveform + 1; iwaveform < nWaveforms; ++iwaveform) {
-                        const auto & waveform1 = history[iwaveform];
-                        //auto [bestcc, bestoffset] = findBestCC(waveform0, waveform1, is0, is1, alignWindow);
-                        auto ret = findBestCC(waveform0, waveform1, is0, is1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        auto bestoffset = std::get<1>(ret);
-
-                        ccs[iwaveform][alignToWaveform] = std::tuple<TValueCC, TOffset>(bestcc, bestoffset);
-                        ccs[alignToWaveform][iwaveform] = std::tuple<TValueCC, TOffset>(bestcc, -bestoffset);
-                    }
-
-                    int curntrain = 0;
-                    double curccsum = 0.0;
-                    double curosum = 0.0;
-                    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                        //auto [cc, offset] = ccs[iwaveform][alignToWaveform];
-                        auto cc     = std::get<0>(ccs[iwaveform][alignToWaveform]);
-                        auto offset = std::get<1>(ccs[iwaveform][alignToWaveform]);
-
-                        if (std::abs(offset) > 50) continue;
-                        ++curntrain;
-                        curccsum += cc*cc;
-                        curosum += offset*offset;
-                    }
-
-                    if (curccsum > bestccsum) {
-                    //if (curosum < bestosum) {
-                        ntrain = curntrain;
-                        bestw = alignToWaveform;
-                        bestccsum = curccsum;
-                        bestosum = curosum;
-                    }
-                }
-                bestccsum = sqrt(bestccsum/ntrain);
-
-                trainStats[key].nWaveformsUsed = ntrain;
-                trainStats[key].nWaveformsTotal = nWaveforms;
-                trainStats[key].averageCC = bestccsum;
-
-                printf("    - Aligning all waveforms to waveform %d, (cost = %g)\n", bestw, bestccsum);
-#ifdef OUTPUT_WAVEFORMS
-                std::ofstream fout(std::string("waveform_one_") + std::to_string(key) + ".plot");
-                for (auto & v : history[bestw]) fout << v << std::endl;
-                fout << std::endl;
-#endif
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    if (iwaveform == bestw) continue;
-
-                    auto & waveform1 = history[iwaveform];
-                    //auto [cc, offset] = ccs[iwaveform][bestw];
-                    //auto cc     = std::get<0>(ccs[iwaveform][bestw]);
-                    auto offset = std::get<1>(ccs[iwaveform][bestw]);
-
-                    auto newWaveform = TKeyWaveform();
-                    newWaveform.resize(kSamplesPerWaveform);
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        int iorg = icur + offset;
-
-                        if (iorg >= 0 && iorg < kSamplesPerWaveform) {
-                            newWaveform[icur] = waveform1[iorg];
-                        } else {
-                            newWaveform[icur] = 0.0f;
-                        }
-                    }
-
-                    waveform1 = std::move(newWaveform);
-#ifdef OUTPUT_WAVEFORMS
-                    for (auto & v : waveform1) fout << v << std::endl;
-                    fout << std::endl;
-#endif
-                }
-
-                printf("    - Calculating average waveform\n");
-                double ccsum = 0.0f;
-                double norm = 0.0f;
-                auto & avgWaveform = keySoundAverageAmpl[key];
-                avgWaveform.resize(kSamplesPerWaveform);
-                std::fill(avgWaveform.begin(), avgWaveform.end(), 0.0f);
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    //auto [cc, offset] = ccs[iwaveform][bestw];
-                    auto cc     = std::get<0>(ccs[iwaveform][bestw]);
-                    auto offset = std::get<1>(ccs[iwaveform][bestw]);
-
-                    //if (std::abs(offset) > 5) continue;
-                    printf("        Adding waveform %d - cc = %g, offset = %d\n", iwaveform, cc, offset);
-                    ccsum += cc*cc;
-                    norm += cc*cc;
-                    auto & waveform = history[iwaveform];
-                    for (int is = 0; is < kSamplesPerWaveform; ++is) {
-                        avgWaveform[is] += cc*cc*waveform[is];
-                    }
-                }
-
-                norm = 1.0f/(norm);
-                for (int is = 0; is < kSamplesPerWaveform; ++is) {
-                    avgWaveform[is] *= norm;
-                    if (avgWaveform[is] > amplMax) amplMax = avgWaveform[is];
-                    if (avgWaveform[is] < amplMin) amplMin = avgWaveform[is];
-                }
-
-#ifdef OUTPUT_WAVEFORMS
-                {
-                    std::ofstream fout(std::string("waveform_avg_") + std::to_string(key) + ".plot");
-                    for (auto & v : avgWaveform) fout << v << std::endl;
-                }
-#endif
+            // train on a separate thread, so that the UI keeps rendering
+            if (trainer.joinable() == false) {
+                printf("[+] Training\n");
+                nKeysToTrain = keySoundHistoryAmpl.size();
+                nKeysTrained = 0;
+                isTrainingDone = false;
+                trainer = std::thread([&]() {
+                    trainKeys(keySoundHistoryAmpl, trainResults, &nKeysTrained, getNumThreads(), trainMethod);
+                    isTrainingDone = true;
+                });
+            }
 
-                if (ccsum*norm < 0.50f || (1.0f/norm < nWaveforms/3)) {
-                    failedToTrain.push_back(key);
-                }
+            if (isTrainingDone == false) {
+                return;
+            }
 
-                printf("\n");
-            };
+            trainer.join();
 
-            for (const auto & kh : keySoundHistoryAmpl) {
-                if (kh.second.size() > 2) {
-                    trainKey(kh.first);
-                } else {
-                    printf("[!] Key '%s' does not have enough training data. Need at least 3 presses\n", kKeyText.at(kh.first));
-                    failedToTrain.push_back(kh.first);
+            std::vector<TKey> failedToTrain;
+            for (auto & kr : trainResults) {
+                auto & res = kr.second;
+                printf("%s", res.log.c_str());
+                if (res.failed) failedToTrain.push_back(kr.first);
+                if (res.average.empty()) continue;
+
+                for (const auto & v : res.average) {
+                    if (v > amplMax) amplMax = v;
+                    if (v < amplMin) amplMin = v;
                 }
+                keySoundAverageAmpl[kr.first] = std::move(res.average);
+                trainStats[kr.first] = res.stats;
             }
+            trainResults.clear();
+
             printf("Failed to train the following keys: ");
             for (auto & k : failedToTrain) printf("'%c' ", k);
             printf("\n");
@@ -795,6 +683,8 @@ int main(int argc, char ** argv) {
                 for (auto & v : kh.second) v = (v/curAmplMax)*amplMax;
             }
 
+            saveModel();
+
             audioLogger.resume();
 
             printf("[+] Ready to predict. Keep pressing keys and the program will guess which key was pressed\n");
@@ -823,6 +713,14 @@ int main(int argc, char ** argv) {
                 case SDL_WINDOWEVENT:
                     if (event.window.event == SDL_WINDOWEVENT_CLOSE && event.window.windowID == SDL_GetWindowID(window)) finishApp = true;
                     break;
+#ifndef __EMSCRIPTEN__
+                // the web version receives the keys through keyPressedCallback
+                case SDL_TEXTINPUT:
+                    if (io.WantTextInput == false) {
+                        g_handleKey(std::tolower((unsigned char) event.text.text[0]));
+                    }
+                    break;
+#endif
             };
         }
 
@@ -845,20 +743,13 @@ int main(int argc, char ** argv) {
                 audioLogger.pause();
                 std::this_thread::sleep_for(std::chrono::milliseconds(500));
                 foutTrain.close();
-                fins[0] = std::ifstream("train_default.kbd", std::ios::binary);
-                if (fins[0].good()) {
-                    int bufferSize_frames = 1;
-                    fins[0].read((char *)(&bufferSize_frames), sizeof(bufferSize_frames));
-                    if (bufferSize_frames != kTrainBufferSize_frames) {
-                        printf("Buffer size in file (%d) does not match the expected one (%d)\n", bufferSize_frames, (int) kTrainBufferSize_frames);
-                    }
-                }
-                processingInput = true;
+                loadInput({ "train_default.kbd" });
                 isAcquiringTrainData = false;
                 audioLogger.resume();
             }
         } else if (isReadyToPredict == false) {
             ImGui::Text("Training ... Please wait");
+            ImGui::ProgressBar(nKeysToTrain > 0 ? ((float) nKeysTrained)/nKeysToTrain : 0.0f, { ImGui::GetContentRegionAvailWidth(), 0.0f });
         } else {
             {
                 static char inp[128] = { "record.kbd" };
@@ -869,6 +760,7 @@ int main(int argc, char ** argv) {
                     frecord = std::ifstream(inp, std::ios::binary);
                     if (frecord.good()) {
                         audioLogger.pause();
+                        filterCapture.reset();
                         processingRecord = true;
                         ntest = 0;
                     }
@@ -888,11 +780,30 @@ int main(int argc, char ** argv) {
                         (float)(std::chrono::duration_cast<std::chrono::milliseconds>(tNow - tLastDetectedKeyStroke).count()/1000.0f));
             ImGui::Text("Average background level: %16.13f\n", rbAverage);
             ImGui::SliderFloat("Threshold background", &thresholdBackground, 0.1f, 300.0f);
-            ImGui::Text("Tasks in queue: %d\n", (int) workQueue.size());
+            {
+                auto stats = workQueue.stats();
+                ImGui::Text("Tasks in queue: %d / %d, workers: %d, dropped: %d\n",
+                            stats.nQueued, workQueue.capacity(), stats.nWorkers, (int) stats.nDropped);
+
+                const auto & quality = PredictionQoS::levels()[qos.level()];
+                ImGui::Text("Quality level: %d (align window = %d, candidates = %d)%s\n",
+                            qos.level(), quality.alignWindow, quality.nCandidates, useQoS ? "" : " - disabled");
+            }
             ImGui::Text("\n");
 
             static bool displayConfidence = false;
             ImGui::Checkbox("Display confidence", &displayConfidence);
+            ImGui::SameLine();
+            ImGui::Checkbox("Refine templates", &refineTemplates);
+            if (ImGui::IsItemHovered()) {
+                ImGui::BeginTooltip();
+                ImGui::Text("Type the keys that you press - each typed key is folded into its template");
+                ImGui::EndTooltip();
+            }
+            if (refineTemplates) {
+                ImGui::SameLine();
+                ImGui::Text("Refined presses: %d", (int) nRefined);
+            }
 
             auto drawList = ImGui::GetWindowDrawList();
 
@@ -1041,6 +952,11 @@ int main(int argc, char ** argv) {
     };
 
     init();
+
+    // applied after the capture and the worker threads are started, the threads that the GUI thread starts
+    // later, e.g. the trainer, inherit it
+    applyThreadPolicy("gui", threadConfig.gui);
+
 #ifdef __EMSCRIPTEN__
     emscripten_set_main_loop(mainUpdate, 60, 1);
 #else
@@ -1049,7 +965,12 @@ int main(int argc, char ** argv) {
     }
 #endif
 
-    worker.join();
+    workQueue.stop();
+    if (trainer.joinable()) trainer.join();
+
+    if (nRefined > 0) {
+        saveModel();
+    }
 
     printf("[+] Terminated");
 
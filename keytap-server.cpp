@@ -0,0 +1,424 @@
+/*! \file keytap-server.cpp
+ *  \brief Serves keytap predictions to several local clients that stream audio over a Unix-domain socket
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "key_model.h"
+#include "key_detection.h"
+#include "work_queue.h"
+#include "server_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static std::atomic<bool> g_isRunning(true);
+
+// messages queued for a client that does not read them, before it is disconnected
+static const int kClientMaxOutgoing = 4096;
+
+// One connected client. The reader thread owns the audio stream and the detection state. The messages to the
+// client are queued and written by its sender thread, so the workers that deliver the predictions never wait
+// for the socket. The socket is closed when the last pending job of the client is delivered.
+struct Client {
+    struct Frame {
+        ServerMessage type;
+        std::vector<uint8_t> payload;
+    };
+
+    int id = 0;
+    int fd = -1;
+    int model = -1;
+
+    std::atomic<bool> isAlive { true };
+    std::atomic<uint64_t> nPresses { 0 };
+    std::atomic<uint64_t> nPredictions { 0 };
+
+    std::mutex mutexSend;
+    std::condition_variable cvSend;
+    std::deque<Frame> outgoing;
+    bool isClosing = false;
+    std::thread sender;
+
+    std::mutex mutexPending;
+    std::condition_variable cvPending;
+    int nPending = 0;
+
+    ~Client() {
+        finish();
+        if (fd >= 0) close(fd);
+    }
+
+    void start() {
+        sender = std::thread([this]() { sendLoop(); });
+    }
+
+    // writes the queued messages and stops the sender thread
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutexSend);
+            isClosing = true;
+        }
+        cvSend.notify_one();
+        if (sender.joinable()) sender.join();
+    }
+
+    // queues the message and returns right away
+    // a client that does not read its messages is disconnected instead of stalling the other clients
+    bool send(ServerMessage type, const void * payload, uint32_t size) {
+        if (isAlive == false) return false;
+        {
+            std::lock_guard<std::mutex> lock(mutexSend);
+            if ((int) outgoing.size() >= kClientMaxOutgoing) {
+                disconnect();
+                return false;
+            }
+            const uint8_t * data = (const uint8_t *) payload;
+            outgoing.push_back({ type, std::vector<uint8_t>(data, data + size) });
+        }
+        cvSend.notify_one();
+        return true;
+    }
+
+    bool sendError(const std::string & text) {
+        return send(ServerMessage::Error, text.data(), text.size());
+    }
+
+    void disconnect() {
+        isAlive = false;
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    // the only thread that writes to the socket, a slow client blocks only here
+    void sendLoop() {
+        std::unique_lock<std::mutex> lock(mutexSend);
+        while (true) {
+            cvSend.wait(lock, [this]() { return outgoing.empty() == false || isClosing; });
+            if (outgoing.empty() || isAlive == false) break;
+
+            Frame frame = std::move(outgoing.front());
+            outgoing.pop_front();
+
+            lock.unlock();
+            bool ok = serverWriteFrame(fd, frame.type, frame.payload.data(), frame.payload.size());
+            lock.lock();
+
+            if (ok == false) {
+                disconnect();
+                break;
+            }
+            if (frame.type == ServerMessage::Prediction) ++nPredictions;
+        }
+        outgoing.clear();
+    }
+};
+
+struct ServerJob {
+    std::shared_ptr<Client> client;
+    int64_t sampleIndex = 0;
+    TKeyWaveform ampl;
+};
+
+struct ServerResult {
+    TKeyPrediction prediction;
+};
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s --load-model F[,F2,...] [--socket PATH] [-pF] [-tF] [--workers N] [--queue N]\n", argv[0]);
+    printf("    --load-model F - models served to the clients, a client selects one by its index in this list\n");
+    printf("    --socket PATH  - Unix-domain socket to listen on (default %s)\n", kServerDefaultSocket);
+    printf("    -pF            - prediction threshold: only predictions with CC > F are sent (default 0.5)\n");
+    printf("    -tF            - background threshold: ampl > F*avg_background (default 10)\n");
+    printf("    --workers N    - number of prediction worker threads shared by all clients (default - all cores)\n");
+    printf("    --queue N      - maximum number of queued key presses, a client waits when it is full (default 256)\n");
+    printf("\n");
+
+    auto argm = parseCmdArguments(argc, argv);
+    if (argm["load-model"].empty()) {
+        printf("No models specified\n");
+        return -127;
+    }
+
+    const std::string socketPath = argm["socket"].empty() ? kServerDefaultSocket : argm["socket"];
+    const float thresholdCC = argm["p"].empty() ? 0.5f : std::stof(argm["p"]);
+    const float thresholdBackground = argm["t"].empty() ? 10.0f : std::stof(argm["t"]);
+    const int nWorkers = argm["workers"].empty() ? getNumThreads() : std::max(1, std::stoi(argm["workers"]));
+    const int queueCapacity = argm["queue"].empty() ? 256 : std::max(1, std::stoi(argm["queue"]));
+    const int alignWindow = 64;
+
+    // the models are loaded once and shared read-only by all clients and workers
+    std::vector<std::string> modelNames;
+    std::vector<KeyModel> models;
+    for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+        end = argm["load-model"].find(',', begin);
+        modelNames.push_back(argm["load-model"].substr(begin, end == std::string::npos ? end : end - begin));
+
+        KeyModel model;
+        if (loadKeyModel(modelNames.back(), model) == false) {
+            return -4;
+        }
+        if (model.templates.empty()) {
+            printf("Model '%s' has no keys\n", modelNames.back().c_str());
+            return -4;
+        }
+        printf("[+] Model %d: '%s' with %d keys\n", (int) models.size(), modelNames.back().c_str(), (int) model.templates.size());
+        models.emplace_back(std::move(model));
+    }
+
+    sockaddr_un addr;
+    if (serverSocketAddress(socketPath, addr) == false) {
+        printf("Socket path '%s' is too long\n", socketPath.c_str());
+        return -1;
+    }
+
+    int fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fdListen < 0) {
+        printf("Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // a socket file left by a previous run that did not exit cleanly is replaced, but not the one of a running server
+    struct stat st;
+    if (lstat(socketPath.c_str(), &st) == 0) {
+        int fdProbe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool isServing = fdProbe >= 0 && connect(fdProbe, (sockaddr *) &addr, sizeof(addr)) == 0;
+        if (fdProbe >= 0) close(fdProbe);
+        if (isServing) {
+            printf("Another server is already listening on '%s'\n", socketPath.c_str());
+            close(fdListen);
+            return -1;
+        }
+        if (S_ISSOCK(st.st_mode) == false) {
+            printf("'%s' exists and is not a socket\n", socketPath.c_str());
+            close(fdListen);
+            return -1;
+        }
+        unlink(socketPath.c_str());
+    }
+    if (bind(fdListen, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fdListen, 16) != 0) {
+        printf("Failed to listen on '%s': %s\n", socketPath.c_str(), strerror(errno));
+        close(fdListen);
+        return -1;
+    }
+
+    signal(SIGINT, [](int) { g_isRunning = false; });
+    signal(SIGTERM, [](int) { g_isRunning = false; });
+    signal(SIGPIPE, SIG_IGN);
+
+    WorkQueue<ServerJob, ServerResult> workQueue;
+    workQueue.start(nWorkers, queueCapacity,
+        [&](ServerJob & job, ServerResult & result) {
+            // the result slot is reused, so a skipped job must not leave the previous prediction in it
+            if (job.client->isAlive == false) {
+                result.prediction = TKeyPrediction();
+                return;
+            }
+            predictKeyPress(models[job.client->model].templates, job.ampl, kSamplesPerWaveform/2, alignWindow, 1, result.prediction);
+        },
+        [&](ServerJob & job, ServerResult & result) {
+            auto & client = *job.client;
+
+            const auto & prediction = result.prediction;
+            if (prediction.key != -1 && prediction.cc > thresholdCC) {
+                ServerPrediction msg;
+                msg.sampleIndex = job.sampleIndex;
+                msg.key = prediction.key;
+                msg.cc = prediction.cc;
+                msg.offset = prediction.offset;
+                msg.reserved = 0;
+                client.send(ServerMessage::Prediction, &msg, sizeof(msg));
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(client.mutexPending);
+                --client.nPending;
+            }
+            client.cvPending.notify_all();
+        });
+
+    // Every client keeps a window of its stream: enough history before the first unscanned sample for the
+    // background average and the snippets, and the new samples. Detection runs on each new frame up to the
+    // last position that has a full snippet after it, so the presses are the same as on the whole recording.
+    auto serveClient = [&](std::shared_ptr<Client> client) {
+        std::vector<uint8_t> payload;
+        ServerMessage type;
+
+        if (serverReadFrame(client->fd, type, payload) == false || type != ServerMessage::Hello || payload.size() != sizeof(ServerHello)) {
+            client->sendError("expected hello");
+            return;
+        }
+
+        ServerHello hello;
+        memcpy(&hello, payload.data(), sizeof(hello));
+        if (hello.sampleRate != kSampleRate) {
+            client->sendError("unsupported sample rate " + std::to_string(hello.sampleRate) + ", expected " + std::to_string(kSampleRate));
+            return;
+        }
+        if (hello.model < 0 || hello.model >= (int) models.size()) {
+            client->sendError("unknown model " + std::to_string(hello.model));
+            return;
+        }
+        client->model = hello.model;
+
+        printf("[+] Client %d connected, model '%s'\n", client->id, modelNames[client->model].c_str());
+
+        const int64_t nHistory = kBkgrRingBufferSize + kSamplesPerFrame + kSamplesPerWaveform/2;
+
+        std::vector<float> samples;
+        int64_t samplesBegin = 0;   // stream index of samples[0]
+        int64_t scanned = 0;        // stream index of the first sample that is not scanned yet
+
+        std::vector<int64_t> presses;
+        auto detect = [&](bool isLast) {
+            const int64_t n = samples.size();
+            const int64_t i0 = scanned - samplesBegin;
+            const int64_t i1 = isLast ? n : n - kSamplesPerWaveform/2;
+            if (i1 <= i0) return;
+
+            presses.clear();
+            detectKeyPresses(samples.data(), n, i0, i1, thresholdBackground, presses);
+            scanned = samplesBegin + i1;
+
+            for (auto pos : presses) {
+                ServerJob job;
+                job.client = client;
+                job.sampleIndex = samplesBegin + pos;
+                job.ampl.assign(kSamplesPerWaveform, 0.0f);
+                const int64_t is0 = pos - kSamplesPerWaveform/2;
+                for (int64_t i = std::max<int64_t>(0, -is0); i < kSamplesPerWaveform && is0 + i < n; ++i) {
+                    job.ampl[i] = samples[is0 + i];
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(client->mutexPending);
+                    ++client->nPending;
+                }
+                ++client->nPresses;
+
+                // waits when the queue is full, which throttles the clients that send faster than they can be served
+                workQueue.push(std::move(job), false);
+            }
+
+            const int64_t nDrop = std::max<int64_t>(0, scanned - nHistory - samplesBegin);
+            if (nDrop > 0) {
+                samples.erase(samples.begin(), samples.begin() + nDrop);
+                samplesBegin += nDrop;
+            }
+        };
+
+        bool isDone = false;
+        while (client->isAlive && g_isRunning) {
+            if (serverReadFrame(client->fd, type, payload) == false) break;
+
+            if (type == ServerMessage::Audio) {
+                if (payload.size() % sizeof(float) != 0) {
+                    client->sendError("audio frame is not a whole number of float32 samples");
+                    break;
+                }
+                const size_t n = payload.size()/sizeof(float);
+                const size_t n0 = samples.size();
+                samples.resize(n0 + n);
+                memcpy(samples.data() + n0, payload.data(), payload.size());
+                detect(false);
+            } else if (type == ServerMessage::End) {
+                detect(true);
+                isDone = true;
+                break;
+            } else {
+                client->sendError("unexpected message " + std::to_string((uint32_t) type));
+                break;
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(client->mutexPending);
+            client->cvPending.wait(lock, [&]() { return client->nPending == 0; });
+        }
+
+        if (isDone) client->send(ServerMessage::Done, nullptr, 0);
+        client->finish();
+
+        printf("[+] Client %d disconnected: %.1f s of audio, %d key presses, %d predictions sent\n", client->id,
+               double(samplesBegin + samples.size())/kSampleRate, (int) client->nPresses, (int) client->nPredictions);
+    };
+
+    struct Connection {
+        std::shared_ptr<Client> client;
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> isFinished;
+    };
+
+    std::list<Connection> connections;
+    int nClients = 0;
+
+    printf("[+] Listening on '%s' with %d workers. Press Ctrl+C to stop\n", socketPath.c_str(), nWorkers);
+
+    while (g_isRunning) {
+        for (auto it = connections.begin(); it != connections.end(); ) {
+            if (*it->isFinished) {
+                it->thread.join();
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        pollfd pfd = { fdListen, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0 || (pfd.revents & POLLIN) == 0) continue;
+
+        int fd = accept(fdListen, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        auto client = std::make_shared<Client>();
+        client->id = ++nClients;
+        client->fd = fd;
+        client->start();
+
+        auto isFinished = std::make_shared<std::atomic<bool>>(false);
+        std::thread thread([&serveClient, client, isFinished]() {
+            serveClient(client);
+            client->finish();
+            *isFinished = true;
+        });
+        connections.push_back({ client, std::move(thread), isFinished });
+    }
+
+    printf("[+] Stopping\n");
+
+    // wakes up the readers that wait for data, the queued presses of these clients are still delivered
+    for (auto & connection : connections) shutdown(connection.client->fd, SHUT_RD);
+    for (auto & connection : connections) connection.thread.join();
+    connections.clear();
+
+    auto stats = workQueue.stats();
+
+    workQueue.stop();
+    close(fdListen);
+    unlink(socketPath.c_str());
+
+    printf("[+] Served %d clients, %d key presses predicted on %d workers\n", nClients, (int) stats.nProcessed, stats.nWorkers);
+
+    return 0;
+}
@@ -0,0 +1,388 @@
+/*! \file keytap-sweep.cpp
+ *  \brief Grid search of the keytap detection and matching parameters on a labeled recording
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "audio_filter.h"
+#include "training_data.h"
+#include "mapped_recording.h"
+#include "key_detection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// The expensive steps are done once and shared by all grid points:
+//
+//   - detection runs once at the lowest background threshold, the presses of a higher threshold are a subset
+//   - there is one template bank per training method and number of presses per key
+//   - every detected press is matched once per bank at the largest align window, the best CC for each smaller
+//     window is taken from the same offset scan
+//
+// A grid point then only filters the cached predictions, so the whole grid is evaluated in a fraction of a second.
+
+static std::vector<float> parseList(const std::string & str, const std::vector<float> & def) {
+    if (str.empty()) return def;
+
+    std::vector<float> res;
+    for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+        end = str.find(',', begin);
+        auto cur = str.substr(begin, end == std::string::npos ? end : end - begin);
+        res.push_back(cur == "all" ? 0.0f : std::stof(cur));
+    }
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s train.kbd [train2.kbd ...] --record F --labels F [-fS] [--p L] [--t L] [--align L] [--presses L] [--train L] [--threads N] [--csv F]\n", argv[0]);
+    printf("    --record F  - recording to detect the key presses in (raw float32 or WAV)\n");
+    printf("    --labels F  - ground truth for the recording, one 'sampleIndex key' per line\n");
+    printf("    --p L       - prediction thresholds, comma-separated (default 0.3,0.4,0.5,0.6,0.7,0.8)\n");
+    printf("    --t L       - background thresholds (default 5,7.5,10,15,20,30)\n");
+    printf("    --align L   - align windows (default 8,16,32,64,128)\n");
+    printf("    --presses L - training presses per key, 'all' for all of them (default 4,8,all)\n");
+    printf("    --train L   - training methods (default pairwise)\n");
+    printf("    --threads N - number of threads (default - all cores)\n");
+    printf("    --csv F     - write all grid points to file F\n");
+    printf("\n");
+
+    auto argm = parseCmdArguments(argc, argv);
+    auto trainFiles = parseCmdPositional(argc, argv);
+
+    if (trainFiles.empty() || argm["record"].empty() || argm["labels"].empty()) {
+        return -127;
+    }
+
+    const int nThreads = argm["threads"].empty() ? getNumThreads() : std::max(1, std::stoi(argm["threads"]));
+
+    auto thresholdsCC = parseList(argm["p"], { 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f });
+    auto thresholdsBackground = parseList(argm["t"], { 5.0f, 7.5f, 10.0f, 15.0f, 20.0f, 30.0f });
+    auto alignWindowsF = parseList(argm["align"], { 8, 16, 32, 64, 128 });
+    auto pressesPerKeyF = parseList(argm["presses"], { 4, 8, 0 });
+
+    std::vector<int> alignWindows;
+    for (auto w : alignWindowsF) alignWindows.push_back(std::max(1, std::min((int) kSamplesPerWaveform/2 - (int) kSamplesPerFrame, (int) w)));
+    std::sort(alignWindows.begin(), alignWindows.end());
+    alignWindows.erase(std::unique(alignWindows.begin(), alignWindows.end()), alignWindows.end());
+    const int alignWindowMax = alignWindows.back();
+
+    std::vector<TrainMethod> trainMethods;
+    {
+        std::string str = argm["train"].empty() ? "pairwise" : argm["train"];
+        for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+            end = str.find(',', begin);
+            TrainMethod method;
+            auto cur = str.substr(begin, end == std::string::npos ? end : end - begin);
+            if (parseTrainMethod(cur, method) == false) {
+                printf("Unknown training method: '%s'\n", cur.c_str());
+                return -5;
+            }
+            trainMethods.push_back(method);
+        }
+    }
+
+    AudioFilter filterInput;
+    AudioFilter filterRecord;
+    if (argm["f"].empty() == false) {
+        if (filterInput.addSections(argm["f"], kSampleRate) == false || filterRecord.addSections(argm["f"], kSampleRate) == false) {
+            printf("Invalid filter specification: '%s'\n", argm["f"].c_str());
+            return -3;
+        }
+    }
+
+    // labels
+    std::vector<std::pair<int64_t, TKey>> labels;
+    {
+        std::ifstream fin(argm["labels"]);
+        if (fin.good() == false) {
+            printf("Failed to open labels file '%s'\n", argm["labels"].c_str());
+            return -2;
+        }
+        long long sampleIndex;
+        std::string key;
+        while (fin >> sampleIndex >> key) {
+            if (key.size() != 1 || kKeyText.find((unsigned char) key[0]) == kKeyText.end()) {
+                printf("Invalid key '%s' in the labels file\n", key.c_str());
+                return -2;
+            }
+            labels.emplace_back(sampleIndex, (unsigned char) key[0]);
+        }
+        std::sort(labels.begin(), labels.end());
+    }
+
+    // recording
+    MappedRecording recording;
+    if (recording.open(argm["record"]) == false) {
+        printf("Failed to open recording '%s'\n", argm["record"].c_str());
+        return -2;
+    }
+    const int64_t nSamples = recording.size();
+    const double duration_s = double(nSamples)/kSampleRate;
+
+    const float * samples = recording.samplesFloat();
+    std::vector<float> converted;
+    if (samples == nullptr || filterRecord.empty() == false) {
+        converted.resize(nSamples);
+        recording.read(0, nSamples, converted.data());
+        if (filterRecord.empty() == false) filterRecord.process(converted.data(), nSamples);
+        samples = converted.data();
+    }
+
+    // shared step 1: detection at the lowest threshold
+    auto tStart = std::chrono::high_resolution_clock::now();
+
+    std::vector<int64_t> presses;
+    std::vector<float> strength;
+    detectKeyPressesParallel(samples, nSamples, *std::min_element(thresholdsBackground.begin(), thresholdsBackground.end()),
+                             presses, nThreads, 1 << 18, &strength);
+
+    auto tDetected = std::chrono::high_resolution_clock::now();
+    double detect_ms = std::chrono::duration<double, std::milli>(tDetected - tStart).count();
+
+    printf("[+] %d candidate presses in %.1f s of audio, %d labels, detected in %g ms\n",
+           (int) presses.size(), duration_s, (int) labels.size(), detect_ms);
+
+    // the labeled press of every candidate, -1 if it is not within half a frame of one
+    std::vector<int> truth(presses.size(), -1);
+    for (int i = 0; i < (int) presses.size(); ++i) {
+        auto it = std::lower_bound(labels.begin(), labels.end(), std::make_pair(presses[i] - kSamplesPerFrame/2, (TKey) -1));
+        if (it != labels.end() && std::abs(it->first - presses[i]) <= kSamplesPerFrame/2) truth[i] = it - labels.begin();
+    }
+
+    // snippets around the candidates, zero-padded at the ends of the recording
+    std::vector<TKeyWaveform> snippets(presses.size());
+    parallelFor(presses.size(), nThreads, [&](int i) {
+        auto & snippet = snippets[i];
+        snippet.assign(kSamplesPerWaveform, 0.0f);
+        int64_t i0 = presses[i] - kSamplesPerWaveform/2;
+        for (int64_t j = std::max<int64_t>(0, -i0); j < kSamplesPerWaveform && i0 + j < nSamples; ++j) snippet[j] = samples[i0 + j];
+    });
+
+    // shared step 2: template banks
+    std::map<TKey, TKeyHistory> histories;
+    {
+        TrainingDataStats stats;
+        if (loadTrainingData(trainFiles, filterInput, histories, stats) == false) {
+            return -2;
+        }
+        printf("[+] Loaded %d training presses of %d keys\n", stats.nRecords, stats.nKeys);
+    }
+
+    struct Bank {
+        TrainMethod method;
+        int pressesPerKey;
+        std::map<TKey, TKeyWaveform> templates;
+        double train_ms = 0.0;
+
+        std::vector<double> predict_ms;     // per align window, measured on a sample of the candidates
+
+        // per candidate and align window
+        std::vector<TKey> key;
+        std::vector<TValueCC> cc;
+    };
+
+    std::vector<Bank> banks;
+    for (auto method : trainMethods) {
+        for (auto n : pressesPerKeyF) {
+            Bank bank;
+            bank.method = method;
+            bank.pressesPerKey = n;
+
+            std::map<TKey, TKeyHistory> cur;
+            for (const auto & kh : histories) {
+                int m = n > 0 ? std::min<int>(n, kh.second.size()) : kh.second.size();
+                cur[kh.first].assign(kh.second.begin(), kh.second.begin() + m);
+            }
+
+            auto t0 = std::chrono::high_resolution_clock::now();
+            std::map<TKey, TrainResult> results;
+            trainKeys(cur, results, nullptr, nThreads, method);
+            for (auto & kr : results) {
+                if (kr.second.average.empty()) continue;
+                bank.templates[kr.first] = std::move(kr.second.average);
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            bank.train_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+            banks.push_back(std::move(bank));
+        }
+    }
+    printf("[+] Trained %d template bank(s)\n", (int) banks.size());
+
+    // shared step 3: one offset scan per bank and candidate
+    const int nWindows = alignWindows.size();
+    for (auto & bank : banks) {
+        bank.key.assign(presses.size()*nWindows, -1);
+        bank.cc.assign(presses.size()*nWindows, -1.0f);
+
+        std::vector<std::tuple<TKey, const TKeyWaveform *, TSum, TSum2>> templates;
+        for (const auto & kt : bank.templates) {
+            int is00 = kt.second.size()/2 - kSamplesPerFrame;
+            auto ret = calcSum(kt.second, is00, is00 + 2*kSamplesPerFrame);
+            templates.emplace_back(kt.first, &kt.second, std::get<0>(ret), std::get<1>(ret));
+        }
+
+        parallelFor(presses.size(), nThreads, [&](int i) {
+            const auto & snippet = snippets[i];
+            const int scmp0 = kSamplesPerWaveform/2 - kSamplesPerFrame;
+            const int scmp1 = kSamplesPerWaveform/2 + kSamplesPerFrame;
+
+            for (const auto & t : templates) {
+                const auto & waveform0 = *std::get<1>(t);
+                int is00 = waveform0.size()/2 - kSamplesPerFrame;
+
+                std::vector<TValueCC> best(nWindows, -1.0f);
+                for (int o = -alignWindowMax; o < alignWindowMax; ++o) {
+                    auto cc = calcCC(waveform0, snippet, std::get<2>(t), std::get<3>(t), is00, scmp0 + o, scmp1 + o);
+                    for (int w = nWindows - 1; w >= 0 && o >= -alignWindows[w] && o < alignWindows[w]; --w) {
+                        if (cc > best[w]) best[w] = cc;
+                    }
+                }
+
+                for (int w = 0; w < nWindows; ++w) {
+                    if (best[w] > bank.cc[i*nWindows + w]) {
+                        bank.cc[i*nWindows + w] = best[w];
+                        bank.key[i*nWindows + w] = std::get<0>(t);
+                    }
+                }
+            }
+        });
+
+        // the CPU cost of a grid point is measured with the same matching that keytap runs
+        const int nSample = std::min<int>(64, presses.size());
+        for (auto w : alignWindows) {
+            auto t0 = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < nSample; ++i) {
+                TKeyPrediction res;
+                predictKeyPress(bank.templates, snippets[(i*presses.size())/nSample], kSamplesPerWaveform/2, w, 1, res);
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            bank.predict_ms.push_back(nSample > 0 ? std::chrono::duration<double, std::milli>(t1 - t0).count()/nSample : 0.0);
+        }
+    }
+
+    auto tCached = std::chrono::high_resolution_clock::now();
+    printf("[+] Matched all candidates in %g ms\n", std::chrono::duration<double, std::milli>(tCached - tDetected).count());
+
+    // grid evaluation
+    struct Point {
+        int bank;
+        int window;
+        float thresholdBackground;
+        float thresholdCC;
+
+        int nCorrect = 0;
+        int nWrong = 0;         // accepted predictions of a labeled press with the wrong key
+        int nSpurious = 0;      // accepted predictions away from the labeled presses
+        double accuracy = 0.0;  // nCorrect/(nLabels + nSpurious)
+        double cpu = 0.0;       // ms of matching per second of audio
+        bool pareto = false;
+    };
+
+    std::vector<Point> points;
+    for (int b = 0; b < (int) banks.size(); ++b) {
+        for (int w = 0; w < nWindows; ++w) {
+            for (auto tb : thresholdsBackground) {
+                for (auto tcc : thresholdsCC) {
+                    Point p;
+                    p.bank = b;
+                    p.window = w;
+                    p.thresholdBackground = tb;
+                    p.thresholdCC = tcc;
+                    points.push_back(p);
+                }
+            }
+        }
+    }
+
+    parallelFor(points.size(), nThreads, [&](int ip) {
+        auto & p = points[ip];
+        const auto & bank = banks[p.bank];
+
+        // a labeled press counts once, even if two candidates are close to it
+        std::vector<char> isUsed(labels.size(), 0);
+
+        int nScored = 0;
+        for (int i = 0; i < (int) presses.size(); ++i) {
+            if (strength[i] <= p.thresholdBackground) continue;
+            ++nScored;
+
+            const auto cc = bank.cc[i*nWindows + p.window];
+            const auto key = bank.key[i*nWindows + p.window];
+            if (cc <= p.thresholdCC) continue;
+
+            if (truth[i] == -1 || isUsed[truth[i]]) {
+                ++p.nSpurious;
+            } else if (labels[truth[i]].second == key) {
+                ++p.nCorrect;
+                isUsed[truth[i]] = 1;
+            } else {
+                ++p.nWrong;
+                isUsed[truth[i]] = 1;
+            }
+        }
+
+        p.accuracy = labels.empty() ? 0.0 : double(p.nCorrect)/(labels.size() + p.nSpurious);
+        p.cpu = (detect_ms + nScored*bank.predict_ms[p.window])/duration_s;
+    });
+
+    // a point is on the front if no other point is at least as accurate and at least as cheap, and better in one of them
+    for (auto & p : points) {
+        p.pareto = true;
+        for (const auto & q : points) {
+            if (q.accuracy >= p.accuracy && q.cpu <= p.cpu && (q.accuracy > p.accuracy || q.cpu < p.cpu)) {
+                p.pareto = false;
+                break;
+            }
+        }
+    }
+
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    printf("[+] Evaluated %d grid points in %g ms\n", (int) points.size(), std::chrono::duration<double, std::milli>(tEnd - tCached).count());
+
+    auto bankName = [&](const Bank & bank) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s/%s", bank.method == TrainMethod::AlignToMean ? "mean" : "pairwise",
+                 bank.pressesPerKey > 0 ? std::to_string(bank.pressesPerKey).c_str() : "all");
+        return std::string(buf);
+    };
+
+    if (argm["csv"].empty() == false) {
+        FILE * fout = fopen(argm["csv"].c_str(), "w");
+        if (fout == nullptr) {
+            printf("Failed to open '%s' for writing\n", argm["csv"].c_str());
+        } else {
+            fprintf(fout, "train,presses,align,t,p,correct,wrong,spurious,accuracy,cpu_ms_per_s,pareto\n");
+            for (const auto & p : points) {
+                const auto & bank = banks[p.bank];
+                fprintf(fout, "%s,%d,%d,%g,%g,%d,%d,%d,%g,%g,%d\n",
+                        bank.method == TrainMethod::AlignToMean ? "mean" : "pairwise", bank.pressesPerKey,
+                        alignWindows[p.window], p.thresholdBackground, p.thresholdCC,
+                        p.nCorrect, p.nWrong, p.nSpurious, p.accuracy, p.cpu, p.pareto ? 1 : 0);
+            }
+            fclose(fout);
+            printf("[+] Wrote %d grid points to '%s'\n", (int) points.size(), argm["csv"].c_str());
+        }
+    }
+
+    std::vector<const Point *> front;
+    for (const auto & p : points) if (p.pareto) front.push_back(&p);
+    std::sort(front.begin(), front.end(), [](const Point * a, const Point * b) { return a->cpu < b->cpu; });
+
+    printf("\n");
+    printf("[+] Accuracy / CPU Pareto front (accuracy = correct/(labels + spurious), CPU = ms of matching per second of audio):\n");
+    printf("    %-14s %6s %6s %6s %8s %8s %8s %10s %10s\n", "train/presses", "align", "-t", "-p", "correct", "wrong", "spurious", "accuracy", "cpu");
+    for (const auto * p : front) {
+        printf("    %-14s %6d %6g %6g %8d %8d %8d %9.2f%% %10.3f\n",
+               bankName(banks[p->bank]).c_str(), alignWindows[p->window], p->thresholdBackground, p->thresholdCC,
+               p->nCorrect, p->nWrong, p->nSpurious, 100.0*p->accuracy, p->cpu);
+    }
+
+    return 0;
+}
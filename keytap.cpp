@@ -6,6 +6,22 @@
 #include "constants.h"
 #include "common.h"
 #include "audio_logger.h"
+#include "audio_filter.h"
+#include "key_model.h"
+#include "training_data.h"
+#include "work_queue.h"
+#include "prediction_qos.h"
+#include "latency_histogram.h"
+#include "key_features.h"
+#include "key_pca.h"
+#include "model_bank.h"
+#include "key_detection.h"
+#include "mapped_recording.h"
+#include "prediction_sink.h"
+#include "feature_store.h"
+#include "object_pool.h"
+#include "alloc_counter.h"
+#include "thread_policy.h"
 
 #include <map>
 #include <mutex>
@@ -14,8 +30,8 @@
 #include <chrono>
 #include <thread>
 #include <vector>
-#include <deque>
 #include <fstream>
+#include <csignal>
 
 //#define MY_DEBUG
 //#define OUTPUT_WAVEFORMS
@@ -30,6 +46,9 @@ static std::function<void()> g_update;
 static std::function<bool()> g_mainUpdate;
 static std::function<void(int)> g_handleKey;
 
+// set by SIGUSR1, the latency histograms are printed from the main loop
+static std::atomic<bool> g_printLatency(false);
+
 int init() {
     if (g_isInitialized) return 1;
 
@@ -62,57 +81,157 @@ extern "C" {
 }
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s input.kbd [input2.kbd ...] [-cN] [-pF] [-tF]\n", argv[0]);
+    const std::vector<std::string> flags = { "quiet" };
+    auto argm = parseCmdArguments(argc, argv, flags);
+
+    // the records of --output=- are the only thing on stdout, everything else goes to stderr
+    if (argm["output"] == "-" && PredictionSink::detachStdout() == false) {
+        fprintf(stderr, "Failed to redirect stdout for --output=-\n");
+        return -7;
+    }
+
+    printf("Usage: %s input.kbd [input2.kbd ...] [-cN] [-pF] [-tF] [-fS] [--save-model F] [--load-model F[,F2,...]] [--select N] [--train M] [--workers N] [--queue N] [--qos N] [--shortlist K] [--pca R] [--offline F] [--output F] [--output-format S] [--output-topk K] [--store F] [--quiet] [--thread-capture S] [--thread-workers S]\n", argv[0]);
     printf("    -cN - select capture device N\n");
     printf("    -pF - prediction threshold: CC > F\n");
     printf("    -tF - background threshold: ampl > F*avg_background\n");
+    printf("    -fS - pre-filter audio with biquad sections, e.g. -fhp:100 or -fhp:80,bp:3000:0.5\n");
+    printf("    --save-model F - save the trained key templates to file F\n");
+    printf("    --load-model F - load trained key templates from file F instead of training\n");
+    printf("                     several comma-separated models are matched together and the best one is selected\n");
+    printf("    --select N     - with several models, select the best one after N confident presses (default 5)\n");
+    printf("    --train M      - training method: 'pairwise' (default) or 'mean' (faster for many presses per key)\n");
+    printf("    --workers N    - number of prediction threads (default 2)\n");
+    printf("    --queue N      - max number of pending prediction jobs (default 64)\n");
+    printf("    --qos N        - 1 (default) - lower the matching quality while the queue is backed up, 0 - always full quality\n");
+    printf("    --shortlist K  - match only the K keys with the closest spectral features (default 0 - all keys)\n");
+    printf("    --pca R        - match in a reduced space of R basis waveforms, exact CC only for the winner (default 0 - off)\n");
+    printf("    --offline F    - predict the key presses in recording F (raw float32 or WAV) as fast as possible and exit\n");
+    printf("    --output F     - write every prediction with its sample index and top keys to file F (--output=- for stdout)\n");
+    printf("                     with --output=- all other output goes to stderr\n");
+    printf("    --output-format S - 'json' (default) - JSON lines, 'bin' - fixed-size binary records\n");
+    printf("    --output-topk K   - number of keys with their CC in each output record (default 3)\n");
+    printf("    --store F      - append every scored key press with its aligned window and features to feature store F\n");
+    printf("    --quiet        - do not print the predictions on the console, takes no value\n");
+    printf("    --thread-capture S - scheduling of the capture thread, e.g. cpu:1,fifo:80 - see thread_policy.h\n");
+    printf("    --thread-workers S - scheduling of the prediction threads, e.g. cpu:2-3,nice:5\n");
+    printf("    Send SIGUSR1 to print the prediction latency histograms, the shortlist recall and the work buffer usage\n");
     printf("\n");
 
     if (argc < 2) {
         return -127;
     }
 
-    auto argm = parseCmdArguments(argc, argv);
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+    signal(SIGUSR1, [](int) { g_printLatency = true; });
+#endif
+
+    ThreadConfig threadConfig;
+    if (threadConfig.parse(argm, { "capture", "workers" }) == false) {
+        return -9;
+    }
     int captureId = argm["c"].empty() ? 0 : std::stoi(argm["c"]);
 
-    std::map<int, std::ifstream> fins;
-    for (int i = 0; i < argc - 1; ++i) {
-        if (argv[i + 1][0] == '-') continue;
-        printf("Opening file '%s'\n", argv[i + 1]);
-        fins[i] = std::ifstream(argv[i + 1], std::ios::binary);
-        if (fins[i].good() == false) {
-            printf("Failed to open input file: '%s'\n", argv[i + 1]);
-            return -2;
+    // the capture filter runs continuously on the microphone stream, while the
+    // training records are independent snippets and are filtered from a clean state
+    AudioFilter filterCapture;
+    AudioFilter filterInput;
+    if (argm["f"].empty() == false) {
+        if (filterCapture.addSections(argm["f"], kSampleRate) == false ||
+            filterInput.addSections(argm["f"], kSampleRate) == false) {
+            printf("Invalid filter specification: '%s'\n", argm["f"].c_str());
+            return -3;
+        }
+        printf("Pre-filter: %d biquad section(s) - '%s'\n", filterCapture.nSections(), argm["f"].c_str());
+    }
+
+    TrainMethod trainMethod = TrainMethod::Pairwise;
+    if (parseTrainMethod(argm["train"], trainMethod) == false) {
+        printf("Unknown training method: '%s'. Expected 'pairwise' or 'mean'\n", argm["train"].c_str());
+        return -5;
+    }
+
+    float thresholdCC = argm["p"].empty() ? 0.5f : std::stof(argm["p"]);
+    int nSelectPresses = argm["select"].empty() ? 5 : std::max(1, std::stoi(argm["select"]));
+
+    // a single model is used directly, several models go to the bank until one of them is selected
+    KeyModel model;
+    ModelBank modelBank(nSelectPresses, thresholdCC);
+    bool hasModel = false;
+    if (argm["load-model"].empty() == false) {
+        std::vector<std::string> fnames;
+        for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+            end = argm["load-model"].find(',', begin);
+            fnames.push_back(argm["load-model"].substr(begin, end == std::string::npos ? end : end - begin));
         }
 
-        {
-            int bufferSize_frames = 1;
-            fins[i].read((char *)(&bufferSize_frames), sizeof(bufferSize_frames));
-            if (bufferSize_frames != kTrainBufferSize_frames) {
-                printf("Buffer size in file (%d) does not match the expected one (%d)\n", bufferSize_frames, (int) kTrainBufferSize_frames);
-                return -1;
+        for (const auto & fname : fnames) {
+            KeyModel cur;
+            auto tStart = std::chrono::high_resolution_clock::now();
+            if (loadKeyModel(fname, cur) == false) {
+                return -4;
             }
+            auto tEnd = std::chrono::high_resolution_clock::now();
+            printf("Loaded model '%s' with %d keys in %g ms\n", fname.c_str(), (int) cur.templates.size(),
+                   std::chrono::duration<double, std::milli>(tEnd - tStart).count());
+
+            if (fnames.size() == 1) {
+                model = std::move(cur);
+            } else if (modelBank.add(fname, std::move(cur)) == false) {
+                printf("Model '%s' has no keys\n", fname.c_str());
+                return -4;
+            }
+        }
+        hasModel = true;
+
+        if (modelBank.size() > 1) {
+            printf("[+] Matching %d models together, the best one is selected after %d confident presses\n",
+                   modelBank.size(), nSelectPresses);
         }
     }
 
+    auto inputFiles = parseCmdPositional(argc, argv, flags);
+    if (inputFiles.empty() && hasModel == false) {
+        printf("No input files specified\n");
+        return -2;
+    }
+
     TKey keyPressed = -1;
     std::map<TKey, TKeyHistory> keySoundHistoryAmpl;
     std::map<TKey, TKeyWaveform> keySoundAverageAmpl;
+    std::map<TKey, TrainStats> trainStats;
 
     int ntest = 0;
 
     bool doRecord = false;
     bool isReadyToPredict = false;
     bool finishApp = false;
-    bool processingInput = true;
-
-    int curFile = 0;
 
     float amplMin = 0.0f;
     float amplMax = 0.0f;
-    float thresholdCC = argm["p"].empty() ? 0.5f : std::stof(argm["p"]);
     float thresholdBackground = argm["t"].empty() ? 10.0f : std::stof(argm["t"]);
 
+    if (hasModel) {
+        keySoundAverageAmpl = std::move(model.templates);
+        trainStats = std::move(model.trainStats);
+        amplMin = model.amplMin;
+        amplMax = model.amplMax;
+
+        isReadyToPredict = true;
+        doRecord = true;
+    }
+
+    if (hasModel == false) {
+        auto tStart = std::chrono::high_resolution_clock::now();
+        TrainingDataStats trainingDataStats;
+        if (loadTrainingData(inputFiles, filterInput, keySoundHistoryAmpl, trainingDataStats) == false) {
+            return -2;
+        }
+        auto tEnd = std::chrono::high_resolution_clock::now();
+        printf("Loaded %d key presses of %d keys from %d file(s) (%g MB) in %g ms\n",
+               trainingDataStats.nRecords, trainingDataStats.nKeys, trainingDataStats.nFiles,
+               trainingDataStats.nBytes/1024.0/1024.0, std::chrono::duration<double, std::milli>(tEnd - tStart).count());
+    }
+
     // ring buffer
     int rbBegin = 0;
     float rbAverage = 0.0f;
@@ -134,75 +253,322 @@ int main(int argc, char ** argv) {
     struct WorkData {
         TKeyWaveform ampl;
         std::vector<int> positionsToPredict;
+        std::vector<AudioLogger::FrameStamp> stamps;    // sample index and capture time of every position
+        int64_t tDetect_us = 0;
     };
 
-    std::mutex mutex;
-    std::deque<WorkData> workQueue;
-    std::thread worker([&]() {
-        int lastkey = -1;
-        double lastcc = -1.0f;
+    struct WorkResult {
+        std::vector<TKeyPrediction> predictions;
+        std::vector<std::vector<TKeyPrediction>> modelPredictions;  // per model, while several models are scored
+        std::vector<int> models;                                    // the model of each prediction
+        int64_t tDequeue_us = 0;
+        int64_t tScored_us = 0;
+    };
 
-        while (finishApp == false) {
-            bool process = false;
-            WorkData workData;
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                while (workQueue.size() > 30) {
-                    workQueue.pop_front();
-                    printf("pop\n");
+    using WorkItem = ObjectPool<WorkData>::Handle;
+
+    LatencyHistogram latencyDetect("capture -> detect");
+    LatencyHistogram latencyQueue("detect -> dequeue");
+    LatencyHistogram latencyScore("dequeue -> scored");
+    LatencyHistogram latencyDeliver("scored -> printed");
+    LatencyHistogram latencyTotal("capture -> printed");
+
+    auto printLatency = [&]() {
+        printf("[+] Prediction latency per stage:\n");
+        latencyDetect.print();
+        latencyQueue.print();
+        latencyScore.print();
+        latencyDeliver.print();
+        latencyTotal.print();
+    };
+
+    // the templates are shared by all workers, the CC search of each template is split between nWorkersCC threads
+    // an offline recording is processed as fast as possible, on all cores and always at full quality
+    const std::string offlineFile = argm["offline"];
+    const bool isOffline = offlineFile.empty() == false;
+
+    int nWorkersPredict = argm["workers"].empty() ? (isOffline ? getNumThreads() : 2) : std::max(1, std::stoi(argm["workers"]));
+    int nWorkersCC = std::max(1, std::min(4, getNumThreads()/nWorkersPredict));
+    int queueCapacity = argm["queue"].empty() ? 64 : std::max(1, std::stoi(argm["queue"]));
+
+    // lower the matching quality while the queue is backed up, instead of dropping key presses
+    bool useQoS = isOffline == false && (argm["qos"].empty() || std::stoi(argm["qos"]) != 0);
+    PredictionQoS qos(queueCapacity);
+
+    // The work items of the capture callback are preallocated for a whole prediction record and recycled, so
+    // that the audio thread does not allocate. The queue holds at most one item per result slot, pushed and not
+    // yet delivered, and the callback fills one more.
+    const float kPredictRecord_s = 0.50f;
+    const int kPredictRecord_samples = 3*getBufferSize_frames(kSampleRate, kPredictRecord_s)*kSamplesPerFrame;
+    ObjectPool<WorkData> workPool(WorkQueue<WorkItem, WorkResult>::slots(nWorkersPredict, queueCapacity) + 1, [&](WorkData & workData) {
+        workData.ampl.reserve(kPredictRecord_samples);
+        workData.positionsToPredict.reserve(2*kPredictRecord_samples/kSamplesPerFrame);
+        workData.stamps.reserve(2*kPredictRecord_samples/kSamplesPerFrame);
+    });
+    std::atomic<uint64_t> nCallbackAllocations(0);
+    std::atomic<int> nCallbacksPredict(0);
+    std::atomic<uint64_t> nWorkerAllocations(0);
+    std::atomic<uint64_t> nDeliverAllocations(0);
+    std::atomic<int> nJobsScored(0);
+
+    auto printWorkBuffers = [&]() {
+        auto stats = workPool.stats();
+        printf("[+] Work buffers: %d preallocated (%.1f MB), %d used, %d allocated because all were in use\n",
+               stats.nObjects, stats.nObjects*(kPredictRecord_samples*sizeof(float))/1024.0/1024.0,
+               (int) stats.nAcquired, (int) stats.nMisses);
+        if (kCountAllocations) {
+            printf("[+] Capture callback: %d heap allocations in %d callbacks with key presses\n",
+                   (int) nCallbackAllocations, (int) nCallbacksPredict);
+            printf("[+] Workers: %d heap allocations while matching, %d while delivering, in %d jobs\n",
+                   (int) nWorkerAllocations, (int) nDeliverAllocations, (int) nJobsScored);
+        }
+    };
+
+    // cheap first stage that picks the templates for the exact CC search
+    // every kShortlistCheck-th press is also matched against all templates to measure the recall of the shortlist
+    const int kShortlistCheck = 16;
+    int shortlistSize = argm["shortlist"].empty() ? 0 : std::max(0, std::stoi(argm["shortlist"]));
+    KeyShortlist shortlist;
+    std::atomic<int> nShortlistPresses(0);
+    std::atomic<int> nShortlistChecked(0);
+    std::atomic<int> nShortlistHits(0);
+
+    auto buildShortlist = [&]() {
+        if (shortlistSize == 0) return;
+        if (modelBank.size() > 1) {
+            printf("[!] The shortlist is not supported with several models - matching all keys\n");
+            shortlistSize = 0;
+            return;
+        }
+
+        bool fromTemplates = keySoundHistoryAmpl.empty();
+        bool ok = fromTemplates ? shortlist.build(keySoundAverageAmpl) : shortlist.build(keySoundHistoryAmpl);
+        if (ok == false) {
+            printf("[!] Failed to compute the key features - matching all keys\n");
+            shortlistSize = 0;
+            return;
+        }
+        printf("[+] Shortlisting %d key(s) per press using the features of the %s\n",
+               shortlistSize, fromTemplates ? "templates" : "training presses");
+    };
+
+    auto printShortlistRecall = [&]() {
+        if (shortlistSize == 0) return;
+
+        int nChecked = nShortlistChecked;
+        printf("[+] Shortlist recall: %d / %d checked presses (%.1f%%) had the exhaustive best key among the top %d\n",
+               (int) nShortlistHits, nChecked, nChecked > 0 ? (100.0*nShortlistHits)/nChecked : 0.0, shortlistSize);
+    };
+
+    // low-rank template space, the offset search runs on the projections and only the winner is refined
+    int pcaRank = argm["pca"].empty() ? 0 : std::max(0, std::stoi(argm["pca"]));
+    KeyPCA pca;
+
+    auto buildPCA = [&]() {
+        if (pcaRank == 0) return;
+        if (modelBank.size() > 1) {
+            printf("[!] The template basis is not supported with several models - matching the full templates\n");
+            pcaRank = 0;
+            return;
+        }
+
+        auto tStart = std::chrono::high_resolution_clock::now();
+        if (pca.train(keySoundHistoryAmpl, keySoundAverageAmpl, pcaRank) == false) {
+            printf("[!] Failed to compute the template basis - matching the full templates\n");
+            pcaRank = 0;
+            return;
+        }
+        auto tEnd = std::chrono::high_resolution_clock::now();
+
+        const auto & stats = pca.stats();
+        printf("[+] Template basis: rank %d from %d waveforms in %g ms, %.1f%% of the energy kept, %.1f kB (full templates %.1f kB)\n",
+               stats.rank, stats.nWaveforms, std::chrono::duration<double, std::milli>(tEnd - tStart).count(),
+               100.0*stats.explained, (stats.nBytesBasis + stats.nBytesTemplates)/1024.0, stats.nBytesFull/1024.0);
+    };
+
+    if (hasModel) {
+        buildShortlist();
+        buildPCA();
+    }
+
+    // structured output, written from its own thread
+    PredictionSink sink;
+    if (argm["output"].empty() == false) {
+        PredictionSink::Format format;
+        if (PredictionSink::parseFormat(argm["output-format"], format) == false) {
+            printf("Unknown output format: '%s'. Expected 'json' or 'bin'\n", argm["output-format"].c_str());
+            return -7;
+        }
+        int topK = argm["output-topk"].empty() ? 3 : std::stoi(argm["output-topk"]);
+        if (sink.open(argm["output"], format, topK) == false) {
+            return -7;
+        }
+    }
+
+    // the detected presses for later experiments, written by the deliver callback
+    FeatureStoreWriter store;
+    FeatureStoreEntry storeEntry;
+    if (argm["store"].empty() == false) {
+        if (store.open(argm["store"]) == false) {
+            return -8;
+        }
+        printf("[+] Appending the key presses to feature store '%s' (%d already in it)\n",
+               argm["store"].c_str(), (int) store.nExisting());
+    }
+    const bool isQuiet = argm.find("quiet") != argm.end();
+
+    int lastkey = -1;
+    double lastcc = -1.0f;
+
+    WorkQueue<WorkItem, WorkResult> workQueue;
+    workQueue.start(nWorkersPredict, queueCapacity,
+        [&](WorkItem & item, WorkResult & result) {
+            const auto & workData = *item;
+            const uint64_t nAllocations0 = getAllocationCount();
+            result.tDequeue_us = getTime_us();
+
+            //int alignWindow = kSamplesPerFrame/2;
+            PredictionQuality quality = PredictionQoS::levels()[0];
+            if (useQoS) {
+                int levelOld = qos.level();
+                quality = qos.update(workQueue.size());
+                if (qos.level() != levelOld) {
+                    printf("[QoS] Queue depth %d - quality level %d -> %d (align window = %d, candidates = %d)\n",
+                           workQueue.size(), levelOld, qos.level(), quality.alignWindow, quality.nCandidates);
                 }
+            }
 
-                if (workQueue.size() > 0) {
-                    workData = std::move(workQueue.front());
-                    workQueue.pop_front();
-                    process = true;
+            const auto & positionsToPredict = workData.positionsToPredict;
+            auto & predictions = result.predictions;
+            predictions.resize(positionsToPredict.size());
+
+            if (modelBank.size() > 1) {
+                result.modelPredictions.resize(positionsToPredict.size());
+                result.models.resize(positionsToPredict.size());
+                for (int ipos = 0; ipos < (int) positionsToPredict.size(); ++ipos) {
+                    auto & cur = result.modelPredictions[ipos];
+                    int m = modelBank.predict(workData.ampl, positionsToPredict[ipos], quality.alignWindow, cur, nWorkersCC);
+                    result.models[ipos] = m;
+                    // the result slot is reused, so a press that no model scored must not keep the previous prediction
+                    predictions[ipos] = m >= 0 ? cur[m] : TKeyPrediction();
+                }
+                result.tScored_us = getTime_us();
+                if (kCountAllocations) {
+                    nWorkerAllocations += getAllocationCount() - nAllocations0;
+                    ++nJobsScored;
                 }
+                return;
             }
-            if (process) {
-                const auto & ampl = workData.ampl;
-                const auto & positionsToPredict = workData.positionsToPredict;
-
-                //int alignWindow = kSamplesPerFrame/2;
-                int alignWindow = 64;
-
-                for (int ipos = 0; ipos < positionsToPredict.size() ; ++ipos) {
-                    auto curPos = positionsToPredict[ipos];
-                    int scmp0 = curPos - kSamplesPerFrame;
-                    int scmp1 = curPos + kSamplesPerFrame;
-
-                    char res = -1;
-                    TValueCC maxcc = -1.0f;
-                    TOffset offs = 0;
-                    TKeyConfidenceMap keyConfidenceTmp;
-                    for (const auto & ka : keySoundAverageAmpl) {
-                        //auto [bestcc, bestoffset] = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto ret = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        auto bestoffset = std::get<1>(ret);
-
-                        if (bestcc > maxcc) {
-                            res = ka.first;
-                            maxcc = bestcc;
-                            offs = bestoffset;
-                        }
-                        keyConfidenceTmp[ka.first] = bestcc;
+
+            for (int ipos = 0; ipos < (int) positionsToPredict.size(); ++ipos) {
+                const int curPos = positionsToPredict[ipos];
+
+                auto predict = [&](TKeyPrediction & res, const std::vector<TKey> * keys) {
+                    if (pcaRank > 0) {
+                        pca.predict(keySoundAverageAmpl, workData.ampl, curPos, quality.alignWindow, res, 2, 4, keys);
+                    } else {
+                        predictKeyPress(keySoundAverageAmpl, workData.ampl, curPos,
+                                        quality.alignWindow, nWorkersCC, res, quality.nCandidates, keys);
+                    }
+                };
+
+                TKeyFeatures features;
+                if (shortlistSize > 0 && calcKeyFeatures(workData.ampl, curPos, features)) {
+                    std::vector<TKey> keys;
+                    shortlist.shortlist(features, shortlistSize, keys);
+                    predict(predictions[ipos], &keys);
+
+                    if (nShortlistPresses++ % kShortlistCheck == 0) {
+                        TKeyPrediction exhaustive;
+                        predict(exhaustive, nullptr);
+                        ++nShortlistChecked;
+                        if (std::find(keys.begin(), keys.end(), exhaustive.key) != keys.end()) ++nShortlistHits;
                     }
+                    continue;
+                }
+
+                predict(predictions[ipos], nullptr);
+            }
+
+            result.tScored_us = getTime_us();
+            if (kCountAllocations) {
+                nWorkerAllocations += getAllocationCount() - nAllocations0;
+                ++nJobsScored;
+            }
+        },
+        [&](WorkItem & item, WorkResult & result) {
+            const auto & workData = *item;
+            const uint64_t nAllocations0 = getAllocationCount();
+            int64_t tDelivered_us = getTime_us();
+            latencyQueue.add(result.tDequeue_us - workData.tDetect_us);
+            latencyScore.add(result.tScored_us - result.tDequeue_us);
+            latencyDeliver.add(tDelivered_us - result.tScored_us);
+            for (const auto & stamp : workData.stamps) {
+                latencyDetect.add(workData.tDetect_us - stamp.time_us);
+                latencyTotal.add(tDelivered_us - stamp.time_us);
+            }
+
+            for (int ipos = 0; ipos < (int) result.predictions.size(); ++ipos) {
+                const auto & prediction = result.predictions[ipos];
+                if (sink.isOpen() && prediction.key != -1) {
+                    // a live capture drops records rather than wait for a slow output, an offline run keeps all of them
+                    sink.push(workData.stamps[ipos].sampleIndex, workData.stamps[ipos].time_us, prediction, isOffline);
+                }
+                if (store.isOpen() && prediction.key != -1) {
+                    storeEntry.set(workData.ampl, workData.positionsToPredict[ipos] + prediction.offset);
+                    storeEntry.sampleIndex = workData.stamps[ipos].sampleIndex;
+                    storeEntry.key = prediction.key;
+                    storeEntry.cc = prediction.cc;
+                    storeEntry.offset = prediction.offset;
+                    store.append(storeEntry);
+                }
 
-                    if (maxcc > thresholdCC) {
-                        if (lastkey != res || lastcc != maxcc) {
-                            printf("    Prediction: '%c'        (%8.5g), ntest = %d\n", res, maxcc, ntest);
+                if (isQuiet == false) {
+                    if (isOffline) {
+                        if (prediction.cc > thresholdCC) {
+                            int64_t sampleIndex = workData.stamps[ipos].sampleIndex;
+                            printf("    [%10.3f s] Prediction: '%c'        (%8.5g), sample = %lld, offset = %d\n",
+                                   double(sampleIndex)/kSampleRate, prediction.key, prediction.cc, (long long) sampleIndex, prediction.offset);
                         }
-                        lastkey = res;
-                        lastcc = maxcc;
+                    } else if (prediction.cc > thresholdCC) {
+                        if (lastkey != prediction.key || lastcc != prediction.cc) {
+                            if (result.models.empty() || result.models[ipos] < 0) {
+                                printf("    Prediction: '%c'        (%8.5g), ntest = %d\n", prediction.key, prediction.cc, ntest);
+                            } else {
+                                printf("    Prediction: '%c'        (%8.5g), ntest = %d, model '%s'\n",
+                                       prediction.key, prediction.cc, ntest, modelBank.name(result.models[ipos]).c_str());
+                            }
+                        }
+                        lastkey = prediction.key;
+                        lastcc = prediction.cc;
+                    }
+                }
+                ++ntest;
+
+                if (ipos < (int) result.modelPredictions.size() && modelBank.update(result.modelPredictions[ipos])) {
+                    auto stats = modelBank.stats();
+                    printf("[+] Selected model '%s' after %d presses, the other models are no longer matched\n",
+                           modelBank.name(stats.selected).c_str(), stats.nPresses);
+                    for (int i = 0; i < modelBank.size(); ++i) {
+                        printf("    %-24s : average CC = %8.5f, best for %d presses\n",
+                               modelBank.name(i).c_str(), stats.meanCC[i], stats.nWins[i]);
                     }
-                    ++ntest;
                 }
+            }
 
-            } else {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            if (kCountAllocations) {
+                nDeliverAllocations += getAllocationCount() - nAllocations0;
             }
-        }
-    });
+        },
+        [&](int iWorker) {
+            applyThreadPolicy(("worker " + std::to_string(iWorker)).c_str(), threadConfig.workers);
+        });
+
+    // the detection state of the callback, allocated once
+    std::vector<int> positionsToPredict;
+    std::vector<int> que;
+    positionsToPredict.reserve(2*kPredictRecord_samples/kSamplesPerFrame);
+    que.resize(kPredictRecord_samples + kSamplesPerFrame);
 
     AudioLogger::Callback cbAudio = [&](const AudioLogger::Record & frames) {
         if (isAcquiringTrainData) {
@@ -230,8 +596,9 @@ int main(int argc, char ** argv) {
         const int nFrames = frames.size();
 
         if (isReadyToPredict) {
+            const uint64_t nAllocations0 = getAllocationCount();
 
-            std::vector<int> positionsToPredict;
+            positionsToPredict.clear();
 
             {
                 float amax = 0.0f;
@@ -252,27 +619,31 @@ int main(int argc, char ** argv) {
 
                 auto _acc = [](const AudioLogger::Record & r, int id) { return std::abs(r[id/kSamplesPerFrame][id%kSamplesPerFrame]); };
 
+                // monotonic queue of the sample indices in the window, starts with k zero indices
                 int k = kSamplesPerFrame;
-                std::deque<int> que(k);
+                if ((int) que.size() < nFrames*kSamplesPerFrame + k) que.resize(nFrames*kSamplesPerFrame + k);
+                std::fill(que.begin(), que.begin() + k, 0);
+                int queBegin = 0;
+                int queEnd = k;
                 for (int i = 0; i < nFrames*kSamplesPerFrame; ++i) {
                     if (i < k) {
-                        while((!que.empty()) && _acc(frames, i) >= _acc(frames, que.back())) {
-                            que.pop_back();
+                        while((queBegin < queEnd) && _acc(frames, i) >= _acc(frames, que[queEnd - 1])) {
+                            --queEnd;
                         }
-                        que.push_back(i);
+                        que[queEnd++] = i;
                     } else {
-                        while((!que.empty()) && que.front() <= i - k) {
-                            que.pop_front();
+                        while((queBegin < queEnd) && que[queBegin] <= i - k) {
+                            ++queBegin;
                         }
 
-                        while((!que.empty()) && _acc(frames, i) >= _acc(frames, que.back())) {
-                            que.pop_back();
+                        while((queBegin < queEnd) && _acc(frames, i) >= _acc(frames, que[queEnd - 1])) {
+                            --queEnd;
                         }
 
-                        que.push_back(i);
+                        que[queEnd++] = i;
 
                         int itest = i - k/2;
-                        if (itest >= 2*kSamplesPerFrame && itest < (nFrames - 2)*kSamplesPerFrame && que.front() == itest) {
+                        if (itest >= 2*kSamplesPerFrame && itest < (nFrames - 2)*kSamplesPerFrame && que[queBegin] == itest) {
                             auto acur = _acc(frames, itest);
                             if (acur > thresholdBackground*rbAverage){
                                 positionsToPredict.push_back(itest);
@@ -283,17 +654,35 @@ int main(int argc, char ** argv) {
             }
 
             if (positionsToPredict.size() > 0) {
-                WorkData workData;
+                auto item = workPool.acquire();
+                auto & workData = *item;
                 auto & ampl = workData.ampl;
                 ampl.resize(nFrames*kSamplesPerFrame);
                 for (int k = 0; k < nFrames; ++k) {
                     std::copy(frames[k].begin(), frames[k].end(), ampl.begin() + k*kSamplesPerFrame);
                 }
                 workData.positionsToPredict = positionsToPredict;
+                workData.stamps.clear();
+
+                // the frame of each position tells when its sound was captured
+                const auto & stamps = audioLogger.getRecordStamps();
+                for (auto pos : positionsToPredict) {
+                    AudioLogger::FrameStamp stamp;
+                    int iframe = pos/kSamplesPerFrame;
+                    if (iframe < (int) stamps.size()) {
+                        stamp = stamps[iframe];
+                        stamp.sampleIndex += pos%kSamplesPerFrame;
+                    }
+                    workData.stamps.push_back(stamp);
+                }
+                workData.tDetect_us = getTime_us();
 
-                {
-                    std::lock_guard<std::mutex> lock(mutex);
-                    workQueue.push_back(std::move(workData));
+                // a drop is reported by the main loop, the callback does not print
+                workQueue.push(std::move(item), true);
+
+                if (kCountAllocations) {
+                    nCallbackAllocations += getAllocationCount() - nAllocations0;
+                    ++nCallbacksPredict;
                 }
             }
 
@@ -312,12 +701,23 @@ int main(int argc, char ** argv) {
     };
 
     g_init = [&]() {
+        if (filterCapture.empty() == false) {
+            audioLogger.setFilter([&](AudioLogger::Sample * samples, int64_t n) { filterCapture.process(samples, n); });
+        }
+        if (threadConfig.capture.empty() == false) {
+            audioLogger.setThreadInit([&]() { applyThreadPolicy("capture", threadConfig.capture); });
+        }
+
         if (audioLogger.install(kSampleRate, cbAudio, captureId) == false) {
             fprintf(stderr, "Failed to install audio logger\n");
             return -1;
         }
 
-        printf("[+] Collecting training data\n");
+        if (isReadyToPredict) {
+            printf("[+] Predicting\n");
+        } else {
+            printf("[+] Collecting training data\n");
+        }
         g_isInitialized = true;
         return 0;
     };
@@ -330,281 +730,64 @@ int main(int argc, char ** argv) {
         }
     };
 
-    g_update = [&]() {
-        if (isAcquiringTrainData) {
-            return;
-        }
+    auto train = [&]() {
+        printf("[+] Training\n");
 
-        if (processingInput) {
-            if (keyPressed == -1) {
-                AudioLogger::Frame frame;
-                AudioLogger::Record record;
-                fins[curFile].read((char *)(&keyPressed), sizeof(keyPressed));
-                if (fins[curFile].eof()) {
-                    ++curFile;
-                    if (curFile >= fins.size()) {
-                        processingInput = false;
-                    }
-                } else {
-                    printf("%c", keyPressed);
-                    fflush(stdout);
-                    for (int i = 0; i < kTrainBufferSize_frames; ++i) {
-                        fins[curFile].read((char *)(frame.data()), sizeof(AudioLogger::Sample)*frame.size());
-                        record.push_back(frame);
-                    }
-                    cbAudio(record);
-                }
-            }
-            return;
-        }
-
-        if (isReadyToPredict == false) {
-            printf("[+] Training\n");
-
-            std::vector<TKey> failedToTrain;
-
-            auto trainKey = [&](TKey key) {
-                auto & history = keySoundHistoryAmpl[key];
-
-                int nWaveforms = history.size();
-                int nFramesPerWaveform = kTrainBufferSize_frames;
-
-                printf("    - Training key '%c'\n", key);
-                printf("    - History size = %d key waveforms\n", nWaveforms);
-                printf("    - Frames per key waveform   = %d\n", nFramesPerWaveform);
-                printf("    - Total frames available    = %d\n", nWaveforms*nFramesPerWaveform);
-                printf("    - Samples per frame         = %d\n", (int) kSamplesPerFrame);
-                printf("    - Total samples available   = %d\n", (int) (nWaveforms*nFramesPerWaveform*kSamplesPerFrame));
-
-                printf("    - Estimating waveform peaks ...\n");
-                std::vector<int> peakSum;
-                std::vector<int> peakMax;
-
-                peakSum.clear();
-                peakMax.clear();
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    int isum = -1;
-                    double asum = 0.0f;
-                    double aisum = 0.0f;
-
-                    int imax = -1;
-                    double amax = 0.0f;
-
-                    const auto & waveform = history[iwaveform];
-
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        double acur = std::abs(waveform[icur]);
-                        double acur2 = acur*acur;
-
-                        asum += acur2;
-                        aisum += acur2*icur;
-
-                        if (acur > amax) {
-                            amax = acur;
-                            imax = icur;
-                        }
-                    }
-
-                    isum = aisum/asum;
-
-                    peakSum.push_back(isum);
-                    peakMax.push_back(imax);
-                    //printf("        Estimated peak: %d (method - sum), %d (method - max)\n", isum, imax);
-                }
-
-                auto calcStdev = [](const std::vector<int> & data) {
-                    double sum = 0.0f;
-                    double sum2 = 0.0f;
-                    for (const auto & p : data) {
-                        sum += p;
-                        sum2 += p*p;
-                    }
-                    sum /= data.size();
-                    sum2 /= data.size();
-                    return sqrt(sum2 - sum*sum);
-                };
-
-                double stdevSum = calcStdev(peakSum);
-                double stdevMax = calcStdev(peakMax);
-
-                printf("    - Stdev of estimated peaks: %g (sum) vs %g (max)\n", stdevSum, stdevMax);
-
-                const auto & peakUsed = peakMax;
-                printf("    - Using 'max' estimation\n");
-
-                int centerSample = kSamplesPerWaveform/2;
+        std::map<TKey, TrainResult> trainResults;
+        trainKeys(keySoundHistoryAmpl, trainResults, nullptr, getNumThreads(), trainMethod);
 
-                printf("    - Centering waveforms at sample %d\n", centerSample);
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    int offset = peakUsed[iwaveform] - centerSample;
-                    //printf("        Offset for waveform %-4d = %-4d\n", iwaveform, offset);
+        std::vector<TKey> failedToTrain;
+        for (auto & kr : trainResults) {
+            auto & res = kr.second;
+            printf("%s", res.log.c_str());
+            if (res.failed) failedToTrain.push_back(kr.first);
+            if (res.average.empty()) continue;
 
-                    auto newWaveform = TKeyWaveform();
-                    newWaveform.resize(kSamplesPerWaveform);
-                    auto & waveform = history[iwaveform];
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        int iorg = icur + offset;
-
-                        if (iorg >= 0 && iorg < kSamplesPerWaveform) {
-                            newWaveform[icur] = waveform[iorg];
-                        } else {
-                            newWaveform[icur] = 0.0f;
-                        }
-                    }
-
-                    waveform = std::move(newWaveform);
-                }
-
-                int alignWindow = 64;
-                printf("    - Calculating CC pairs\n");
-                printf("      Align window = %d\n", alignWindow);
-
-                int bestw = -1;
-                int ntrain = 0;
-                double bestccsum = -1.0f;
-                double bestosum = 1e10;
-                std::map<int, std::map<int, std::tuple<TValueCC, TOffset>>> ccs;
-
-                for (int alignToWaveform = 0; alignToWaveform < nWaveforms; ++alignToWaveform) {
-                    ccs[alignToWaveform][alignToWaveform] = std::tuple<TValueCC, TOffset>(1.0f, 0);
-
-                    int is0 = centerSample - kSamplesPerFrame;
-                    int is1 = centerSample + kSamplesPerFrame;
-
-                    const auto & waveform0 = history[alignToWaveform];
-
-                    for (int iwaveform = alignToWaveform + 1; iwaveform < nWaveforms; ++iwaveform) {
-                        const auto & waveform1 = history[iwaveform];
-                        //auto [bestcc, bestoffset] = findBestCC(waveform0, waveform1, is0, is1, alignWindow);
-                        auto ret = findBestCC(waveform0, waveform1, is0, is1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        auto bestoffset = std::get<1>(ret);
-
-                        ccs[iwaveform][alignToWaveform] = std::tuple<TValueCC, TOffset>(bestcc, bestoffset);
-                        ccs[alignToWaveform][iwaveform] = std::tuple<TValueCC, TOffset>(bestcc, -bestoffset);
-                    }
-
-                    int curntrain = 0;
-                    double curccsum = 0.0;
-                    double curosum = 0.0;
-                    for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                        //auto [cc, offset] = ccs[iwaveform][alignToWaveform];
-                        auto cc     = std::get<0>(ccs[iwaveform][alignToWaveform]);
-                        auto offset = std::get<1>(ccs[iwaveform][alignToWaveform]);
-
-                        if (std::abs(offset) > 50) continue;
-                        ++curntrain;
-                        curccsum += cc*cc;
-                        curosum += offset*offset;
-                    }
-
-                    if (curccsum > bestccsum) {
-                    //if (curosum < bestosum) {
-                        ntrain = curntrain;
-                        bestw = alignToWaveform;
-                        bestccsum = curccsum;
-                        bestosum = curosum;
-                    }
-                }
-                bestccsum = sqrt(bestccsum/ntrain);
-
-                printf("    - Aligning all waveforms to waveform %d, (cost = %g)\n", bestw, bestccsum);
-#ifdef OUTPUT_WAVEFORMS
-                std::ofstream fout(std::string("waveform_one_") + std::to_string(key) + ".plot");
-                for (auto & v : history[bestw]) fout << v << std::endl;
-                fout << std::endl;
-#endif
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    if (iwaveform == bestw) continue;
-
-                    auto & waveform1 = history[iwaveform];
-                    //auto [cc, offset] = ccs[iwaveform][bestw];
-                    //auto cc     = std::get<0>(ccs[iwaveform][bestw]);
-                    auto offset = std::get<1>(ccs[iwaveform][bestw]);
-
-                    auto newWaveform = TKeyWaveform();
-                    newWaveform.resize(kSamplesPerWaveform);
-                    for (int icur = 0; icur < kSamplesPerWaveform; ++icur) {
-                        int iorg = icur + offset;
-
-                        if (iorg >= 0 && iorg < kSamplesPerWaveform) {
-                            newWaveform[icur] = waveform1[iorg];
-                        } else {
-                            newWaveform[icur] = 0.0f;
-                        }
-                    }
-
-                    waveform1 = std::move(newWaveform);
-#ifdef OUTPUT_WAVEFORMS
-                    for (auto & v : waveform1) fout << v << std::endl;
-                    fout << std::endl;
-#endif
-                }
-
-                printf("    - Calculating average waveform\n");
-                double ccsum = 0.0f;
-                double norm = 0.0f;
-                auto & avgWaveform = keySoundAverageAmpl[key];
-                avgWaveform.resize(kSamplesPerWaveform);
-                std::fill(avgWaveform.begin(), avgWaveform.end(), 0.0f);
-                for (int iwaveform = 0; iwaveform < nWaveforms; ++iwaveform) {
-                    //auto [cc, offset] = ccs[iwaveform][bestw];
-                    auto cc     = std::get<0>(ccs[iwaveform][bestw]);
-                    auto offset = std::get<1>(ccs[iwaveform][bestw]);
-
-                    //if (std::abs(offset) > 5) continue;
-                    printf("        Adding waveform %d - cc = %g, offset = %d\n", iwaveform, cc, offset);
-                    ccsum += cc*cc;
-                    norm += cc*cc;
-                    auto & waveform = history[iwaveform];
-                    for (int is = 0; is < kSamplesPerWaveform; ++is) {
-                        avgWaveform[is] += cc*cc*waveform[is];
-                    }
-                }
-
-                norm = 1.0f/(norm);
-                for (int is = 0; is < kSamplesPerWaveform; ++is) {
-                    avgWaveform[is] *= norm;
-                    if (avgWaveform[is] > amplMax) amplMax = avgWaveform[is];
-                    if (avgWaveform[is] < amplMin) amplMin = avgWaveform[is];
-                }
-
-#ifdef OUTPUT_WAVEFORMS
-                {
-                    std::ofstream fout(std::string("waveform_avg_") + std::to_string(key) + ".plot");
-                    for (auto & v : avgWaveform) fout << v << std::endl;
-                }
-#endif
-
-                if (ccsum*norm < 0.50f || (1.0f/norm < nWaveforms/3)) {
-                    failedToTrain.push_back(key);
-                }
+            for (const auto & v : res.average) {
+                if (v > amplMax) amplMax = v;
+                if (v < amplMin) amplMin = v;
+            }
+            keySoundAverageAmpl[kr.first] = std::move(res.average);
+            trainStats[kr.first] = res.stats;
+        }
+        printf("Failed to train the following keys: ");
+        for (auto & k : failedToTrain) printf("'%c' ", k);
+        printf("\n");
+        isReadyToPredict = true;
+        doRecord = true;
+
+        amplMax = std::max(amplMax, -amplMin);
+        amplMin = -std::max(amplMax, -amplMin);
+
+        for (auto & kh : keySoundAverageAmpl) {
+            float curAmplMax = 0.0f;
+            for (const auto & v : kh.second) if (std::abs(v) > curAmplMax) curAmplMax = std::abs(v);
+            for (auto & v : kh.second) v = (v/curAmplMax)*amplMax;
+        }
 
-                printf("\n");
-            };
+        buildShortlist();
+        buildPCA();
 
-            for (const auto & kh : keySoundHistoryAmpl) {
-                if (kh.second.size() > 2) {
-                    trainKey(kh.first);
-                } else {
-                    printf("[!] Key '%s' does not have enough training data. Need at least 3 presses\n", kKeyText.at(kh.first));
-                    failedToTrain.push_back(kh.first);
-                }
+        if (argm["save-model"].empty() == false) {
+            model.amplMin = amplMin;
+            model.amplMax = amplMax;
+            model.templates = keySoundAverageAmpl;
+            model.trainStats = trainStats;
+            if (saveKeyModel(argm["save-model"], model)) {
+                printf("[+] Saved model to '%s'\n", argm["save-model"].c_str());
+            } else {
+                printf("[!] Failed to save model to '%s'\n", argm["save-model"].c_str());
             }
-            printf("Failed to train the following keys: ");
-            for (auto & k : failedToTrain) printf("'%c' ", k);
-            printf("\n");
-            isReadyToPredict = true;
-            doRecord = true;
+        }
+    };
 
-            amplMax = std::max(amplMax, -amplMin);
-            amplMin = -std::max(amplMax, -amplMin);
+    g_update = [&]() {
+        if (isAcquiringTrainData) {
+            return;
+        }
 
-            for (auto & kh : keySoundAverageAmpl) {
-                float curAmplMax = 0.0f;
-                for (const auto & v : kh.second) if (std::abs(v) > curAmplMax) curAmplMax = std::abs(v);
-                for (auto & v : kh.second) v = (v/curAmplMax)*amplMax;
-            }
+        if (isReadyToPredict == false) {
+            train();
 
             audioLogger.resume();
 
@@ -615,29 +798,137 @@ int main(int argc, char ** argv) {
 
         if (doRecord) {
             doRecord = false;
-            audioLogger.recordSym(0.50f);
+            audioLogger.recordSym(kPredictRecord_s);
         }
     };
 
+    // the jobs dropped by the capture callback, checked a few times per second
+    uint64_t nDroppedReported = 0;
+    int64_t tDroppedChecked_us = 0;
+
     g_mainUpdate = [&]() {
         if (finishApp) return false;
 
         update();
 
+        if (getTime_us() - tDroppedChecked_us > 250000) {
+            tDroppedChecked_us = getTime_us();
+            auto stats = workQueue.stats();
+            if (stats.nDropped > nDroppedReported) {
+                printf("[!] Prediction queue is full - %d job(s) dropped, %d in total\n",
+                       (int) (stats.nDropped - nDroppedReported), (int) stats.nDropped);
+                nDroppedReported = stats.nDropped;
+            }
+        }
+
+        if (g_printLatency.exchange(false)) {
+            printLatency();
+            printShortlistRecall();
+            printWorkBuffers();
+        }
+
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
         return true;
     };
 
-    init();
+    if (isOffline) {
+        if (isReadyToPredict == false) {
+            train();
+        }
+
+        MappedRecording recording;
+        if (recording.open(offlineFile) == false) {
+            printf("Failed to open recording '%s'\n", offlineFile.c_str());
+            return -6;
+        }
+        if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+            printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
+            return -6;
+        }
+
+        auto tStart = std::chrono::high_resolution_clock::now();
+
+        // the filter is stateful, so a filtered or converted recording is prepared in one pass before the parallel part
+        const int64_t nSamples = recording.size();
+        const float * samples = recording.samplesFloat();
+        std::vector<float> converted;
+        if (samples == nullptr || filterCapture.empty() == false) {
+            converted.resize(nSamples);
+            recording.read(0, nSamples, converted.data());
+            if (filterCapture.empty() == false) filterCapture.process(converted.data(), nSamples);
+            samples = converted.data();
+        }
+
+        std::vector<int64_t> presses;
+        detectKeyPressesParallel(samples, nSamples, thresholdBackground, presses);
+
+        auto tDetected = std::chrono::high_resolution_clock::now();
+        printf("[+] Offline: %d key presses detected in %.1f s of audio in %g ms\n", (int) presses.size(), double(nSamples)/kSampleRate,
+               std::chrono::duration<double, std::milli>(tDetected - tStart).count());
+
+        // every press is scored on a zero-padded snippet of kSamplesPerWaveform samples around it
+        for (auto pos : presses) {
+            auto item = workPool.acquire();
+            auto & workData = *item;
+            workData.ampl.assign(kSamplesPerWaveform, 0.0f);
+            int64_t i0 = pos - kSamplesPerWaveform/2;
+            for (int64_t i = std::max<int64_t>(0, -i0); i < kSamplesPerWaveform && i0 + i < nSamples; ++i) {
+                workData.ampl[i] = samples[i0 + i];
+            }
+            workData.positionsToPredict.assign(1, kSamplesPerWaveform/2);
+            workData.stamps.clear();
+
+            workData.tDetect_us = getTime_us();
+            workData.stamps.push_back({ pos, workData.tDetect_us });
+
+            workQueue.push(std::move(item), false);
+        }
+        while (workQueue.idle() == false) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        auto tEnd = std::chrono::high_resolution_clock::now();
+        double elapsed_s = std::chrono::duration<double>(tEnd - tStart).count();
+        printf("[+] Offline: %.1f s of audio processed in %.3f s - %.1fx real time, %.1f presses/s, %d workers\n",
+               double(nSamples)/kSampleRate, elapsed_s, (double(nSamples)/kSampleRate)/elapsed_s, presses.size()/elapsed_s, nWorkersPredict);
+    } else {
+        init();
 #ifdef __EMSCRIPTEN__
-    emscripten_set_main_loop(mainUpdate, 60, 1);
+        emscripten_set_main_loop(mainUpdate, 60, 1);
 #else
-    while (true) {
-        if (g_mainUpdate() == false) break;
-    }
+        while (true) {
+            if (g_mainUpdate() == false) break;
+        }
 #endif
+    }
+
+    workQueue.stop();
+
+    {
+        auto stats = workQueue.stats();
+        printf("[+] Prediction jobs: %d pushed, %d processed, %d dropped, %d workers\n",
+               (int) stats.nPushed, (int) stats.nProcessed, (int) stats.nDropped, stats.nWorkers);
+
+        if (sink.isOpen()) {
+            sink.close();
+            auto statsSink = sink.stats();
+            printf("[+] Output: %d records written, %d dropped\n", (int) statsSink.nWritten, (int) statsSink.nDropped);
+        }
+
+        if (store.isOpen()) {
+            store.close();
+            printf("[+] Feature store: %d key presses appended\n", (int) store.nWritten());
+        }
+
+        auto statsQoS = qos.stats();
+        printf("[+] Quality level changes: %d, jobs per level:", statsQoS.nLevelChanges);
+        for (auto n : statsQoS.nJobs) printf(" %d", (int) n);
+        printf("\n");
+    }
 
-    worker.join();
+    printLatency();
+    printShortlistRecall();
+    printWorkBuffers();
 
     printf("[+] Terminated");
 
@@ -3,7 +3,11 @@
  *  \author Georgi Gerganov
  */
 
+#include "constants.h"
 #include "subbreak.h"
+#include "key_press_windows.h"
+#include "mapped_recording.h"
+#include "thread_policy.h"
 
 #include "imgui.h"
 #include "imgui_impl_sdl.h"
@@ -16,6 +20,7 @@
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <deque>
 #include <fstream>
 #include <map>
@@ -32,6 +37,7 @@ struct stMatch;
 struct stKeyPressData;
 struct stWaveformView;
 struct stKeyPressCollection;
+struct stKeyPressCandidates;
 
 using TKey                  = int;
 using TSum                  = int64_t;
@@ -50,6 +56,7 @@ using TWaveformView         = stWaveformView;
 using TKeyPressPosition     = int64_t;
 using TKeyPressData         = stKeyPressData;
 using TKeyPressCollection   = stKeyPressCollection;
+using TKeyPressCandidates   = stKeyPressCandidates;
 
 struct stParameters {
     int keyPressWidth_samples   = 256;
@@ -89,6 +96,18 @@ struct stKeyPressCollection : public std::vector<TKeyPressData> {
     int nClusters = 0;
 };
 
+// local peaks of the recording together with the background level at each of them
+// none of this depends on the background threshold, so it is computed once per recording and history size
+struct stKeyPressCandidates {
+    const TSample * samples     = nullptr;
+    int64_t n                   = 0;
+    int historySize             = 0;
+
+    std::vector<TKeyPressPosition>  pos;
+    std::vector<double>             ampl;
+    std::vector<double>             background;
+};
+
 template <typename T>
 float toSeconds(T t0, T t1) {
     return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count()/1024.0f;
@@ -127,47 +146,23 @@ bool loadKeyPresses(const char * fname, const TWaveformView & waveform, TKeyPres
 }
 
 bool readFromFile(const std::string & fname, TWaveform & res) {
-    std::ifstream fin(fname, std::ios::binary | std::ios::ate);
-    if (fin.good() == false) {
+    static_assert(
+        std::is_same<TSample, int16_t>::value
+        || std::is_same<TSample, int32_t>::value
+                  , "TSample not recognised");
+
+    MappedRecording recording;
+    if (recording.open(fname) == false) {
         return false;
     }
-
-    {
-        std::streamsize size = fin.tellg();
-        fin.seekg(0, std::ios::beg);
-
-        static_assert(std::is_same<TSampleInput, float>::value, "TSampleInput not recognised");
-        static_assert(
-            std::is_same<TSample, float>::value
-            || std::is_same<TSample, int16_t>::value
-            || std::is_same<TSample, int32_t>::value
-                      , "TSampleInput not recognised");
-
-        if (std::is_same<TSample, int16_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-            //double asum = 0.0f;
-            //for (auto i = 0; i < buf.size(); ++i) asum += std::abs(buf[i]); asum /= buf.size(); asum *= 10.0;
-            //for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(2000.0*(buf[i]/asum));
-        } else if (std::is_same<TSample, int32_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-        } else if (std::is_same<TSample, float>::value) {
-            res.resize(size/sizeof(TSample));
-            fin.read((char *)(res.data()), size);
-        } else {
-        }
+    if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+        printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
+        return false;
     }
 
-    fin.close();
+    // the samples are converted straight from the mapped file, without an intermediate float copy
+    res.resize(recording.size());
+    recording.normalize(0, res.size(), recording.amax(), 32000.0, res.data());
 
     return true;
 }
@@ -216,8 +211,14 @@ bool generateLowResWaveform(const TWaveform & waveform, TWaveform & waveformLowR
     return generateLowResWaveform(getView(waveform, 0), waveformLowRes, nWindow);
 }
 
-bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, TWaveform & waveformThreshold, double thresholdBackground, int historySize) {
-    res.clear();
+bool findKeyPressCandidates(const TWaveformView & waveform, TWaveform & waveformThreshold, int historySize, TKeyPressCandidates & res) {
+    res.samples = waveform.samples;
+    res.n = waveform.n;
+    res.historySize = historySize;
+    res.pos.clear();
+    res.ampl.clear();
+    res.background.clear();
+
     waveformThreshold.resize(waveform.n);
 
     int rbBegin = 0;
@@ -231,10 +232,7 @@ bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, T
     auto samples = waveform.samples;
     auto n       = waveform.n;
 
-    TWaveform waveformAbs(n);
-    for (int64_t i = 0; i < n; ++i) {
-        waveformAbs[i] = std::abs(samples[i]);
-    }
+    auto _abs = [samples](int64_t i) { return std::abs(samples[i]); };
 
     for (int64_t i = 0; i < n; ++i) {
         {
@@ -242,7 +240,7 @@ bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, T
             if (ii >= 0) {
                 rbAverage *= rbSamples.size();
                 rbAverage -= rbSamples[rbBegin];
-                double acur = waveformAbs[i];
+                double acur = _abs(i);
                 rbSamples[rbBegin] = acur;
                 rbAverage += acur;
                 rbAverage /= rbSamples.size();
@@ -253,7 +251,7 @@ bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, T
         }
 
         if (i < k) {
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
+            while((!que.empty()) && _abs(i) >= _abs(que.back())) {
                 que.pop_back();
             }
             que.push_back(i);
@@ -262,7 +260,7 @@ bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, T
                 que.pop_front();
             }
 
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
+            while((!que.empty()) && _abs(i) >= _abs(que.back())) {
                 que.pop_back();
             }
 
@@ -270,23 +268,54 @@ bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, T
 
             int64_t itest = i - k/2;
             if (itest >= 2*k && itest < n - 2*k && que.front() == itest) {
-                double acur = waveformAbs[itest];
-                if (acur > thresholdBackground*rbAverage){
-                    TKeyPressData entry;
-                    entry.waveform = waveform;
-                    entry.pos = itest;
-                    entry.ccAvg = 0.0;
-                    entry.cid = -1;
-                    res.emplace_back(std::move(entry));
-                }
+                res.pos.push_back(itest);
+                res.ampl.push_back(_abs(itest));
+                res.background.push_back(rbAverage);
             }
-            waveformThreshold[itest] = waveformAbs[que.front()];
+            waveformThreshold[itest] = _abs(que.front());
         }
     }
 
     return true;
 }
 
+bool findKeyPresses(const TKeyPressCandidates & candidates, TKeyPressCollection & res, double thresholdBackground) {
+    res.clear();
+
+    int64_t nCandidates = candidates.pos.size();
+
+    const double * ampl = candidates.ampl.data();
+    const double * background = candidates.background.data();
+
+    std::vector<uint8_t> accept(nCandidates);
+
+    for (int64_t i = 0; i < nCandidates; ++i) {
+        accept[i] = ampl[i] > thresholdBackground*background[i];
+    }
+
+    for (int64_t i = 0; i < nCandidates; ++i) {
+        if (accept[i] == 0) continue;
+
+        TKeyPressData entry;
+        entry.waveform = { candidates.samples, candidates.n };
+        entry.pos = candidates.pos[i];
+        entry.ccAvg = 0.0;
+        entry.cid = -1;
+        res.emplace_back(std::move(entry));
+    }
+
+    return true;
+}
+
+bool findKeyPresses(const TWaveformView & waveform, TKeyPressCollection & res, TWaveform & waveformThreshold, double thresholdBackground, int historySize) {
+    TKeyPressCandidates candidates;
+    if (findKeyPressCandidates(waveform, waveformThreshold, historySize, candidates) == false) {
+        return false;
+    }
+
+    return findKeyPresses(candidates, res, thresholdBackground);
+}
+
 bool findKeyPresses(const TWaveform & waveform, TKeyPressCollection & res, TWaveform & waveformThreshold, double thresholdBackground = 10.0, int historySize = 4*1024) {
     return findKeyPresses(getView(waveform, 0), res, waveformThreshold, thresholdBackground, historySize);
 }
@@ -398,12 +427,28 @@ std::tuple<TCC, TOffset> findBestCC(
     return std::tuple<TCC, TOffset>(bestcc, besto);
 }
 
+bool extractKeyPressWindows(const TParameters & params, const TKeyPressCollection & keyPresses, KeyPressWindows & res) {
+    int nPresses = keyPresses.size();
+    if (res.init(nPresses, 2*params.keyPressWidth_samples, params.alignWindow) == false) {
+        return false;
+    }
+
+    for (int i = 0; i < nPresses; ++i) {
+        res.set(i, keyPresses[i].waveform.samples + keyPresses[i].pos + params.offsetFromPeak - params.alignWindow);
+    }
+
+    return true;
+}
+
 bool calculateSimilartyMap(const TParameters & params, TKeyPressCollection & keyPresses, TSimilarityMap & res) {
     res.clear();
     int nPresses = keyPresses.size();
 
-    int w = params.keyPressWidth_samples;
-    int alignWindow = params.alignWindow;
+    // the key press positions can be adjusted between calculations, so the windows are extracted every time
+    KeyPressWindows windows;
+    if (extractKeyPressWindows(params, keyPresses, windows) == false) {
+        return false;
+    }
 
     res.resize(nPresses);
     for (auto & x : res) x.resize(nPresses);
@@ -412,28 +457,14 @@ bool calculateSimilartyMap(const TParameters & params, TKeyPressCollection & key
         res[i][i].cc = 1.0f;
         res[i][i].offset = 0;
 
-        //auto & [waveform0, pos0, avgcc, _x] = keyPresses[i];
-        auto & waveform0 = keyPresses[i].waveform;
-        auto & pos0      = keyPresses[i].pos;
-        auto & avgcc     = keyPresses[i].ccAvg;
-
-        //auto [samples0, n0] = waveform0;
-        auto samples0 = waveform0.samples;
-        //auto n0       = waveform0.n;
+        auto & avgcc = keyPresses[i].ccAvg;
 
         for (int j = 0; j < nPresses; ++j) {
             if (i == j) continue;
 
-            auto waveform1 = keyPresses[j].waveform;
-            auto pos1      = keyPresses[j].pos;
-
-            auto samples1 = waveform1.samples;
-            //auto [bestcc, bestoffset] = findBestCC({ samples0 + pos0 + params.offsetFromPeak,               2*w },
-            //                                       { samples1 + pos1 + params.offsetFromPeak - alignWindow, 2*w + 2*alignWindow }, alignWindow);
-            auto ret = findBestCC({ samples0 + pos0 + params.offsetFromPeak,               2*w },
-                                  { samples1 + pos1 + params.offsetFromPeak - alignWindow, 2*w + 2*alignWindow }, alignWindow);
-            auto bestcc     = std::get<0>(ret);
-            auto bestoffset = std::get<1>(ret);
+            double bestcc = -1.0;
+            int bestoffset = -1;
+            windows.findBestCC(i, j, bestcc, bestoffset);
 
             res[i][j].cc = bestcc;
             res[i][j].offset = bestoffset;
@@ -1073,7 +1104,11 @@ bool renderKeyPresses(TParameters & params, const char * fnameInput, const TWave
         ImGui::SliderInt("History Size", &historySize, 512, 1024*16) && (recalculate = true);
         ImGui::SameLine();
         if (ImGui::Button("Recalculate") || recalculate) {
-            findKeyPresses(waveform, keyPresses, waveformThreshold, thresholdBackground, historySize);
+            static TKeyPressCandidates candidates;
+            if (candidates.samples != waveform.data() || candidates.n != (int64_t) waveform.size() || candidates.historySize != historySize) {
+                findKeyPressCandidates(getView(waveform, 0), waveformThreshold, historySize, candidates);
+            }
+            findKeyPresses(candidates, keyPresses, thresholdBackground);
             recalculate = false;
         }
 
@@ -1369,7 +1404,8 @@ bool prepareAudioOut(const TParameters & params) {
 int main(int argc, char ** argv) {
     srand(time(0));
 
-    printf("Usage: %s recrod.kbd n-gram.txt [letter.mask]\n", argv[0]);
+    printf("Usage: %s recrod.kbd n-gram.txt [letter.mask] [--thread-gui S]\n", argv[0]);
+    printf("    --thread-gui S - scheduling of the GUI thread, which also runs the analysis, e.g. cpu:2 - see thread_policy.h\n");
     if (argc < 3) {
         return -1;
     }
@@ -1379,9 +1415,17 @@ int main(int argc, char ** argv) {
     TKeyPressCollection keyPresses;
     TSimilarityMap similarityMap;
 
-    if (argc > 3) {
-        printf("Setting letter mask file '%s'\n", argv[3]);
-        params.fnameLetterMask = argv[3];
+    ThreadConfig threadConfig;
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--thread-gui") == 0 && i + 1 < argc) {
+            if (ThreadPolicy::parse(argv[++i], threadConfig.gui) == false) {
+                printf("Invalid thread policy for --thread-gui: '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (i == 3) {
+            printf("Setting letter mask file '%s'\n", argv[3]);
+            params.fnameLetterMask = argv[3];
+        }
     }
 
     if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER) != 0) {
@@ -1459,6 +1503,8 @@ int main(int argc, char ** argv) {
     printf("    Total number of samples: %d\n", (int) waveformInput.size());
     printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/params.sampleRate);
 
+    applyThreadPolicy("gui", threadConfig.gui);
+
     bool finishApp = false;
     while (finishApp == false) {
         SDL_Event event;
@@ -3,17 +3,25 @@
  *  \author Georgi Gerganov
  */
 
+#include "constants.h"
+#include "audio_filter.h"
+#include "key_press_windows.h"
+#include "mapped_recording.h"
+#include "thread_policy.h"
+
 #include <array>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <deque>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <string>
 #include <tuple>
 #include <vector>
 #include <algorithm>
+#include <cstring>
 
 #define MY_DEBUG
 
@@ -33,6 +41,16 @@ using TKeyPressPosition     = int64_t;
 using TKeyPressData         = std::tuple<TWaveformView, TKeyPressPosition, TClusterId, TCC>;
 using TKeyPressCollection   = std::vector<TKeyPressData>;
 
+// key press windows extracted while streaming through a recording
+struct stKeyPressStore {
+    int64_t before = 0;                         // samples stored before the peak
+    int64_t window = 0;                         // samples stored per key press
+    std::vector<TSample> samples;               // window*positions.size() samples
+    std::vector<TKeyPressPosition> positions;   // peak positions in the recording
+};
+
+using TKeyPressStore        = stKeyPressStore;
+
 template <typename T>
 float toSeconds(T t0, T t1) {
     return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count()/1024.0f;
@@ -44,48 +62,75 @@ TWaveformView getView(const TWaveform & waveform, int64_t idx) { return TWavefor
 
 TWaveformView getView(const TWaveform & waveform, int64_t idx, int64_t len) { return TWaveformView { waveform.data() + idx, len }; }
 
-bool readFromFile(const std::string & fname, TWaveform & res) {
-    std::ifstream fin(fname, std::ios::binary | std::ios::ate);
-    if (fin.good() == false) {
+// calls cb for consecutive chunks of the recording
+// without a filter, raw float32 recordings are passed straight from the mapped file
+bool forEachChunk(const MappedRecording & recording, AudioFilter * filter, const std::function<void(const TSampleInput * samples, int64_t n)> & cb) {
+    static_assert(std::is_same<TSampleInput, float>::value, "TSampleInput not recognised");
+
+    const int64_t kChunkSize = 1024*1024;
+
+    auto samples = recording.samplesFloat();
+    if (samples && filter == nullptr) {
+        for (int64_t i0 = 0; i0 < recording.size(); i0 += kChunkSize) {
+            cb(samples + i0, std::min(kChunkSize, recording.size() - i0));
+        }
+        return true;
+    }
+
+    if (filter) filter->reset();
+
+    std::vector<TSampleInput> chunk(kChunkSize);
+    for (int64_t i0 = 0; i0 < recording.size(); i0 += kChunkSize) {
+        int64_t n = std::min(kChunkSize, recording.size() - i0);
+        recording.read(i0, n, chunk.data());
+        if (filter) filter->process(chunk.data(), n);
+        cb(chunk.data(), n);
+    }
+
+    return true;
+}
+
+double findMaxAmplitude(const MappedRecording & recording, AudioFilter * filter) {
+    if (filter == nullptr) {
+        return recording.amax();
+    }
+
+    double amax = 0.0f;
+    forEachChunk(recording, filter, [&](const TSampleInput * samples, int64_t n) {
+        for (int64_t i = 0; i < n; ++i) if (std::abs(samples[i]) > amax) amax = std::abs(samples[i]);
+    });
+
+    return amax;
+}
+
+bool readFromFile(const std::string & fname, TWaveform & res, AudioFilter * filter = nullptr) {
+    static_assert(
+        std::is_same<TSample, int16_t>::value
+        || std::is_same<TSample, int32_t>::value
+                  , "TSample not recognised");
+
+    MappedRecording recording;
+    if (recording.open(fname) == false) {
+        return false;
+    }
+    if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+        printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
         return false;
     }
 
-    {
-        std::streamsize size = fin.tellg();
-        fin.seekg(0, std::ios::beg);
-
-        static_assert(std::is_same<TSampleInput, float>::value, "TSampleInput not recognised");
-        static_assert(
-            std::is_same<TSample, float>::value
-            || std::is_same<TSample, int16_t>::value
-            || std::is_same<TSample, int32_t>::value
-                      , "TSampleInput not recognised");
-
-        if (std::is_same<TSample, int16_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-            //double asum = 0.0f;
-            //for (auto i = 0; i < buf.size(); ++i) asum += std::abs(buf[i]); asum /= buf.size(); asum *= 10.0;
-            //for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(2000.0*(buf[i]/asum));
-        } else if (std::is_same<TSample, int32_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-        } else if (std::is_same<TSample, float>::value) {
-            res.resize(size/sizeof(TSample));
-            fin.read((char *)(res.data()), size);
-        } else {
-        }
+    res.resize(recording.size());
+
+    double amax = findMaxAmplitude(recording, filter);
+    if (filter == nullptr) {
+        recording.normalize(0, res.size(), amax, 32000.0, res.data());
+        return true;
     }
 
-    fin.close();
+    int64_t offset = 0;
+    forEachChunk(recording, filter, [&](const TSampleInput * samples, int64_t n) {
+        for (int64_t i = 0; i < n; ++i) res[offset + i] = std::round(32000.0*(samples[i]/amax));
+        offset += n;
+    });
 
     return true;
 }
@@ -152,6 +197,111 @@ bool findKeyPresses(const TWaveform & waveform, TKeyPressCollection & res) {
     return findKeyPresses(getView(waveform, 0), res);
 }
 
+// same detection as findKeyPresses(), but streams through the mapped recording and keeps only the key press windows
+bool findKeyPressesStreaming(const std::string & fname, TKeyPressStore & res, int64_t & nSamples, AudioFilter * filter = nullptr) {
+    static_assert(std::is_same<TSample, int32_t>::value, "TSample not recognised");
+
+    const int64_t kHistorySize = 8*1024;
+
+    int k = 1024;
+    double thresholdBackground = 10.0;
+
+    MappedRecording recording;
+    if (recording.open(fname) == false) {
+        return false;
+    }
+    if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+        printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
+        return false;
+    }
+
+    nSamples = recording.size();
+
+    double amax = findMaxAmplitude(recording, filter);
+
+    res.before = 2*k;
+    res.window = 4*k;
+    res.samples.clear();
+    res.positions.clear();
+
+    int rbBegin = 0;
+    double rbAverage = 0.0;
+    std::array<double, 4*1024> rbSamples;
+    rbSamples.fill(0.0);
+
+    // last kHistorySize samples, indexed by absolute sample position
+    std::vector<TSample> history(kHistorySize);
+    auto sample = [&](int64_t i) { return history[i & (kHistorySize - 1)]; };
+
+    std::deque<int64_t> que;
+    std::deque<int64_t> pending;
+
+    int64_t i = 0;
+    return forEachChunk(recording, filter, [&](const TSampleInput * samples, int64_t n) {
+        for (int64_t ic = 0; ic < n; ++ic, ++i) {
+            TSample cur = std::round(32000.0*(samples[ic]/amax));
+            history[i & (kHistorySize - 1)] = cur;
+
+            {
+                rbAverage *= rbSamples.size();
+                rbAverage -= rbSamples[rbBegin];
+                double acur = std::abs(cur);
+                rbSamples[rbBegin] = acur;
+                rbAverage += acur;
+                rbAverage /= rbSamples.size();
+                if (++rbBegin >= rbSamples.size()) {
+                    rbBegin = 0;
+                }
+            }
+
+            while((!que.empty()) && que.front() <= i - k) {
+                que.pop_front();
+            }
+
+            while((!que.empty()) && cur >= sample(que.back())) {
+                que.pop_back();
+            }
+
+            que.push_back(i);
+
+            int64_t itest = i - k/2;
+            if (itest >= 2*k && itest < nSamples - 2*k && que.front() == itest) {
+                double acur = sample(itest);
+                if (acur > thresholdBackground*rbAverage){
+                    pending.push_back(itest);
+                }
+            }
+
+            while ((!pending.empty()) && pending.front() - res.before + res.window - 1 == i) {
+                int64_t i0 = pending.front() - res.before;
+                for (int64_t j = i0; j < i0 + res.window; ++j) {
+                    res.samples.push_back(sample(j));
+                }
+                res.positions.push_back(pending.front());
+                pending.pop_front();
+            }
+        }
+    });
+}
+
+bool findKeyPresses(const TKeyPressStore & store, TKeyPressCollection & res) {
+    res.clear();
+    for (int i = 0; i < (int) store.positions.size(); ++i) {
+        res.push_back(TKeyPressData {TWaveformView {store.samples.data() + i*store.window, store.window}, store.before, 0, 0.0});
+    }
+
+    return true;
+}
+
+bool dumpKeyPresses(const std::string & fname, const std::vector<TKeyPressPosition> & positions) {
+    std::ofstream fout(fname);
+    for (auto & idx : positions) {
+        fout << idx << " 1" << std::endl;
+    }
+    fout.close();
+    return true;
+}
+
 bool dumpKeyPresses(const std::string & fname, const TKeyPressCollection & data) {
     std::ofstream fout(fname);
     for (auto & k : data) {
@@ -260,45 +410,42 @@ std::tuple<TCC, TOffset> findBestCC(
     return std::tuple<TCC, TOffset>(bestcc, besto);
 }
 
-bool calculateSimilartyMap(TKeyPressCollection & keyPresses, TSimilarityMap & res) {
-    res.clear();
+bool extractKeyPressWindows(const TKeyPressCollection & keyPresses, int w, int alignWindow, KeyPressWindows & res) {
     int nPresses = keyPresses.size();
+    if (res.init(nPresses, 2*w, alignWindow) == false) {
+        return false;
+    }
 
-    int w = 256;
-    int alignWindow = 256;
+    for (int i = 0; i < nPresses; ++i) {
+        auto samples = std::get<0>(std::get<0>(keyPresses[i]));
+        auto pos     = std::get<1>(keyPresses[i]);
+
+        res.set(i, samples + pos + (int)(0.5f*w) - alignWindow);
+    }
+
+    return true;
+}
+
+bool calculateSimilartyMap(const KeyPressWindows & windows, TKeyPressCollection & keyPresses, TSimilarityMap & res) {
+    res.clear();
+    int nPresses = keyPresses.size();
+    if (windows.size() != nPresses) {
+        return false;
+    }
 
     res.resize(nPresses);
     for (auto & x : res) x.resize(nPresses);
 
     for (int i = 0; i < nPresses; ++i) {
         res[i][i] = TMatch { 1.0f, 0 };
-        //auto & [waveform0, pos0, _i2, avgcc] = keyPresses[i];
-        auto & waveform0 = std::get<0>(keyPresses[i]);
-        auto & pos0      = std::get<1>(keyPresses[i]);
-        //   &           = std::get<2>(keyPresses[i]);
-        auto & avgcc     = std::get<3>(keyPresses[i]);
-
-        //auto [samples0, n0] = waveform0;
-        auto samples0 = std::get<0>(waveform0);
-        //auto n0       = std::get<1>(waveform0);
+        auto & avgcc = std::get<3>(keyPresses[i]);
 
         for (int j = 0; j < nPresses; ++j) {
             if (i == j) continue;
 
-            //auto [waveform1, pos1, _j2, _j3] = keyPresses[j];
-            auto waveform1 = std::get<0>(keyPresses[j]);
-            auto pos1      = std::get<1>(keyPresses[j]);
-
-            //auto [samples1, n1] = waveform1;
-            auto samples1 = std::get<0>(waveform1);
-            //auto n1       = std::get<1>(waveform1);
-
-            //auto [bestcc, bestoffset] = findBestCC({ samples0 + pos0 + (int)(0.5f*w),               2*w },
-            //                                       { samples1 + pos1 + (int)(0.5f*w) - alignWindow, 2*w + 2*alignWindow }, alignWindow);
-            auto ret = findBestCC(TWaveformView { samples0 + pos0 + (int)(0.5f*w),               2*w },
-                                  TWaveformView { samples1 + pos1 + (int)(0.5f*w) - alignWindow, 2*w + 2*alignWindow }, alignWindow);
-            auto bestcc     = std::get<0>(ret);
-            auto bestoffset = std::get<1>(ret);
+            double bestcc = -1.0;
+            int bestoffset = -1;
+            windows.findBestCC(i, j, bestcc, bestoffset);
 
             res[j][i] = TMatch { bestcc, bestoffset };
             //res[i][j] = { bestcc, -bestoffset };
@@ -652,36 +799,90 @@ bool clusterG2(TSimilarityMap & sim, TKeyPressCollection & keyPresses) {
 int main(int argc, char ** argv) {
     srand(time(0));
 
-    printf("Usage: %s record.kbd\n", argv[0]);
+    printf("Usage: %s record.kbd [-fS] [-s] [--thread-compute S]\n", argv[0]);
+    printf("    -fS - pre-filter audio with biquad sections, e.g. -fhp:100 or -fhp:80,bp:3000:0.5\n");
+    printf("    -s  - streaming mode: read the recording in chunks and keep only the key press windows in memory\n");
+    printf("    --thread-compute S - scheduling of the analysis, e.g. cpu:2,nice:-5 - see thread_policy.h\n");
     if (argc < 2) {
         return -1;
     }
 
     int64_t sampleRate = 24000;
 
-    TWaveform waveformInput;
-    printf("[+] Loading recording from '%s'\n", argv[1]);
-    if (readFromFile(argv[1], waveformInput) == false) {
-        printf("Specified file '%s' does not exist\n", argv[1]);
-        return -1;
+    bool streaming = false;
+    AudioFilter filter;
+    ThreadConfig threadConfig;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--thread-compute") == 0 && i + 1 < argc) {
+            if (ThreadPolicy::parse(argv[++i], threadConfig.compute) == false) {
+                printf("Invalid thread policy for --thread-compute: '%s'\n", argv[i]);
+                return -1;
+            }
+            continue;
+        }
+        if (strncmp(argv[i], "-f", 2) == 0) {
+            if (filter.addSections(argv[i] + 2, sampleRate) == false) {
+                printf("Invalid filter specification: '%s'\n", argv[i] + 2);
+                return -1;
+            }
+            printf("[+] Pre-filter: %d biquad section(s) - '%s'\n", filter.nSections(), argv[i] + 2);
+        }
+        if (strcmp(argv[i], "-s") == 0) {
+            streaming = true;
+        }
     }
 
-    //{
-    //    std::ofstream fout("waveform.plot");
-    //    for (auto & a : waveformInput) {
-    //        fout << a << std::endl;
-    //    }
-    //    fout.close();
-    //}
-
-    printf("[+] Loaded recording: of %d samples (sample size = %d bytes)\n", (int) waveformInput.size(), (int) sizeof(TSample));
-    printf("    Size in memory:          %g MB\n", (float)(sizeof(TSample)*waveformInput.size())/1024/1024);
-    printf("    Sample size:             %d\n", (int) sizeof(TSample));
-    printf("    Total number of samples: %d\n", (int) waveformInput.size());
-    printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/sampleRate);
+    // the whole analysis runs on the main thread
+    applyThreadPolicy("compute", threadConfig.compute);
 
+    TWaveform waveformInput;
+    TKeyPressStore keyPressStore;
     TKeyPressCollection keyPresses;
-    {
+
+    if (streaming) {
+        int64_t nSamples = 0;
+
+        auto tStart = std::chrono::high_resolution_clock::now();
+        printf("[+] Streaming recording from '%s' and searching for key presses\n", argv[1]);
+        if (findKeyPressesStreaming(argv[1], keyPressStore, nSamples, filter.empty() ? nullptr : &filter) == false) {
+            printf("Failed to read recording '%s'\n", argv[1]);
+            return -1;
+        }
+        findKeyPresses(keyPressStore, keyPresses);
+        auto tEnd = std::chrono::high_resolution_clock::now();
+
+        printf("[+] Streamed recording: of %d samples\n", (int) nSamples);
+        printf("    Recording length:        %g seconds\n", (float)(nSamples)/sampleRate);
+        printf("    Key press window:        %d samples\n", (int) keyPressStore.window);
+        printf("    Size in memory:          %g MB\n", (float)(sizeof(TSample)*keyPressStore.samples.size())/1024/1024);
+        printf("[+] Detected a total of %d potential key presses\n", (int) keyPresses.size());
+        for (auto & pos : keyPressStore.positions) {
+            printf("    position - %d\n", (int) pos);
+        }
+        printf("[+] Search took %4.3f seconds\n", toSeconds(tStart, tEnd));
+
+        dumpKeyPresses("key_presses.plot", keyPressStore.positions);
+    } else {
+        printf("[+] Loading recording from '%s'\n", argv[1]);
+        if (readFromFile(argv[1], waveformInput, filter.empty() ? nullptr : &filter) == false) {
+            printf("Specified file '%s' does not exist\n", argv[1]);
+            return -1;
+        }
+
+        //{
+        //    std::ofstream fout("waveform.plot");
+        //    for (auto & a : waveformInput) {
+        //        fout << a << std::endl;
+        //    }
+        //    fout.close();
+        //}
+
+        printf("[+] Loaded recording: of %d samples (sample size = %d bytes)\n", (int) waveformInput.size(), (int) sizeof(TSample));
+        printf("    Size in memory:          %g MB\n", (float)(sizeof(TSample)*waveformInput.size())/1024/1024);
+        printf("    Sample size:             %d\n", (int) sizeof(TSample));
+        printf("    Total number of samples: %d\n", (int) waveformInput.size());
+        printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/sampleRate);
+
         auto tStart = std::chrono::high_resolution_clock::now();
         printf("[+] Searching for key presses\n");
         if (findKeyPresses(waveformInput, keyPresses) == false) {
@@ -703,11 +904,24 @@ int main(int argc, char ** argv) {
 
     //keyPresses.erase(keyPresses.begin(), keyPresses.begin() + keyPresses.size()/2);
 
+    KeyPressWindows keyPressWindows;
+    {
+        int w = 256;
+        int alignWindow = 256;
+
+        if (extractKeyPressWindows(keyPresses, w, alignWindow, keyPressWindows) == false) {
+            printf("Failed to extract key press windows\n");
+            return -3;
+        }
+        printf("[+] Extracted key press windows: %d x %d samples, %g MB\n",
+               keyPressWindows.size(), keyPressWindows.stride(), (float)(keyPressWindows.sizeInBytes())/1024/1024);
+    }
+
     TSimilarityMap similarityMap;
     {
         auto tStart = std::chrono::high_resolution_clock::now();
         printf("[+] Calculating CC similarity map\n");
-        if (calculateSimilartyMap(keyPresses, similarityMap) == false) {
+        if (calculateSimilartyMap(keyPressWindows, keyPresses, similarityMap) == false) {
             printf("Failed to calculate similariy map\n");
             return -3;
         }
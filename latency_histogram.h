@@ -0,0 +1,86 @@
+/*! \file latency_histogram.h
+ *  \brief Lock-free histograms of processing latencies with power-of-two buckets
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// same clock as AudioLogger::FrameStamp::time_us
+static int64_t getTime_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// bucket i counts the latencies in [2^(i - 1), 2^i) us, bucket 0 - below 1 us
+class LatencyHistogram {
+    public:
+        static constexpr int kBuckets = 32;
+
+        explicit LatencyHistogram(std::string name) : name_(std::move(name)) {
+            for (auto & b : buckets_) b = 0;
+        }
+
+        void add(int64_t latency_us) {
+            latency_us = std::max<int64_t>(0, latency_us);
+
+            int bucket = 0;
+            while (bucket < kBuckets - 1 && (int64_t(1) << bucket) <= latency_us) ++bucket;
+
+            ++buckets_[bucket];
+            ++count_;
+            sum_us_ += latency_us;
+
+            int64_t curMax = max_us_;
+            while (latency_us > curMax && max_us_.compare_exchange_weak(curMax, latency_us) == false) {}
+        }
+
+        // upper bound of the bucket that contains the given fraction of the samples
+        double percentile_ms(double p) const {
+            uint64_t n = count_;
+            if (n == 0) return 0.0;
+
+            uint64_t target = std::max<uint64_t>(1, p*n + 0.5);
+            uint64_t cur = 0;
+            for (int i = 0; i < kBuckets; ++i) {
+                cur += buckets_[i];
+                if (cur >= target) return std::min<int64_t>(int64_t(1) << i, max_us_)*1e-3;
+            }
+            return max_us_*1e-3;
+        }
+
+        void print() const {
+            uint64_t n = count_;
+            if (n == 0) {
+                printf("    %-20s: no samples\n", name_.c_str());
+                return;
+            }
+
+            printf("    %-20s: n = %6d, mean = %9.3f ms, p50 <= %9.3f ms, p90 <= %9.3f ms, p99 <= %9.3f ms, max = %9.3f ms\n",
+                   name_.c_str(), (int) n, 1e-3*sum_us_/n, percentile_ms(0.5), percentile_ms(0.9), percentile_ms(0.99), 1e-3*max_us_);
+
+            uint64_t nMax = 0;
+            for (const auto & b : buckets_) nMax = std::max<uint64_t>(nMax, b);
+            for (int i = 0; i < kBuckets; ++i) {
+                uint64_t cur = buckets_[i];
+                if (cur == 0) continue;
+                double lo = i == 0 ? 0.0 : (int64_t(1) << (i - 1))*1e-3;
+                double hi = (int64_t(1) << i)*1e-3;
+                printf("        [%9.3f, %9.3f) ms %6d %s\n", lo, hi, (int) cur, std::string((40*cur + nMax - 1)/nMax, '#').c_str());
+            }
+        }
+
+    private:
+        std::string name_;
+
+        std::atomic<uint64_t> buckets_[kBuckets];
+        std::atomic<uint64_t> count_ { 0 };
+        std::atomic<int64_t> sum_us_ { 0 };
+        std::atomic<int64_t> max_us_ { 0 };
+};
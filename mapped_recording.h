@@ -0,0 +1,233 @@
+/*! \file mapped_recording.h
+ *  \brief Memory-mapped access to recordings without copying them into memory
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read-only view of a whole file
+// falls back to reading the file into memory where mmap is not available
+class MappedFile {
+    public:
+        MappedFile() {}
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile & operator = (const MappedFile &) = delete;
+
+        bool open(const std::string & fname) {
+            close();
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+            if (fin.good() == false) {
+                return false;
+            }
+            buffer_.resize(fin.tellg());
+            fin.seekg(0, std::ios::beg);
+            fin.read((char *)(buffer_.data()), buffer_.size());
+            data_ = buffer_.data();
+            size_ = buffer_.size();
+#else
+            int fd = ::open(fname.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+
+            size_ = st.st_size;
+            if (size_ > 0) {
+                void * addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr == MAP_FAILED) {
+                    ::close(fd);
+                    size_ = 0;
+                    return false;
+                }
+                madvise(addr, size_, MADV_SEQUENTIAL);
+                data_ = (const uint8_t *) addr;
+            }
+            ::close(fd);
+#endif
+
+            return true;
+        }
+
+        void close() {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            buffer_.clear();
+            buffer_.shrink_to_fit();
+#else
+            if (data_ && size_ > 0) {
+                munmap((void *) data_, size_);
+            }
+#endif
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        const uint8_t * data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        const uint8_t * data_ = nullptr;
+        size_t size_ = 0;
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+        std::vector<uint8_t> buffer_;
+#endif
+};
+
+// mono recording stored as raw float32 samples (record-full output) or as a 16-bit PCM / 32-bit float WAV file
+// samples are converted only when a range of them is requested
+class MappedRecording {
+    public:
+        enum Format {
+            Float32,
+            Int16,
+        };
+
+        bool open(const std::string & fname) {
+            if (file_.open(fname) == false) {
+                return false;
+            }
+
+            format_ = Float32;
+            sampleRate_ = 0;
+            data_ = file_.data();
+            nSamples_ = file_.size()/sizeof(float);
+            amax_ = -1.0;
+
+            if (file_.size() >= 12 && memcmp(data_, "RIFF", 4) == 0 && memcmp(data_ + 8, "WAVE", 4) == 0) {
+                return parseWav();
+            }
+
+            return true;
+        }
+
+        Format format() const { return format_; }
+        int sampleRate() const { return sampleRate_; }
+        int64_t size() const { return nSamples_; }
+
+        // zero-copy access, only for aligned float32 data
+        const float * samplesFloat() const {
+            if (format_ != Float32 || ((uintptr_t) data_) % alignof(float) != 0) return nullptr;
+            return (const float *) data_;
+        }
+
+        float at(int64_t i) const {
+            if (format_ == Int16) {
+                int16_t s;
+                memcpy(&s, data_ + i*sizeof(int16_t), sizeof(s));
+                return s/32768.0f;
+            }
+
+            float s;
+            memcpy(&s, data_ + i*sizeof(float), sizeof(s));
+            return s;
+        }
+
+        void read(int64_t offset, int64_t n, float * dst) const {
+            for (int64_t i = 0; i < n; ++i) dst[i] = at(offset + i);
+        }
+
+        // maximum absolute amplitude, computed once
+        double amax() const {
+            if (amax_ < 0.0) {
+                double res = 0.0;
+                if (auto samples = samplesFloat()) {
+                    for (int64_t i = 0; i < nSamples_; ++i) if (std::abs(samples[i]) > res) res = std::abs(samples[i]);
+                } else {
+                    for (int64_t i = 0; i < nSamples_; ++i) if (std::abs(at(i)) > res) res = std::abs(at(i));
+                }
+                amax_ = res;
+            }
+            return amax_;
+        }
+
+        // dst[i] = round(peak*(x[offset + i]/amax))
+        template <typename T>
+        void normalize(int64_t offset, int64_t n, double amax, double peak, T * dst) const {
+            if (auto samples = samplesFloat()) {
+                samples += offset;
+                for (int64_t i = 0; i < n; ++i) dst[i] = std::round(peak*(samples[i]/amax));
+            } else {
+                for (int64_t i = 0; i < n; ++i) dst[i] = std::round(peak*(at(offset + i)/amax));
+            }
+        }
+
+    private:
+        bool parseWav() {
+            const uint8_t * data = file_.data();
+            const size_t size = file_.size();
+
+            auto u16 = [](const uint8_t * x) { return (uint16_t) (x[0] | (x[1] << 8)); };
+            auto u32 = [](const uint8_t * x) { return (uint32_t) (x[0] | (x[1] << 8) | (x[2] << 16) | ((uint32_t) x[3] << 24)); };
+
+            bool hasFormat = false;
+            size_t pos = 12;
+            while (pos + 8 <= size) {
+                const uint8_t * chunk = data + pos + 8;
+                size_t chunkSize = std::min<size_t>(u32(data + pos + 4), size - pos - 8);
+                if (memcmp(data + pos, "fmt ", 4) == 0 && chunkSize >= 16) {
+                    int audioFormat   = u16(chunk + 0);
+                    int nChannels     = u16(chunk + 2);
+                    int bitsPerSample = u16(chunk + 14);
+                    sampleRate_ = u32(chunk + 4);
+
+                    if (nChannels != 1) {
+                        fprintf(stderr, "Only mono WAV files are supported (channels = %d)\n", nChannels);
+                        return false;
+                    }
+                    if (audioFormat == 1 && bitsPerSample == 16) {
+                        format_ = Int16;
+                    } else if (audioFormat == 3 && bitsPerSample == 32) {
+                        format_ = Float32;
+                    } else {
+                        fprintf(stderr, "Unsupported WAV format (format = %d, bits = %d)\n", audioFormat, bitsPerSample);
+                        return false;
+                    }
+                    hasFormat = true;
+                } else if (memcmp(data + pos, "data", 4) == 0 && hasFormat) {
+                    data_ = chunk;
+                    nSamples_ = chunkSize/(format_ == Int16 ? sizeof(int16_t) : sizeof(float));
+                    return true;
+                }
+                pos += 8 + chunkSize + (chunkSize & 1);
+            }
+
+            fprintf(stderr, "Invalid WAV file\n");
+            return false;
+        }
+
+        MappedFile file_;
+
+        Format format_ = Float32;
+        int sampleRate_ = 0;
+
+        const uint8_t * data_ = nullptr;
+        int64_t nSamples_ = 0;
+
+        mutable double amax_ = -1.0;
+};
@@ -0,0 +1,205 @@
+/*! \file model_bank.h
+ *  \brief Templates of several keyboard models matched together, with automatic selection of the best model
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+#include "key_model.h"
+
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ModelBankStats {
+    int selected = -1;
+    int nPresses = 0;               // presses scored against all models
+    std::vector<double> meanCC;     // average best CC of every model over these presses
+    std::vector<int> nWins;         // presses for which the model had the best CC
+};
+
+// All templates of all models are kept in one flat bank. A key press is matched against the bank in a single pass
+// over the offsets - the sums of each input window are computed once and shared by all templates. Until a model is
+// selected, every press is scored against all models. After nSelectPresses presses with a prediction above
+// thresholdCC, the model with the highest average best CC is selected and the other models are no longer scored.
+class ModelBank {
+    public:
+        explicit ModelBank(int nSelectPresses = 5, TValueCC thresholdCC = 0.5f) :
+            nSelectPresses_(nSelectPresses), thresholdCC_(thresholdCC) {}
+
+        ModelBank(const ModelBank &) = delete;
+        ModelBank & operator = (const ModelBank &) = delete;
+
+        // must not be called after the first predict()
+        bool add(const std::string & name, KeyModel && model) {
+            if (model.templates.empty()) return false;
+
+            names_.push_back(name);
+            models_.emplace_back(std::move(model));
+            stats_.meanCC.push_back(0.0);
+            stats_.nWins.push_back(0);
+
+            entries_.clear();
+            for (int i = 0; i < (int) models_.size(); ++i) {
+                for (const auto & kt : models_[i].templates) {
+                    const auto & waveform = kt.second;
+                    int is00 = waveform.size()/2 - kSamplesPerFrame;
+                    auto ret = calcSum(waveform, is00, is00 + 2*kSamplesPerFrame);
+                    entries_.push_back({ i, kt.first, waveform.data() + is00, std::get<0>(ret), std::get<1>(ret) });
+                }
+            }
+
+            return true;
+        }
+
+        int size() const { return models_.size(); }
+        const std::string & name(int i) const { return names_[i]; }
+        const KeyModel & model(int i) const { return models_[i]; }
+
+        int selected() const { return selected_; }
+
+        // res gets one prediction per model, empty for the models that are not scored
+        // returns the model with the best prediction, or -1
+        int predict(const TKeyWaveform & ampl, int curPos, int alignWindow, std::vector<TKeyPrediction> & res, int nWorkers = 1) const {
+            const int selected = selected_;
+            const int ncc = 2*kSamplesPerFrame;
+            const int scmp0 = curPos - kSamplesPerFrame;
+
+            res.assign(models_.size(), TKeyPrediction());
+            if (scmp0 - alignWindow < 0 || scmp0 + ncc + alignWindow > (int) ampl.size()) return -1;
+
+            std::vector<const Entry *> entries;
+            for (const auto & entry : entries_) {
+                if (selected == -1 || entry.model == selected) entries.push_back(&entry);
+            }
+
+            struct Best {
+                TValueCC cc = -1.0f;
+                TOffset offset = 0;
+            };
+
+            nWorkers = std::max(1, std::min(nWorkers, 2*alignWindow));
+            std::vector<std::vector<Best>> best(nWorkers, std::vector<Best>(entries.size()));
+
+            parallelFor(nWorkers, nWorkers, [&](int iw) {
+                auto & cur = best[iw];
+                for (int o = -alignWindow + iw; o < alignWindow; o += nWorkers) {
+                    const float * w = ampl.data() + scmp0 + o;
+
+                    TSum sum1 = 0.0f;
+                    TSum2 sum12 = 0.0f;
+                    for (int is = 0; is < ncc; ++is) {
+                        sum1 += w[is];
+                        sum12 += w[is]*w[is];
+                    }
+                    double den2b = sum12*ncc - sum1*sum1;
+
+                    for (int ie = 0; ie < (int) entries.size(); ++ie) {
+                        const auto & entry = *entries[ie];
+
+                        TSum2 sum01 = 0.0f;
+                        for (int is = 0; is < ncc; ++is) sum01 += entry.data[is]*w[is];
+
+                        double nom = sum01*ncc - entry.sum0*sum1;
+                        double den2a = entry.sum02*ncc - entry.sum0*entry.sum0;
+                        TValueCC cc = nom/sqrt(den2a*den2b);
+                        if (cc > cur[ie].cc) {
+                            cur[ie].cc = cc;
+                            cur[ie].offset = o;
+                        }
+                    }
+                }
+            });
+
+            int bestModel = -1;
+            TValueCC bestCC = -1.0f;
+            for (int ie = 0; ie < (int) entries.size(); ++ie) {
+                Best cur;
+                for (int iw = 0; iw < nWorkers; ++iw) {
+                    if (best[iw][ie].cc > cur.cc) cur = best[iw][ie];
+                }
+
+                const auto & entry = *entries[ie];
+                auto & prediction = res[entry.model];
+                prediction.confidence[entry.key] = cur.cc;
+                if (cur.cc > prediction.cc) {
+                    prediction.key = entry.key;
+                    prediction.cc = cur.cc;
+                    prediction.offset = cur.offset;
+                }
+                if (cur.cc > bestCC) {
+                    bestCC = cur.cc;
+                    bestModel = entry.model;
+                }
+            }
+
+            return bestModel;
+        }
+
+        // adds the predictions of one press as evidence for the selection, in the order of the presses
+        // returns true if this press completed the selection
+        bool update(const std::vector<TKeyPrediction> & res) {
+            if (selected_ != -1 || models_.size() < 2 || res.size() != models_.size()) return false;
+
+            int bestModel = -1;
+            TValueCC bestCC = -1.0f;
+            for (int i = 0; i < (int) res.size(); ++i) {
+                if (res[i].key == -1) return false;
+                if (res[i].cc > bestCC) {
+                    bestCC = res[i].cc;
+                    bestModel = i;
+                }
+            }
+            if (bestCC <= thresholdCC_) return false;
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            int n = stats_.nPresses++;
+            for (int i = 0; i < (int) res.size(); ++i) {
+                stats_.meanCC[i] = (stats_.meanCC[i]*n + res[i].cc)/(n + 1);
+            }
+            ++stats_.nWins[bestModel];
+
+            if (stats_.nPresses < nSelectPresses_) return false;
+
+            int selected = 0;
+            for (int i = 1; i < (int) models_.size(); ++i) {
+                if (stats_.meanCC[i] > stats_.meanCC[selected]) selected = i;
+            }
+            stats_.selected = selected;
+            selected_ = selected;
+
+            return true;
+        }
+
+        ModelBankStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return stats_;
+        }
+
+    private:
+        struct Entry {
+            int model;
+            TKey key;
+            const AudioLogger::Sample * data;   // the matched segment of the template
+            TSum sum0;
+            TSum2 sum02;
+        };
+
+        int nSelectPresses_;
+        TValueCC thresholdCC_;
+
+        std::vector<std::string> names_;
+        std::vector<KeyModel> models_;
+        std::vector<Entry> entries_;
+
+        std::atomic<int> selected_ { -1 };
+
+        mutable std::mutex mutex_;
+        ModelBankStats stats_;
+};
@@ -0,0 +1,110 @@
+/*! \file object_pool.h
+ *  \brief Fixed set of preallocated objects, recycled instead of allocated for every job
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct ObjectPoolStats {
+    int nObjects = 0;
+    int nFree = 0;
+    uint64_t nAcquired = 0;
+    uint64_t nMisses = 0;   // the pool was empty and a temporary object was allocated
+};
+
+// All objects are created and initialized up front. acquire() hands out an object wrapped in a Handle - a
+// unique_ptr that puts the object back to the pool when it is destroyed or reset, so the objects can be moved
+// through queues like any other owned data. The objects are returned as they were left, e.g. with the capacity
+// of their vectors, and the user overwrites their contents. If the pool is empty, a temporary object is
+// allocated and deleted on release, and the miss is counted. The pool must outlive all handles.
+template <typename T>
+class ObjectPool {
+    public:
+        using Init = std::function<void(T & object)>;
+
+        class Release {
+            public:
+                Release(ObjectPool * pool = nullptr) : pool_(pool) {}
+                void operator () (T * object) const { if (pool_) pool_->release(object); else delete object; }
+
+            private:
+                ObjectPool * pool_;
+        };
+
+        using Handle = std::unique_ptr<T, Release>;
+
+        ObjectPool(int nObjects, Init init) : init_(std::move(init)) {
+            objects_.reserve(nObjects);
+            free_.reserve(nObjects);
+            for (int i = 0; i < nObjects; ++i) {
+                objects_.emplace_back(new T());
+                if (init_) init_(*objects_.back());
+                free_.push_back(objects_.back().get());
+            }
+        }
+
+        ObjectPool(const ObjectPool &) = delete;
+        ObjectPool & operator = (const ObjectPool &) = delete;
+
+        Handle acquire() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++nAcquired_;
+                if (free_.empty() == false) {
+                    T * object = free_.back();
+                    free_.pop_back();
+                    return Handle(object, Release(this));
+                }
+                ++nMisses_;
+            }
+
+            T * object = new T();
+            if (init_) init_(*object);
+            return Handle(object, Release(this));
+        }
+
+        ObjectPoolStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            ObjectPoolStats res;
+            res.nObjects = objects_.size();
+            res.nFree = free_.size();
+            res.nAcquired = nAcquired_;
+            res.nMisses = nMisses_;
+            return res;
+        }
+
+    private:
+        void release(T * object) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (isPooled(object)) {
+                    free_.push_back(object);
+                    return;
+                }
+            }
+            delete object;
+        }
+
+        // the objects are few and the check runs only on release
+        bool isPooled(const T * object) const {
+            for (const auto & cur : objects_) if (cur.get() == object) return true;
+            return false;
+        }
+
+        Init init_;
+
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<T>> objects_;
+        std::vector<T *> free_;
+
+        uint64_t nAcquired_ = 0;
+        uint64_t nMisses_ = 0;
+};
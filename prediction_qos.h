@@ -0,0 +1,99 @@
+/*! \file prediction_qos.h
+ *  \brief Trades prediction accuracy for speed while the prediction queue is backed up
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+struct PredictionQuality {
+    int alignWindow;    // offsets searched around the detected position
+    int nCandidates;    // templates that get the offset search, 0 - all of them
+};
+
+struct PredictionQoSStats {
+    int level = 0;
+    int queueDepth = 0;
+    int nLevelChanges = 0;
+    std::vector<uint64_t> nJobs;    // jobs processed at each level
+};
+
+// Level 0 is the full quality. The level goes up one step when the queue depth reaches the degrade threshold
+// of the current level and goes back down only when the depth falls to the lower restore threshold, so that
+// the quality does not flip on every job.
+class PredictionQoS {
+    public:
+        static const std::vector<PredictionQuality> & levels() {
+            static const std::vector<PredictionQuality> kLevels = {
+                { 64, 0 },
+                { 32, 0 },
+                { 16, 5 },
+                {  8, 2 },
+            };
+            return kLevels;
+        }
+
+        // thresholds are fractions of the queue capacity
+        explicit PredictionQoS(int capacity) {
+            int n = levels().size();
+            degradeDepth_.resize(n);
+            restoreDepth_.resize(n);
+            for (int i = 0; i < n; ++i) {
+                degradeDepth_[i] = std::max(i + 2, (capacity*(i + 1))/8);
+                restoreDepth_[i] = i == 0 ? -1 : std::max(0, degradeDepth_[i - 1]/4);
+            }
+            degradeDepth_[n - 1] = capacity + 1;
+
+            nJobs_.assign(n, 0);
+        }
+
+        // call once per job with the current number of queued jobs, returns the quality to use for the job
+        PredictionQuality update(int queueDepth) {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            int level = level_;
+            if (queueDepth >= degradeDepth_[level]) {
+                ++level;
+            } else if (queueDepth <= restoreDepth_[level]) {
+                --level;
+            }
+
+            if (level != level_) {
+                level_ = level;
+                ++nLevelChanges_;
+            }
+            queueDepth_ = queueDepth;
+            ++nJobs_[level];
+
+            return levels()[level];
+        }
+
+        int level() const { return level_; }
+
+        PredictionQoSStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            PredictionQoSStats res;
+            res.level = level_;
+            res.queueDepth = queueDepth_;
+            res.nLevelChanges = nLevelChanges_;
+            res.nJobs = nJobs_;
+            return res;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+
+        std::atomic<int> level_ { 0 };
+        int queueDepth_ = 0;
+        int nLevelChanges_ = 0;
+        std::vector<uint64_t> nJobs_;
+
+        std::vector<int> degradeDepth_;
+        std::vector<int> restoreDepth_;
+};
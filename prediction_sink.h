@@ -0,0 +1,280 @@
+/*! \file prediction_sink.h
+ *  \brief Machine-readable stream of the predictions, written from a dedicated thread
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Formats:
+//
+//   JSON lines - one object per prediction:
+//     {"sample":24009,"time_us":123456789,"offset":11,"top":[{"key":"b","cc":0.98678},{"key":"h","cc":0.61}]}
+//
+//   binary (native byte order):
+//     char[8] "KBDPRED1", int32 topK
+//     records: int64 sample, int64 time_us, int32 offset, int32 nTop, { int32 key, float cc } x topK
+//
+// "top" starts with the predicted key and its CC, followed by the other keys by decreasing confidence. The
+// prediction goes first even if its confidence is not the highest, e.g. with --pca, where the confidence of the
+// other keys is their CC in the reduced space.
+
+struct PredictionRecord {
+    static constexpr int kMaxTop = 8;
+
+    int64_t sampleIndex = 0;
+    int64_t time_us = 0;
+    int32_t offset = 0;
+    int32_t nTop = 0;
+    int32_t keys[kMaxTop];
+    float cc[kMaxTop];
+};
+
+struct PredictionSinkStats {
+    uint64_t nWritten = 0;
+    uint64_t nDropped = 0;  // the writer thread could not keep up and the queue was full
+};
+
+// The producer never allocates - push() copies the record into a preallocated single-producer single-consumer
+// ring and returns. When the ring is full, the record is dropped, so that a live capture never blocks on a slow
+// output, or push() waits for the writer if asked to, so that an offline run writes every record. Concurrent
+// producers must be serialized by the caller, e.g. the deliver callback of WorkQueue. The writer thread drains
+// the ring, formats the records and flushes whenever it is empty.
+class PredictionSink {
+    public:
+        enum Format {
+            JSON,
+            Binary,
+        };
+
+        PredictionSink() {}
+        ~PredictionSink() { close(); }
+
+        PredictionSink(const PredictionSink &) = delete;
+        PredictionSink & operator = (const PredictionSink &) = delete;
+
+        static bool parseFormat(const std::string & name, Format & format) {
+            if (name.empty() || name == "json") {
+                format = JSON;
+            } else if (name == "bin") {
+                format = Binary;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        // The records of "-" go to stdout, and nothing else may: the original stdout is kept for the sink and
+        // stdout is pointed to stderr, so that the usage, the status lines and the console predictions go there.
+        // open("-") does this, but the program should call it before it prints anything.
+        static bool detachStdout() {
+            if (detachedStdout()) return true;
+#ifdef _WIN32
+            int fd = _dup(_fileno(stdout));
+            if (fd < 0) return false;
+            _setmode(fd, _O_BINARY);
+            _dup2(_fileno(stderr), _fileno(stdout));
+            detachedStdout() = _fdopen(fd, "wb");
+#else
+            int fd = dup(STDOUT_FILENO);
+            if (fd < 0) return false;
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            detachedStdout() = fdopen(fd, "wb");
+#endif
+            return detachedStdout() != nullptr;
+        }
+
+        // fname "-" writes to the original stdout, see detachStdout()
+        bool open(const std::string & fname, Format format, int topK, int capacity = 4096) {
+            close();
+
+            if (fname == "-") {
+                fout_ = detachStdout() ? detachedStdout() : nullptr;
+                detachedStdout() = nullptr;
+            } else {
+                fout_ = fopen(fname.c_str(), "wb");
+            }
+            if (fout_ == nullptr) {
+                fprintf(stderr, "Failed to open '%s' for writing\n", fname.c_str());
+                return false;
+            }
+
+            format_ = format;
+            topK_ = std::max(1, std::min(topK, (int) PredictionRecord::kMaxTop));
+            ring_.assign(capacity + 1, PredictionRecord());
+            head_ = 0;
+            tail_ = 0;
+            nWritten_ = 0;
+            nDropped_ = 0;
+
+            if (format_ == Binary) {
+                int32_t topK32 = topK_;
+                fwrite("KBDPRED1", 1, 8, fout_);
+                fwrite(&topK32, sizeof(topK32), 1, fout_);
+            }
+
+            isRunning_ = true;
+            writer_ = std::thread([this]() { write(); });
+
+            return true;
+        }
+
+        // writes the queued records and closes the file
+        void close() {
+            if (writer_.joinable()) {
+                isRunning_ = false;
+                writer_.join();
+            }
+            if (fout_) fclose(fout_);
+            fout_ = nullptr;
+        }
+
+        bool isOpen() const { return fout_ != nullptr; }
+        int topK() const { return topK_; }
+
+        // when the ring is full, either waits for the writer or drops the record
+        // returns false if the record was dropped
+        bool push(int64_t sampleIndex, int64_t time_us, const TKeyPrediction & prediction, bool wait = false) {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            const size_t next = head + 1 == ring_.size() ? 0 : head + 1;
+            while (next == tail_.load(std::memory_order_acquire)) {
+                if (wait == false) {
+                    ++nDropped_;
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            auto & record = ring_[head];
+            record.sampleIndex = sampleIndex;
+            record.time_us = time_us;
+            record.offset = prediction.offset;
+            record.nTop = 0;
+
+            // the prediction first, then a partial insertion sort of the rest of the confidence map
+            int nFixed = 0;
+            if (prediction.key != -1) {
+                record.keys[0] = prediction.key;
+                record.cc[0] = prediction.cc;
+                record.nTop = nFixed = 1;
+            }
+            for (const auto & kc : prediction.confidence) {
+                if (kc.first == prediction.key) continue;
+                int i = record.nTop;
+                if (i == topK_ && (i == nFixed || kc.second <= record.cc[i - 1])) continue;
+                if (i == topK_) --i;
+                for (; i > nFixed && record.cc[i - 1] < kc.second; --i) {
+                    record.keys[i] = record.keys[i - 1];
+                    record.cc[i] = record.cc[i - 1];
+                }
+                record.keys[i] = kc.first;
+                record.cc[i] = kc.second;
+                record.nTop = std::min(record.nTop + 1, topK_);
+            }
+
+            head_.store(next, std::memory_order_release);
+            return true;
+        }
+
+        PredictionSinkStats stats() const {
+            PredictionSinkStats res;
+            res.nWritten = nWritten_;
+            res.nDropped = nDropped_;
+            return res;
+        }
+
+    private:
+        void write() {
+            std::string line;
+            while (true) {
+                const bool isRunning = isRunning_;
+
+                size_t tail = tail_.load(std::memory_order_relaxed);
+                if (tail == head_.load(std::memory_order_acquire)) {
+                    if (isRunning == false) break;
+                    fflush(fout_);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    continue;
+                }
+
+                const auto & record = ring_[tail];
+                if (format_ == Binary) {
+                    PredictionRecord cur = record;
+                    for (int i = cur.nTop; i < topK_; ++i) {
+                        cur.keys[i] = -1;
+                        cur.cc[i] = 0.0f;
+                    }
+                    fwrite(&cur.sampleIndex, sizeof(cur.sampleIndex), 1, fout_);
+                    fwrite(&cur.time_us, sizeof(cur.time_us), 1, fout_);
+                    fwrite(&cur.offset, sizeof(cur.offset), 1, fout_);
+                    fwrite(&cur.nTop, sizeof(cur.nTop), 1, fout_);
+                    for (int i = 0; i < topK_; ++i) {
+                        fwrite(&cur.keys[i], sizeof(cur.keys[i]), 1, fout_);
+                        fwrite(&cur.cc[i], sizeof(cur.cc[i]), 1, fout_);
+                    }
+                } else {
+                    line.clear();
+                    appendf(line, "{\"sample\":%lld,\"time_us\":%lld,\"offset\":%d,\"top\":[",
+                            (long long) record.sampleIndex, (long long) record.time_us, record.offset);
+                    for (int i = 0; i < record.nTop; ++i) {
+                        appendf(line, "%s{\"key\":\"", i == 0 ? "" : ",");
+                        appendJSON(line, record.keys[i]);
+                        appendf(line, "\",\"cc\":%.5f}", record.cc[i]);
+                    }
+                    line += "]}\n";
+                    fwrite(line.data(), 1, line.size(), fout_);
+                }
+
+                tail_.store(tail + 1 == ring_.size() ? 0 : tail + 1, std::memory_order_release);
+                ++nWritten_;
+            }
+            fflush(fout_);
+        }
+
+        static FILE *& detachedStdout() {
+            static FILE * res = nullptr;
+            return res;
+        }
+
+        static void appendJSON(std::string & dst, TKey key) {
+            auto it = kKeyText.find(key);
+            const char * text = it == kKeyText.end() ? "?" : it->second;
+            for (const char * c = text; *c; ++c) {
+                if (*c == '"' || *c == '\\') dst += '\\';
+                dst += *c;
+            }
+        }
+
+        FILE * fout_ = nullptr;
+        Format format_ = JSON;
+        int topK_ = 1;
+
+        std::vector<PredictionRecord> ring_;
+        std::atomic<size_t> head_ { 0 };    // next slot to fill, owned by the producer
+        std::atomic<size_t> tail_ { 0 };    // next slot to write, owned by the writer
+
+        std::atomic<bool> isRunning_ { false };
+        std::atomic<uint64_t> nWritten_ { 0 };
+        std::atomic<uint64_t> nDropped_ { 0 };
+
+        std::thread writer_;
+};
@@ -0,0 +1,91 @@
+/*! \file rescore_store.cpp
+ *  \brief Re-scores the key presses of a feature store against a model, without the original audio
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "key_model.h"
+#include "feature_store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s store.kbdf --load-model F [--align N] [-pF]\n", argv[0]);
+    printf("    --load-model F - templates to match the stored windows against\n");
+    printf("    --align N      - offsets searched around the stored alignment (default 16, at most %d)\n",
+           (int) (kFeatureStoreWindow/2 - kSamplesPerFrame));
+    printf("    -pF            - only the stored presses with CC > F are re-scored (default 0.5)\n");
+    printf("\n");
+
+    auto argm = parseCmdArguments(argc, argv);
+    auto inputFiles = parseCmdPositional(argc, argv);
+    if (inputFiles.size() != 1 || argm["load-model"].empty()) {
+        return -127;
+    }
+
+    // the offset search must stay inside the stored window
+    const int alignWindowMax = kFeatureStoreWindow/2 - kSamplesPerFrame;
+    const int alignWindow = argm["align"].empty() ? 16 : std::max(1, std::min(alignWindowMax, std::stoi(argm["align"])));
+    const float thresholdCC = argm["p"].empty() ? 0.5f : std::stof(argm["p"]);
+
+    KeyModel model;
+    if (loadKeyModel(argm["load-model"], model) == false) {
+        return -1;
+    }
+
+    FeatureStoreReader store;
+    if (store.open(inputFiles[0]) == false) {
+        return -2;
+    }
+    printf("[+] Feature store '%s': %d key presses\n", inputFiles[0].c_str(), (int) store.size());
+
+    struct Counts {
+        int nStored = 0;
+        int nSame = 0;
+    };
+    std::map<TKey, Counts> counts;
+    int nScored = 0;
+    int nSame = 0;
+    double sumDeltaCC = 0.0;
+
+    auto tStart = std::chrono::high_resolution_clock::now();
+
+    // the windows are already aligned, so a small search around the center is enough
+    FeatureStoreEntry entry;
+    TKeyWaveform waveform;
+    while (store.next(entry)) {
+        if (entry.cc <= thresholdCC) continue;
+
+        entry.waveform(waveform);
+        TKeyPrediction prediction;
+        predictKeyPress(model.templates, waveform, kFeatureStoreWindow/2, alignWindow, 1, prediction);
+
+        auto & cur = counts[entry.key];
+        ++cur.nStored;
+        ++nScored;
+        if (prediction.key == entry.key) {
+            ++cur.nSame;
+            ++nSame;
+        }
+        sumDeltaCC += prediction.cc - entry.cc;
+    }
+
+    auto tEnd = std::chrono::high_resolution_clock::now();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+
+    printf("[+] Stored key -> same key with model '%s':\n", argm["load-model"].c_str());
+    for (const auto & kc : counts) {
+        printf("    '%c' : %4d / %4d\n", kc.first, kc.second.nSame, kc.second.nStored);
+    }
+    printf("[+] %d / %d presses (%.1f%%) keep their key, average CC change %+.5f\n",
+           nSame, nScored, nScored > 0 ? (100.0*nSame)/nScored : 0.0, nScored > 0 ? sumDeltaCC/nScored : 0.0);
+    printf("[+] Re-scored in %g ms, %.1f presses/s\n", elapsed_ms, elapsed_ms > 0.0 ? 1000.0*nScored/elapsed_ms : 0.0);
+
+    return 0;
+}
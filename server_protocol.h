@@ -0,0 +1,117 @@
+/*! \file server_protocol.h
+ *  \brief Framing of the messages between keytap-server and its clients over a Unix-domain socket
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Every message is a frame (native byte order - both ends are on the same machine):
+//
+//   uint32 type
+//   uint32 payload size in bytes
+//   payload
+//
+// client -> server:
+//   Hello  - int32 sample rate, int32 model index - must be the first message
+//   Audio  - float32 samples, mono, any number per frame
+//   End    - no more audio, the server replies with Done after the last prediction
+//
+// server -> client:
+//   Prediction - ServerPrediction
+//   Error      - text, the server closes the connection after it
+//   Done       - no payload
+
+enum class ServerMessage : uint32_t {
+    Hello       = 1,
+    Audio       = 2,
+    End         = 3,
+
+    Prediction  = 16,
+    Error       = 17,
+    Done        = 18,
+};
+
+struct ServerFrameHeader {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct ServerHello {
+    int32_t sampleRate;
+    int32_t model;
+};
+
+struct ServerPrediction {
+    int64_t sampleIndex;    // position of the key press in the stream of the client
+    int32_t key;
+    float cc;
+    int32_t offset;
+    int32_t reserved;
+};
+
+// larger frames are treated as a protocol error
+static const uint32_t kServerMaxFrameSize = 1 << 20;
+
+static const char * kServerDefaultSocket = "/tmp/keytap.sock";
+
+static bool serverWriteAll(int fd, const void * data, size_t n) {
+    const char * cur = (const char *) data;
+    while (n > 0) {
+#ifdef MSG_NOSIGNAL
+        ssize_t res = send(fd, cur, n, MSG_NOSIGNAL);
+#else
+        ssize_t res = send(fd, cur, n, 0);
+#endif
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        cur += res;
+        n -= res;
+    }
+    return true;
+}
+
+static bool serverReadAll(int fd, void * data, size_t n) {
+    char * cur = (char *) data;
+    while (n > 0) {
+        ssize_t res = recv(fd, cur, n, 0);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        cur += res;
+        n -= res;
+    }
+    return true;
+}
+
+static bool serverWriteFrame(int fd, ServerMessage type, const void * payload, uint32_t size) {
+    ServerFrameHeader header = { (uint32_t) type, size };
+    return serverWriteAll(fd, &header, sizeof(header)) && (size == 0 || serverWriteAll(fd, payload, size));
+}
+
+// payload is resized to the size of the frame
+static bool serverReadFrame(int fd, ServerMessage & type, std::vector<uint8_t> & payload) {
+    ServerFrameHeader header;
+    if (serverReadAll(fd, &header, sizeof(header)) == false) return false;
+    if (header.size > kServerMaxFrameSize) return false;
+
+    type = (ServerMessage) header.type;
+    payload.resize(header.size);
+    return header.size == 0 || serverReadAll(fd, payload.data(), header.size);
+}
+
+static bool serverSocketAddress(const std::string & path, sockaddr_un & addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
@@ -0,0 +1,192 @@
+/*! \file thread_policy.h
+ *  \brief CPU affinity, real-time priority and nice level of the pipeline threads
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Policy specification - comma-separated items, e.g. "cpu:2,cpu:4-5,fifo:80" or "nice:10":
+//
+//   cpu:N or cpu:N-M - allow the thread on these CPUs only (Linux), can be repeated
+//   fifo:P           - SCHED_FIFO with priority P (1-99), needs CAP_SYS_NICE or an rtprio limit
+//   nice:N           - nice level of the thread (Linux), negative values need CAP_SYS_NICE
+//
+// A policy is applied by the thread itself. Whatever the system does not permit is logged and skipped, and the
+// thread keeps running with its previous settings.
+struct ThreadPolicy {
+    std::vector<int> cpus;
+    int fifoPriority = 0;   // 0 - default scheduling
+    bool hasNice = false;
+    int nice = 0;
+
+    bool empty() const { return cpus.empty() && fifoPriority == 0 && hasNice == false; }
+
+    static bool parse(const std::string & spec, ThreadPolicy & res) {
+        res = ThreadPolicy();
+
+        for (size_t begin = 0, end = 0; end != std::string::npos; begin = end + 1) {
+            end = spec.find(',', begin);
+            std::string item = spec.substr(begin, end == std::string::npos ? end : end - begin);
+            if (item.empty()) continue;
+
+            auto colon = item.find(':');
+            if (colon == std::string::npos) return false;
+            std::string name = item.substr(0, colon);
+            std::string value = item.substr(colon + 1);
+
+            char * rest = nullptr;
+            long x = strtol(value.c_str(), &rest, 10);
+            if (rest == value.c_str()) return false;
+
+            if (name == "cpu") {
+                long x1 = x;
+                if (*rest == '-') {
+                    const char * s1 = rest + 1;
+                    x1 = strtol(s1, &rest, 10);
+                    if (rest == s1) return false;
+                }
+                if (*rest != 0 || x < 0 || x1 < x || x1 >= 1024) return false;
+                for (long i = x; i <= x1; ++i) res.cpus.push_back(i);
+            } else if (name == "fifo") {
+                if (*rest != 0 || x < 1 || x > 99) return false;
+                res.fifoPriority = x;
+            } else if (name == "nice") {
+                if (*rest != 0 || x < -20 || x > 19) return false;
+                res.hasNice = true;
+                res.nice = x;
+            } else {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+// the policies of the thread roles of the tools, set with --thread-<role> S
+struct ThreadConfig {
+    ThreadPolicy capture;   // audio capture callback
+    ThreadPolicy workers;   // prediction workers
+    ThreadPolicy gui;       // GUI rendering
+    ThreadPolicy compute;   // keytap2 analysis
+
+    ThreadPolicy * get(const std::string & role) {
+        if (role == "capture") return &capture;
+        if (role == "workers") return &workers;
+        if (role == "gui") return &gui;
+        if (role == "compute") return &compute;
+        return nullptr;
+    }
+
+    // parses the --thread-<role> arguments of the given roles
+    bool parse(const std::map<std::string, std::string> & argm, const std::vector<std::string> & roles) {
+        for (const auto & role : roles) {
+            auto it = argm.find("thread-" + role);
+            if (it == argm.end() || it->second.empty()) continue;
+
+            auto policy = get(role);
+            if (policy == nullptr || ThreadPolicy::parse(it->second, *policy) == false) {
+                printf("Invalid thread policy for --thread-%s: '%s'\n", role.c_str(), it->second.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// applies the policy to the calling thread and logs the result, returns false if any part was not applied
+static bool applyThreadPolicy(const char * name, const ThreadPolicy & policy) {
+    if (policy.empty()) return true;
+
+    bool res = true;
+    std::string applied;
+
+    auto append = [&](const std::string & s) {
+        if (applied.empty() == false) applied += ", ";
+        applied += s;
+    };
+
+    if (policy.cpus.empty() == false) {
+        std::string cpus;
+        for (auto cpu : policy.cpus) cpus += (cpus.empty() ? "" : " ") + std::to_string(cpu);
+
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : policy.cpus) if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err == 0) {
+            append("CPUs " + cpus);
+        } else {
+            printf("[!] Thread '%s': cannot pin to CPUs %s (%s) - running on any CPU\n", name, cpus.c_str(), strerror(err));
+            res = false;
+        }
+#else
+        printf("[!] Thread '%s': CPU pinning is not supported on this platform - running on any CPU\n", name);
+        res = false;
+#endif
+    }
+
+    if (policy.fifoPriority > 0) {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = policy.fifoPriority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err == 0) {
+            append("SCHED_FIFO priority " + std::to_string(policy.fifoPriority));
+        } else {
+            printf("[!] Thread '%s': SCHED_FIFO priority %d not permitted (%s) - keeping the default scheduling\n",
+                   name, policy.fifoPriority, strerror(err));
+            if (err == EPERM) {
+                printf("    It needs CAP_SYS_NICE or an rtprio limit, e.g. '@audio - rtprio 95' in /etc/security/limits.conf\n");
+            }
+            res = false;
+        }
+#else
+        printf("[!] Thread '%s': SCHED_FIFO is not supported on this platform - keeping the default scheduling\n", name);
+        res = false;
+#endif
+    }
+
+    if (policy.hasNice) {
+#ifdef __linux__
+        // on Linux the nice level is per thread when it is set for the thread id
+        if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), policy.nice) == 0) {
+            append("nice " + std::to_string(policy.nice));
+        } else {
+            printf("[!] Thread '%s': nice %d not permitted (%s) - keeping nice %d\n",
+                   name, policy.nice, strerror(errno), getpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid)));
+            res = false;
+        }
+#else
+        printf("[!] Thread '%s': per-thread nice levels are not supported on this platform\n", name);
+        res = false;
+#endif
+    }
+
+    if (applied.empty() == false) {
+        printf("[+] Thread '%s': %s\n", name, applied.c_str());
+    }
+
+    return res;
+}
@@ -0,0 +1,127 @@
+/*! \file training_data.h
+ *  \brief Bulk loading of the .kbd training files recorded with the record tool
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+#include "audio_filter.h"
+#include "mapped_recording.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// File layout (native byte order):
+//
+//   int32 - frames per record, must be kTrainBufferSize_frames
+//   records:
+//     int32 - key
+//     float x kTrainBufferSize_frames*kSamplesPerFrame - audio around the key press
+
+struct TrainingDataStats {
+    int nFiles = 0;
+    int nRecords = 0;
+    int nKeys = 0;
+    size_t nBytes = 0;
+};
+
+// Loads the records of all files into per-key histories, in the order in which they appear in the files.
+// The files are memory-mapped and validated first, then every record gets its slot in the histories and the
+// records are parsed by nThreads threads without locking. Each record is filtered from a clean filter state.
+static bool loadTrainingData(
+        const std::vector<std::string> & fnames,
+        const AudioFilter & filter,
+        std::map<TKey, TKeyHistory> & histories,
+        TrainingDataStats & stats,
+        int nThreads = getNumThreads()) {
+    const size_t kHeaderSize = sizeof(int32_t);
+    const size_t kRecordSize = sizeof(int32_t) + kSamplesPerWaveform*sizeof(AudioLogger::Sample);
+
+    struct Record {
+        const uint8_t * data;
+        TKeyWaveform * waveform;
+    };
+
+    stats = TrainingDataStats();
+
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::vector<std::pair<const uint8_t *, TKey>> records;
+    for (const auto & fname : fnames) {
+        files.emplace_back(new MappedFile());
+        auto & file = *files.back();
+        if (file.open(fname) == false) {
+            printf("Failed to open input file: '%s'\n", fname.c_str());
+            return false;
+        }
+
+        int32_t bufferSize_frames = 0;
+        if (file.size() < kHeaderSize) {
+            printf("Input file '%s' is too small\n", fname.c_str());
+            return false;
+        }
+        memcpy(&bufferSize_frames, file.data(), sizeof(bufferSize_frames));
+        if (bufferSize_frames != kTrainBufferSize_frames) {
+            printf("Buffer size in file '%s' (%d) does not match the expected one (%d)\n", fname.c_str(), bufferSize_frames, (int) kTrainBufferSize_frames);
+            return false;
+        }
+
+        size_t nRecords = (file.size() - kHeaderSize)/kRecordSize;
+        size_t nExtra = (file.size() - kHeaderSize)%kRecordSize;
+        if (nExtra != 0) {
+            printf("Input file '%s' ends with a partial record (%d bytes) - ignoring it\n", fname.c_str(), (int) nExtra);
+        }
+
+        for (size_t i = 0; i < nRecords; ++i) {
+            const uint8_t * data = file.data() + kHeaderSize + i*kRecordSize;
+
+            int32_t key = 0;
+            memcpy(&key, data, sizeof(key));
+            if (kKeyText.find(key) == kKeyText.end()) {
+                printf("Invalid key %d in record %d of file '%s'\n", key, (int) i, fname.c_str());
+                return false;
+            }
+            records.emplace_back(data + sizeof(int32_t), key);
+        }
+
+        ++stats.nFiles;
+        stats.nBytes += file.size();
+    }
+
+    // assign the slots serially, so that the order of the presses does not depend on the number of threads
+    std::map<TKey, int> nPresses;
+    for (const auto & record : records) ++nPresses[record.second];
+    for (const auto & kn : nPresses) {
+        auto & history = histories[kn.first];
+        history.reserve(history.size() + kn.second);
+    }
+
+    std::vector<Record> jobs(records.size());
+    for (int i = 0; i < (int) records.size(); ++i) {
+        auto & history = histories[records[i].second];
+        history.emplace_back();
+        jobs[i] = { records[i].first, &history.back() };
+    }
+
+    parallelFor(jobs.size(), nThreads, [&](int i) {
+        auto & waveform = *jobs[i].waveform;
+        waveform.resize(kSamplesPerWaveform);
+        memcpy(waveform.data(), jobs[i].data, kSamplesPerWaveform*sizeof(AudioLogger::Sample));
+
+        if (filter.empty() == false) {
+            AudioFilter cur = filter;
+            cur.reset();
+            cur.process(waveform.data(), waveform.size());
+        }
+    });
+
+    stats.nRecords = records.size();
+    stats.nKeys = nPresses.size();
+
+    return true;
+}
@@ -9,6 +9,7 @@
 #endif
 
 #include "constants.h"
+#include "mapped_recording.h"
 
 #include "imgui.h"
 #include "imgui_impl_sdl.h"
@@ -97,47 +98,23 @@ TWaveformView getView(const TWaveform & waveform, int64_t idx) { return { wavefo
 TWaveformView getView(const TWaveform & waveform, int64_t idx, int64_t len) { return { waveform.data() + idx, len }; }
 
 bool readFromFile(const std::string & fname, TWaveform & res) {
-    std::ifstream fin(fname, std::ios::binary | std::ios::ate);
-    if (fin.good() == false) {
+    static_assert(
+        std::is_same<TSample, int16_t>::value
+        || std::is_same<TSample, int32_t>::value
+                  , "TSample not recognised");
+
+    MappedRecording recording;
+    if (recording.open(fname) == false) {
         return false;
     }
-
-    {
-        std::streamsize size = fin.tellg();
-        fin.seekg(0, std::ios::beg);
-
-        static_assert(std::is_same<TSampleInput, float>::value, "TSampleInput not recognised");
-        static_assert(
-            std::is_same<TSample, float>::value
-            || std::is_same<TSample, int16_t>::value
-            || std::is_same<TSample, int32_t>::value
-                      , "TSampleInput not recognised");
-
-        if (std::is_same<TSample, int16_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-            //double asum = 0.0f;
-            //for (auto i = 0; i < buf.size(); ++i) asum += std::abs(buf[i]); asum /= buf.size(); asum *= 10.0;
-            //for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(2000.0*(buf[i]/asum));
-        } else if (std::is_same<TSample, int32_t>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = 0.0f;
-            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-            for (auto i = 0; i < buf.size(); ++i) res[i] = std::round(32000.0*(buf[i]/amax));
-        } else if (std::is_same<TSample, float>::value) {
-            res.resize(size/sizeof(TSample));
-            fin.read((char *)(res.data()), size);
-        } else {
-        }
+    if (recording.sampleRate() != 0 && recording.sampleRate() != kSampleRate) {
+        printf("Recording sample rate %d does not match the expected one (%d)\n", recording.sampleRate(), (int) kSampleRate);
+        return false;
     }
 
-    fin.close();
+    // the samples are converted straight from the mapped file, without an intermediate float copy
+    res.resize(recording.size());
+    recording.normalize(0, res.size(), recording.amax(), 32000.0, res.data());
 
     return true;
 }
@@ -4,6 +4,7 @@
  */
 
 #include "constants.h"
+#include "mapped_recording.h"
 
 #include "imgui.h"
 #include "imgui_impl_sdl.h"
@@ -68,13 +69,17 @@ TWaveformView getView(const TWaveform & waveform, int64_t idx, int64_t len) { re
 bool readFromFile(const TParameters & params, const std::string & fname, TWaveform & res, TTrainKeys & trainKeys) {
     trainKeys.clear();
 
-    std::ifstream fin(fname, std::ios::binary);
-    if (fin.good() == false) {
+    MappedFile fin;
+    if (fin.open(fname) == false) {
         return false;
     }
 
     int32_t bufferSize_frames = 1;
-    fin.read((char *)(&bufferSize_frames), sizeof(bufferSize_frames));
+    if (fin.size() < sizeof(bufferSize_frames)) {
+        printf("File '%s' is too small\n", fname.c_str());
+        return false;
+    }
+    memcpy(&bufferSize_frames, fin.data(), sizeof(bufferSize_frames));
     if (bufferSize_frames != kTrainBufferSize_frames) {
         printf("Buffer size in file (%d) does not match the expected one (%d)\n", bufferSize_frames, (int) kTrainBufferSize_frames);
         return false;
@@ -83,46 +88,31 @@ bool readFromFile(const TParameters & params, const std::string & fname, TWavefo
     {
         static_assert(std::is_same<TSampleInput, float>::value, "TSampleInput not recognised");
         static_assert(
-            std::is_same<TSample, float>::value
-            || std::is_same<TSample, int16_t>::value
+            std::is_same<TSample, int16_t>::value
             || std::is_same<TSample, int32_t>::value
-                      , "TSampleInput not recognised");
-
-        int32_t offset = 0;
-        std::streamsize size = bufferSize_frames*kSamplesPerFrame*sizeof(TSampleInput);
-        while (true) {
-            TKey keyPressed = 0;
-            fin.read((char *)(&keyPressed), sizeof(keyPressed));
-            if (fin.eof()) break;
-            trainKeys.push_back(keyPressed);
-
-            if (std::is_same<TSample, int16_t>::value) {
-                std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-                res.resize(offset + size/sizeof(TSampleInput));
-                fin.read((char *)(buf.data()), size);
-                double amax = 0.0f;
-                for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-                for (auto i = 0; i < buf.size(); ++i) res[offset + i] = std::round(32000.0*(buf[i]/amax));
-            } else if (std::is_same<TSample, int32_t>::value) {
-                std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-                res.resize(offset + size/sizeof(TSampleInput));
-                fin.read((char *)(buf.data()), size);
-                double amax = 0.0f;
-                for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
-                for (auto i = 0; i < buf.size(); ++i) res[offset + i] = std::round(32000.0*(buf[i]/amax));
-            } else if (std::is_same<TSample, float>::value) {
-                res.resize(offset + size/sizeof(TSample));
-                fin.read((char *)(res.data() + offset), size);
-            } else {
-            }
-
-            offset += size/sizeof(TSampleInput);
-            if (fin.eof()) break;
+                      , "TSample not recognised");
+
+        // every record is normalized on its own, straight from the mapped file
+        const size_t nRecordSamples = bufferSize_frames*kSamplesPerFrame;
+        const size_t recordSize = sizeof(TKey) + nRecordSamples*sizeof(TSampleInput);
+        const size_t nRecords = (fin.size() - sizeof(bufferSize_frames))/recordSize;
+
+        res.resize(nRecords*nRecordSamples);
+        trainKeys.resize(nRecords);
+
+        std::vector<TSampleInput> buf(nRecordSamples);
+        for (size_t r = 0; r < nRecords; ++r) {
+            const uint8_t * record = fin.data() + sizeof(bufferSize_frames) + r*recordSize;
+            memcpy(&trainKeys[r], record, sizeof(TKey));
+            memcpy(buf.data(), record + sizeof(TKey), nRecordSamples*sizeof(TSampleInput));
+
+            auto dst = res.data() + r*nRecordSamples;
+            double amax = 0.0f;
+            for (auto i = 0; i < buf.size(); ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
+            for (auto i = 0; i < buf.size(); ++i) dst[i] = std::round(32000.0*(buf[i]/amax));
         }
     }
 
-    fin.close();
-
     return true;
 }
 
@@ -0,0 +1,267 @@
+/*! \file work_queue.h
+ *  \brief Bounded job queue served by a pool of worker threads, with results delivered in submission order
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkQueueStats {
+    uint64_t nPushed = 0;
+    uint64_t nProcessed = 0;
+    uint64_t nDropped = 0;      // jobs that were discarded because the queue was full
+    int nUndelivered = 0;       // pushed jobs whose results were not delivered yet
+    int nQueued = 0;
+    int nWorkers = 0;
+};
+
+// Multiple producers push jobs, nWorkers threads process them and the results are handed to the deliver
+// callback strictly in the order in which the jobs were pushed. The deliver callback runs on one of the
+// workers, but never on two of them at the same time. The workers sleep on a condition variable when idle.
+//
+// Every job is processed in a result slot of a ring that is allocated by start(), so the queue does not allocate
+// per job. A slow job holds back the delivery of the jobs pushed after it, and at most slots(nWorkers, capacity)
+// jobs can be pushed and not yet delivered - past that, push() waits or drops the new job. The slots are reused:
+// the result is left as the previous job of the slot left it, and process must overwrite it.
+template <typename Job, typename Result>
+class WorkQueue {
+    public:
+        using Process = std::function<void(Job & job, Result & result)>;
+        using Deliver = std::function<void(Job & job, Result & result)>;
+        using Init = std::function<void(int iWorker)>;
+
+        WorkQueue() {}
+        ~WorkQueue() { stop(); }
+
+        WorkQueue(const WorkQueue &) = delete;
+        WorkQueue & operator = (const WorkQueue &) = delete;
+
+        // the number of result slots, i.e. the most jobs that are pushed and not delivered at any time
+        // room for the queued jobs, one per worker in progress, and as many finished ones waiting behind a slow job
+        static int slots(int nWorkers, int capacity) { return 2*capacity + nWorkers; }
+
+        // init, if given, runs first on every worker thread, e.g. to set its scheduling policy
+        bool start(int nWorkers, int capacity, Process && process, Deliver && deliver, Init && init = nullptr) {
+            if (workers_.empty() == false || nWorkers < 1 || capacity < 1) return false;
+
+            capacity_ = capacity;
+            jobs_.resize(slots(nWorkers, capacity));
+            jobsHead_ = 0;
+            nJobs_ = 0;
+            nUndelivered_ = 0;
+            done_.clear();
+            done_.resize(jobs_.size());
+            nextDelivered_ = nextId_;
+            process_ = std::move(process);
+            deliver_ = std::move(deliver);
+            isRunning_ = true;
+
+            init_ = std::move(init);
+            for (int i = 0; i < nWorkers; ++i) {
+                workers_.emplace_back([this, i]() {
+                    if (init_) init_(i);
+                    work();
+                });
+            }
+
+            return true;
+        }
+
+        // finishes the job that is being processed and discards the rest
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                isRunning_ = false;
+            }
+            cvJobs_.notify_all();
+            cvSpace_.notify_all();
+            for (auto & worker : workers_) worker.join();
+            workers_.clear();
+        }
+
+        // when the queue is full, either waits for space or drops the oldest queued job
+        // a dropped job stays in the queue without its data, so that the results after it are still delivered in order
+        // when all result slots are taken, the new job is dropped instead, as the queued ones would not free a slot
+        // returns false if a job was dropped
+        bool push(Job && job, bool dropOldestIfFull) {
+            bool res = true;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (dropOldestIfFull) {
+                    if (nUndelivered_ >= (int) done_.size()) {
+                        job = Job();
+                        ++nPushed_;
+                        ++nDropped_;
+                        return false;
+                    }
+                    for (size_t i = 0; nQueued_ >= capacity_ && i < nJobs_; ++i) {
+                        auto & entry = jobAt(i);
+                        if (entry.dropped) continue;
+                        entry.dropped = true;
+                        entry.job = Job();
+                        --nQueued_;
+                        ++nDropped_;
+                        res = false;
+                    }
+                } else {
+                    cvSpace_.wait(lock, [this]() {
+                        return (nQueued_ < capacity_ && nUndelivered_ < (int) done_.size()) || isRunning_ == false;
+                    });
+                    if (isRunning_ == false) {
+                        job = Job();
+                        return false;
+                    }
+                }
+                pushJob({ nextId_++, false, std::move(job) });
+                ++nQueued_;
+                ++nUndelivered_;
+                ++nPushed_;
+            }
+            cvJobs_.notify_one();
+
+            return res;
+        }
+
+        int capacity() const { return capacity_; }
+
+        int size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return nQueued_;
+        }
+
+        // true if there are no queued jobs and all results have been delivered
+        bool idle() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return nJobs_ == 0 && nInProgress_ == 0;
+        }
+
+        WorkQueueStats stats() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            WorkQueueStats res;
+            res.nPushed = nPushed_;
+            res.nProcessed = nProcessed_;
+            res.nDropped = nDropped_;
+            res.nQueued = nQueued_;
+            res.nUndelivered = nUndelivered_;
+            res.nWorkers = workers_.size();
+            return res;
+        }
+
+    private:
+        struct Entry {
+            uint64_t id;
+            bool dropped;
+            Job job;
+        };
+
+        // the slot of job id is done_[id % done_.size()], it is free again once the job is delivered
+        struct Done {
+            bool ready = false;     // processed and waiting for the jobs before it to be delivered
+            bool dropped = false;
+            Job job;
+            Result result;
+        };
+
+        void work() {
+            while (true) {
+                uint64_t id = 0;
+                bool dropped = false;
+                Done * cur = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cvJobs_.wait(lock, [this]() { return nJobs_ > 0 || isRunning_ == false; });
+                    if (isRunning_ == false) break;
+
+                    // push() keeps fewer than done_.size() jobs undelivered, so the slot of this id is free
+                    auto & entry = jobAt(0);
+                    id = entry.id;
+                    cur = &done_[id % done_.size()];
+                    cur->dropped = entry.dropped;
+                    cur->job = std::move(entry.job);
+                    jobsHead_ = jobsHead_ + 1 == jobs_.size() ? 0 : jobsHead_ + 1;
+                    --nJobs_;
+                    dropped = cur->dropped;
+                    if (dropped == false) --nQueued_;
+                    ++nInProgress_;
+                }
+                cvSpace_.notify_one();
+
+                if (dropped == false) {
+                    process_(cur->job, cur->result);
+                }
+
+                int nDelivered = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mutexDeliver_);
+                    cur->ready = true;
+
+                    // deliver everything that is ready, in order, and release the jobs
+                    while (true) {
+                        auto & next = done_[nextDelivered_ % done_.size()];
+                        if (next.ready == false) break;
+
+                        if (next.dropped == false) {
+                            deliver_(next.job, next.result);
+                        }
+                        next.job = Job();
+                        next.ready = false;
+                        ++nextDelivered_;
+                        ++nDelivered;
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (dropped == false) ++nProcessed_;
+                    --nInProgress_;
+                    nUndelivered_ -= nDelivered;
+                }
+                if (nDelivered > 0) cvSpace_.notify_all();
+            }
+        }
+
+        Entry & jobAt(size_t i) {
+            i += jobsHead_;
+            return jobs_[i < jobs_.size() ? i : i - jobs_.size()];
+        }
+
+        // the waiting jobs, dropped ones included, are undelivered, so they always fit in the ring
+        void pushJob(Entry && entry) {
+            jobAt(nJobs_++) = std::move(entry);
+        }
+
+        int capacity_ = 0;
+        Process process_;
+        Deliver deliver_;
+        Init init_;
+
+        mutable std::mutex mutex_;
+        std::condition_variable cvJobs_;
+        std::condition_variable cvSpace_;
+        std::vector<Entry> jobs_;   // ring of nJobs_ entries starting at jobsHead_
+        size_t jobsHead_ = 0;
+        size_t nJobs_ = 0;
+        int nQueued_ = 0;
+        bool isRunning_ = false;
+        int nInProgress_ = 0;
+        int nUndelivered_ = 0;
+
+        uint64_t nextId_ = 0;
+        uint64_t nPushed_ = 0;
+        uint64_t nProcessed_ = 0;
+        uint64_t nDropped_ = 0;
+
+        std::mutex mutexDeliver_;
+        std::vector<Done> done_;    // ring of result slots
+        uint64_t nextDelivered_ = 0;
+
+        std::vector<std::thread> workers_;
+};